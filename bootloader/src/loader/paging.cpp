@@ -12,6 +12,10 @@
 #define PAGING_VLOC         0xFFFFFF0000000000
 #define PAGING_LOOP_MASK    ((PAGING_VLOC >> 39) & 0x1FF)
 
+// PML4 entries of the kernel half copied into every address space, the recursive entries excluded
+#define SHARED_PML4_START   0x100
+#define SHARED_PML4_LIMIT   (PAGING_LOOP_MASK - 1)
+
 typedef struct {
     size_t size;
     size_t desc_size;
@@ -59,6 +63,11 @@ namespace {
         };
     }
 
+    // shared kernel mappings are global, so they survive CR3 loads once the kernel enables CR4.PGE
+    static inline uint64_t global_bit(const RawVirtualAddress* rva) {
+        return (rva->PML4_offset >= SHARED_PML4_START && rva->PML4_offset < SHARED_PML4_LIMIT) ? PTE_GLOBAL : 0;
+    }
+
     static inline SimpleMMAP getSimpleMMAP(void) {
         SimpleMMAP smmap = {
             .size = 0,
@@ -169,6 +178,7 @@ namespace {
             PTE* pte = reinterpret_cast<PTE*>(pde->raw & PDE_ADDRESS) + remap_rva->PT_offset;
 
             *pte = make_PTE(physical_start + i * PAGE_SIZE, PI, execute_disable);
+            pte->raw |= global_bit(remap_rva);
 
             fullUpdateRemapRVA(remap_rva);
         }
@@ -242,6 +252,7 @@ namespace {
         pte->raw |= (PAT_enable == 1 && PI->PAT_support != 0) ? PTE_PAT : 0;
         pte->raw |= PWT_enable ? PTE_PWT : 0;
         pte->raw |= PCD_enable ? PTE_PCD : 0;
+        pte->raw |= global_bit(remap_rva);
 
         *current_source += PAGE_SIZE;
 
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace CPU {
+	inline constexpr uint64_t MAX_CPUS = 32;
+
+	// index of the processor running the caller, the bootstrap processor is always 0
+	inline uint64_t currentIndex() {
+		// application processors are not started yet
+		return 0;
+	}
+
+	// time stamp counter, ordered after the preceding loads
+	inline uint64_t readTimestamp() {
+		uint32_t low, high;
+		__asm__ volatile("lfence; rdtsc" : "=a"(low), "=d"(high) :: "memory");
+		return (static_cast<uint64_t>(high) << 32) | low;
+	}
+}
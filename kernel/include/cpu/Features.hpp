@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+namespace CPU {
+	// one bit of the registry per feature
+	enum class Feature : uint64_t {
+		PAT,
+		PGE,
+		PDPE1GB,
+		NX,
+		PCID,
+		INVPCID,
+		SMEP,
+		SMAP,
+		ERMS,			// enhanced rep movsb/stosb
+		FSRM,			// fast short rep movsb
+		XSAVE,
+		XSAVEOPT,
+		XSAVEC,
+		XSAVES,
+		X2APIC,
+		RDTSCP,
+		INVARIANT_TSC,
+		COUNT
+	};
+
+	static_assert(static_cast<uint64_t>(Feature::COUNT) <= 64, "The feature registry is a single qword");
+
+	// architectural maximum until SetupFeatures has run
+	extern uint64_t physicalAddressMask;
+
+	// fills the registry from CPUID, must be the first thing the kernel does
+	void SetupFeatures();
+	bool HasFeature(Feature feature);
+	uint8_t QueryPhysicalAddressBits();
+	uint8_t QueryLinearAddressBits();
+
+	// patches every static branch to match the registry, must run before interrupts are enabled
+	void ApplyAlternatives();
+
+	// Static branch, compiled as a 5 bytes jump to the false path.
+	// ApplyAlternatives turns the jump into a NOP when the feature is present, so hot paths neither call nor test anything.
+	template<Feature feature>
+	__attribute__((always_inline)) inline bool StaticHasFeature() {
+		__asm__ goto(
+			"1:\n\t"
+			".byte 0xE9\n\t"
+			".long %l[absent] - 2f\n"
+			"2:\n\t"
+			".pushsection .cpu_alternatives, \"a\"\n\t"
+			".balign 8\n\t"
+			".quad 1b\n\t"
+			".quad %c0\n\t"
+			".popsection"
+			:: "i"(static_cast<uint64_t>(feature)) :: absent
+		);
+		return true;
+	absent:
+		return false;
+	}
+}
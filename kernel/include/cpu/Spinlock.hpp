@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+namespace CPU {
+	inline constexpr uint64_t RFLAGS_IF = 0x200;
+
+	// ticket lock, waiting CPUs are served in arrival order
+	struct Spinlock {
+		uint32_t next = 0;
+		uint32_t owner = 0;
+	};
+
+	inline void acquire(Spinlock* lock) {
+		const uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+
+		while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+			__asm__ volatile("pause" ::: "memory");
+		}
+	}
+
+	inline void release(Spinlock* lock) {
+		__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+	}
+
+	// returns the previous RFLAGS
+	inline uint64_t disableInterrupts() {
+		uint64_t flags;
+		__asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+		return flags;
+	}
+
+	inline void restoreInterrupts(uint64_t flags) {
+		if ((flags & RFLAGS_IF) != 0) {
+			__asm__ volatile("sti" ::: "memory");
+		}
+	}
+
+	// interrupts stay disabled for the lifetime of the guard, which is enough to own the per-CPU data of the current CPU
+	struct InterruptGuard {
+		const uint64_t flags;
+
+		InterruptGuard() : flags(disableInterrupts()) {}
+		~InterruptGuard() { restoreInterrupts(flags); }
+
+		InterruptGuard(const InterruptGuard&) = delete;
+		InterruptGuard& operator=(const InterruptGuard&) = delete;
+	};
+
+	// holds a spinlock with interrupts disabled, so an interrupt handler of the same CPU cannot deadlock on it
+	struct LockGuard {
+		InterruptGuard interrupts;
+		Spinlock* const lock;
+
+		explicit LockGuard(Spinlock* _lock) : lock(_lock) { acquire(lock); }
+		~LockGuard() { release(lock); }
+
+		LockGuard(const LockGuard&) = delete;
+		LockGuard& operator=(const LockGuard&) = delete;
+	};
+}
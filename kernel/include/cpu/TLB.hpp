@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+
+#include <mm/VirtualMemoryLayout.hpp>
+
+namespace CPU {
+	// invalidations a batch can hold, past this it always ends with a full flush
+	inline constexpr uint64_t TLB_BATCH_CAPACITY = 64;
+
+	// PML4 entries 256 to 508 are shared by every address space, their leaf mappings are global
+	inline constexpr uint64_t SHARED_ADDRESS_SPACE		= VirtualMemoryLayout::KERNEL_IMAGE;
+	inline constexpr uint64_t SHARED_ADDRESS_SPACE_END	= VirtualMemoryLayout::SECONDARY_RECURSIVE_PML4;
+
+	inline constexpr bool IsSharedAddress(uint64_t address) {
+		return address >= SHARED_ADDRESS_SPACE && address < SHARED_ADDRESS_SPACE_END;
+	}
+
+	struct TLBStatistics {
+		uint64_t pageFlushes;		// invlpg issued by committed batches
+		uint64_t fullFlushes;		// batches committed with a full flush
+		uint64_t batches;			// committed batches that had anything to invalidate
+	};
+
+	// invalidations collected during an operation on the page tables, issued all at once by CommitTLBBatch
+	struct TLBBatch {
+		uint64_t addresses[TLB_BATCH_CAPACITY];
+		uint64_t count = 0;
+		bool overflow = false;
+		bool global = false;		// a full flush has to drop global translations as well
+		bool shared = false;		// shared paging structures changed, other address spaces may have cached them
+	};
+
+	// invalidates the translation of a page, invlpg drops it for every PCID when it is global
+	inline void QueueTLBInvalidation(TLBBatch* batch, uint64_t address) {
+		if (batch->count < TLB_BATCH_CAPACITY) {
+			batch->addresses[batch->count] = address;
+		}
+		else {
+			batch->overflow = true;
+		}
+		if (IsSharedAddress(address)) {
+			batch->global = true;
+		}
+		++batch->count;
+	}
+
+	// same, for an address whose paging structures were replaced or freed
+	inline void QueueTLBTableInvalidation(TLBBatch* batch, uint64_t address) {
+		QueueTLBInvalidation(batch, address);
+		if (IsSharedAddress(address)) {
+			batch->shared = true;
+		}
+	}
+
+	inline void FlushTLBPage(uint64_t address) {
+		__asm__ volatile("invlpg (%0)" :: "r"(address) : "memory");
+	}
+
+	// drops every non-global translation, of every address space when INVPCID is available
+	void FlushTLB();
+	// drops every translation, global ones included, for the rare changes to the shared kernel mappings
+	void FlushGlobalTLB();
+
+	// one invlpg per page up to the threshold, a full flush above it, the batch is empty afterwards
+	void CommitTLBBatch(TLBBatch* batch);
+
+	// enables write protection, and global pages and PCIDs when the CPU supports them, must run before the first task switch
+	void SetupAddressSpaces();
+	bool PCIDEnabled();
+
+	// Returns the CR3 value switching to the address space rooted at root.
+	// addressSpaceID belongs to the address space, starts at 0 and is updated when its PCID has to be reassigned.
+	uint64_t SwitchAddressSpace(void* root, uint64_t* addressSpaceID);
+
+	// clamped to TLB_BATCH_CAPACITY
+	void SetTLBFlushThreshold(uint64_t pages);
+	TLBStatistics QueryTLBStatistics();
+}
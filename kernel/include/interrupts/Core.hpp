@@ -1,7 +1,17 @@
 #pragma once
 
+#include <cstdint>
+
 namespace Interrupts {
 	namespace Core {
+		// most on-demand pages a single page fault can populate
+		inline constexpr uint64_t FAULT_AROUND_LIMIT = 64;
+
+		// A demand fault populates a window of on-demand pages starting at the faulting one, in the limit of its page table.
+		// The window starts at minimumPages and doubles up to maximumPages while the faults of a region stay sequential.
+		// Returns false if the bounds are not 1 <= minimumPages <= maximumPages <= FAULT_AROUND_LIMIT.
+		bool SetFaultAroundWindow(uint64_t minimumPages, uint64_t maximumPages);
+
 		extern "C" {
 			extern void int_divide_error(void);
 			extern void int_debug_trap(void);
@@ -18,5 +18,7 @@ namespace Interrupts {
         };
 
         extern "C" void swFramebufferManager(void);
+        extern "C" void swIdleManager(void);
+        extern "C" void swExitManager(void);
     }
 }
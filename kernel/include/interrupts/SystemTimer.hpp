@@ -5,5 +5,8 @@ namespace Interrupts {
 		extern "C" {
 			extern void PIT_IRQ0_handler(void);
 		}
+
+		// called on every tick before the task switch, with interrupts disabled, nullptr removes it
+		void set_tick_hook(void (*hook)(void));
 	}
 }
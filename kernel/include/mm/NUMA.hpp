@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+namespace NUMA {
+	// proximity domains beyond this are folded into the last node
+	inline constexpr uint64_t MAX_NODES = 8;
+
+	// distances used when the firmware does not provide a SLIT
+	inline constexpr uint8_t LOCAL_DISTANCE = 10;
+	inline constexpr uint8_t REMOTE_DISTANCE = 20;
+
+	enum class StatusCode {
+		SUCCESS,
+		NOT_SUPPORTED,		// no SRAT, the machine is treated as a single node
+		INVALID_TABLE
+	};
+
+	// parses SRAT and SLIT, requires the VMM to be set up
+	StatusCode Setup();
+
+	uint64_t QueryNodeCount();
+	uint64_t QueryCurrentNode();
+
+	// returns the node of a physical address, end receives the first address that may belong to another node
+	uint64_t QueryNode(uint64_t physicalAddress, uint64_t* end);
+	uint8_t QueryDistance(uint64_t from, uint64_t to);
+
+	// every node sorted by increasing distance from node, starting with node itself
+	const uint8_t* QueryFallbackOrder(uint64_t node);
+}
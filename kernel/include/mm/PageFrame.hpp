@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+namespace PhysicalMemory {
+	// One entry per physical frame, stored in the PHYSICAL_MEMORY_MAP zone and indexed by frame number.
+	// While a block is free, only its first frame carries FRAME_FREE and the order of the block.
+	struct PageFrame {
+		uint32_t next;		// free list links while free, LRU links while allocated
+		uint32_t prev;
+		uint32_t refcount;
+		uint16_t flags;
+		uint8_t order;
+		uint8_t node;
+	};
+
+	static_assert(sizeof(PageFrame) == 16, "PageFrame must stay 16 bytes large");
+
+	inline constexpr uint32_t NO_FRAME				= 0xFFFFFFFF;
+
+	inline constexpr uint16_t FRAME_USABLE			= 0x0001;	// the frame is managed by the buddy allocator
+	inline constexpr uint16_t FRAME_FREE			= 0x0002;	// the frame is the head of a free block
+	inline constexpr uint16_t FRAME_CACHED			= 0x0004;	// the frame sits in a magazine of the frame caches
+	inline constexpr uint16_t FRAME_RESERVED		= 0x0008;	// the frame is the head of a block kept in a large page reserve
+	inline constexpr uint16_t FRAME_PINNED			= 0x0010;	// the frame must stay resident (never reclaimed or swapped)
+	inline constexpr uint16_t FRAME_PAGE_TABLE		= 0x0020;	// the frame holds a paging structure
+	inline constexpr uint16_t FRAME_DMA				= 0x0040;	// the frame belongs to the legacy DMA zone
+	inline constexpr uint16_t FRAME_LRU				= 0x0080;	// the frame is linked in the LRU list of its node
+
+	// flags owned by the users of a frame, the others are maintained by the PMM
+	inline constexpr uint16_t FRAME_USER_FLAGS		= FRAME_PINNED | FRAME_PAGE_TABLE;
+}
@@ -3,11 +3,28 @@
 #include <cstddef>
 #include <cstdint>
 
+#include <cpu/Features.hpp>
+#include <mm/PageFrame.hpp>
+
 namespace PhysicalMemory {
 	inline constexpr uint64_t FRAME_SIZE = 4096;
+	// largest block handed out by the buddy allocator: 2^MAX_ORDER frames (1 GB)
+	inline constexpr uint64_t MAX_ORDER = 18;
+
+	// naturally aligned blocks matching the PDE_PAGE_SIZE and PDPTE_PAGE_SIZE mappings
+	inline constexpr uint64_t LARGE_PAGE_ORDER	= 9;
+	inline constexpr uint64_t HUGE_PAGE_ORDER	= 18;
+	inline constexpr uint64_t LARGE_PAGE_SIZE	= FRAME_SIZE << LARGE_PAGE_ORDER;
+	inline constexpr uint64_t HUGE_PAGE_SIZE	= FRAME_SIZE << HUGE_PAGE_ORDER;
+
+	// keeps the frame address bits supported by the CPU
+	inline uint64_t FilterAddress(uint64_t address) {
+		return address & CPU::physicalAddressMask;
+	}
 
-	uint64_t FilterAddress(uint64_t address);
-	uint64_t FilterAddress(void* address);
+	inline uint64_t FilterAddress(void* address) {
+		return FilterAddress(reinterpret_cast<uint64_t>(address));
+	}
 
 	enum class StatusCode {
 		SUCCESS,
@@ -17,14 +34,96 @@ namespace PhysicalMemory {
 		ALLOCATED
 	};
 
+	struct FrameCacheStatistics {
+		uint64_t allocationHits;	// allocations served by the magazines of a CPU
+		uint64_t allocationMisses;	// allocations that had to go through the depot
+		uint64_t freeHits;
+		uint64_t freeMisses;
+		uint64_t depotRefills;		// magazines filled from the buddy allocator
+		uint64_t depotDrains;		// magazines given back to the buddy allocator
+		uint64_t cachedFrames;
+	};
+
+	// usable RAM as reported by the firmware, in bytes
+	struct MemoryRange {
+		uint64_t start;
+		uint64_t end;
+	};
+
+	// usable memory past this many ranges is left out of QueryMemoryRanges and never handed out
+	inline constexpr uint64_t MAX_MEMORY_RANGES = 64;
+
+	struct LargePageStatistics {
+		uint64_t reservedLargePages;
+		uint64_t reservedHugePages;
+		uint64_t reserveHits;		// allocations the free lists could not serve without the reserves
+		uint64_t reserveTrims;		// reserved blocks broken up because single frames ran out
+	};
+
 	StatusCode Setup();
+	// moves the free memory into per-node zones, must be called after NUMA::Setup
+	StatusCode SetupNodes();
 
 	uint64_t QueryMemoryUsage();
+	uint64_t QueryMemoryUsage(uint64_t node);
 	StatusCode QueryDMAAddress(uint64_t address);
+	FrameCacheStatistics QueryFrameCacheStatistics();
+	LargePageStatistics QueryLargePageStatistics();
+	// sorted and merged, includes the frames the PMM used for itself and the DMA zone
+	uint64_t QueryMemoryRanges(const MemoryRange** ranges);
+
+	// watermarks are expressed in frames held by the depot
+	StatusCode SetFrameCacheWatermarks(uint64_t lowWatermark, uint64_t highWatermark);
+
+	// number of 2 MB and 1 GB blocks each node keeps in reserve, in the limit of what the node can spare
+	StatusCode SetLargePageReserve(uint64_t largePages, uint64_t hugePages);
+
+	// Zeroes up to count frames into the zero pool, returns the number of frames added.
+	// Also tops up the large block reserves that single frame allocations had to break up.
+	uint64_t RefillZeroPool(uint64_t count);
 
 	void* AllocateDMA(uint64_t pages);
+	// alignment and boundary are in bytes and must be powers of two, a boundary of 0 means the run may cross any boundary
+	void* AllocateDMA(uint64_t pages, uint64_t alignment, uint64_t boundary);
+	// allocations come from the node of the current CPU first, then from the other nodes by increasing distance
 	void* Allocate();
+	void* Allocate(uint64_t node);
+	// takes a frame from the zero pool, or zeroes one synchronously when the pool is empty
+	void* AllocateZeroed();
+	// zeroed frame flagged as FRAME_PAGE_TABLE
+	void* AllocatePageTable();
+	void* AllocatePages(uint64_t order);
+	void* AllocateLargePage();
+	void* AllocateHugePage();
+
+	// fills batch with count single frames taken in as few trips through the allocator as possible,
+	// either every frame is allocated or none is
+	StatusCode AllocateBatch(uint64_t count, void** batch);
+	StatusCode AllocateZeroedBatch(uint64_t count, void** batch);
+	StatusCode AllocatePageTableBatch(uint64_t count, void** batch);
 
 	StatusCode FreeDMA(void* ptr, uint64_t pages);
 	StatusCode Free(void* ptr);
+	// INVALID_PARAMETER unless ptr starts a block allocated with this very order, Free is FreePages with order 0
+	StatusCode FreePages(void* ptr, uint64_t order);
+	StatusCode FreeLargePage(void* ptr);
+	StatusCode FreeHugePage(void* ptr);
+	// turns an allocated block of 2^order frames into as many single frames that can be freed one by one,
+	// shared blocks cannot be split
+	StatusCode SplitPages(void* ptr, uint64_t order);
+	// frees every frame of the batch, INVALID_PARAMETER if any of them was rejected
+	StatusCode FreeBatch(uint64_t count, void* const* batch);
+
+	// page frame database, covers the DMA zone and every frame of the buddy allocator
+	const PageFrame* QueryPageFrame(const void* ptr);
+
+	// adds a reference to an allocated frame, Free only releases it with the last reference
+	StatusCode Share(void* ptr);
+	// only FRAME_USER_FLAGS can be changed
+	StatusCode UpdateFrameFlags(void* ptr, uint16_t set, uint16_t clear);
+
+	// moves an allocated frame to the head of the LRU list of its node
+	StatusCode TouchFrame(void* ptr);
+	StatusCode UntrackFrame(void* ptr);
+	void* QueryLeastRecentlyUsed(uint64_t node);
 }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Swap {
+	enum class StatusCode {
+		SUCCESS,
+		OUT_OF_MEMORY,
+		INVALID_PARAMETER,
+		NO_DEVICE,
+		DEVICE_ERROR
+	};
+
+	// backing store of the swapped out pages, addressed in FRAME_SIZE blocks
+	struct Device {
+		uint64_t blocks;
+		void* data;		// owned by the backend
+		StatusCode (*read)(Device* device, uint64_t block, void* page);
+		StatusCode (*write)(Device* device, uint64_t block, const void* page);
+		// optional, called when a slot is released so the backend can drop its copy
+		void (*discard)(Device* device, uint64_t block);
+	};
+
+	// Slot n lives in block n of the device. Slot 0 is never handed out, so a swap entry is never an empty entry.
+	// Slots are reference counted like frames: a cloned address space shares the slots of its parent.
+
+	// the device can only be replaced while no slot is in use, OUT_OF_MEMORY when its slot map cannot be backed in full
+	StatusCode AttachDevice(Device* device);
+	StatusCode DetachDevice();
+
+	// device backed by kernel heap pages, for testing the swap paths without a disk
+	Device* CreateRamDisk(uint64_t pages);
+
+	// the compression ratio is originalBytes / compressedBytes
+	struct CompressedStatistics {
+		uint64_t storedPages;			// same-filled and incompressible pages included
+		uint64_t sameFilledPages;		// kept as their fill value, without any memory
+		uint64_t incompressiblePages;	// kept as is in a frame of their own
+		uint64_t originalBytes;			// of the compressed pages only
+		uint64_t compressedBytes;
+		uint64_t usedFrames;			// frames holding compressed objects and incompressible pages
+		uint64_t reads;
+		uint64_t readCycles;			// TSC cycles spent producing the pages read back
+		uint64_t maxReadCycles;
+	};
+
+	// Device keeping the pages compressed in RAM, with an LZ4 style compressor.
+	// Apart from the block table and a few spare frames, taken at creation so pages can still be stored once Allocate fails,
+	// frames are only taken for what is stored, small objects share frames by size class.
+	Device* CreateCompressedRamDisk(uint64_t pages);
+	// INVALID_PARAMETER if the device was not created by CreateCompressedRamDisk
+	StatusCode QueryCompressedStatistics(const Device* device, CompressedStatistics* statistics);
+
+	uint64_t QueryFreeSlots();
+
+	// 0 when there is no device or it is full
+	uint64_t AllocateSlot();
+	StatusCode ShareSlot(uint64_t slot);
+	// the slot is free again with the last reference
+	StatusCode ReleaseSlot(uint64_t slot);
+
+	StatusCode WriteSlot(uint64_t slot, const void* page);
+	StatusCode ReadSlot(uint64_t slot, void* page);
+}
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <type_traits>
 
+#include <cpu/Features.hpp>
 #include <mm/PhysicalMemory.hpp>
 #include <mm/VirtualMemoryLayout.hpp>
 
@@ -59,6 +60,9 @@ namespace VirtualMemory {
 	inline constexpr uint64_t PDPTE_ADDRESS		= 0x000FFFFFFFFFF000;
 	inline constexpr uint64_t PDPTE_XD			= 0x8000000000000000;
 
+	// only valid when PDPTE_PAGE_SIZE is set (1 GB page)
+	inline constexpr uint64_t PDPTE_HUGE_ADDRESS	= 0x000FFFFFC0000000;
+
 	inline constexpr uint64_t PDE_PRESENT		= 0x0000000000000001;
 	inline constexpr uint64_t PDE_READWRITE		= 0x0000000000000002;
 	inline constexpr uint64_t PDE_USERMODE		= 0x0000000000000004;
@@ -72,6 +76,10 @@ namespace VirtualMemory {
 	inline constexpr uint64_t PDE_PK			= 0x7800000000000000;
 	inline constexpr uint64_t PDE_XD			= 0x8000000000000000;
 
+	// only valid when PDE_PAGE_SIZE is set (2 MB page)
+	inline constexpr uint64_t PDE_LARGE_PAT		= 0x0000000000001000;
+	inline constexpr uint64_t PDE_LARGE_ADDRESS	= 0x000FFFFFFFE00000;
+
 	inline constexpr uint64_t PTE_PRESENT		= 0x0000000000000001;
 	inline constexpr uint64_t PTE_READWRITE		= 0x0000000000000002;
 	inline constexpr uint64_t PTE_USERMODE		= 0x0000000000000004;
@@ -85,9 +93,14 @@ namespace VirtualMemory {
 	inline constexpr uint64_t PTE_PK			= 0x7800000000000000;
 	inline constexpr uint64_t PTE_XD			= 0x8000000000000000;
 
+	// bits ProtectRange can change, same positions in the PTE and the PDE
+	inline constexpr uint64_t PROTECTION_FLAGS	= PTE_READWRITE | PTE_USERMODE | PTE_XD;
+
 	// Custom values (when the page is present and valid)
 
 	inline constexpr uint64_t PTE_LOCK			= 0x0000000000000200;
+	// the mapping is writable, but the frame is shared: PTE_READWRITE stays clear and the first write gets a private frame
+	inline constexpr uint64_t PTE_COW			= 0x0000000000000400;
 
 	// Masks used for non-present entries (if the page entry is 0, it is invalid)
 
@@ -105,6 +118,16 @@ namespace VirtualMemory {
 	inline constexpr uint64_t NP_ON_DEMAND	= 0x0000000000000800;
 	// Index of the page in the swap file, this field is ignored if NP_ON_DEMAND is set
 	inline constexpr uint64_t NP_INDEX		= 0xFFFFFFFFFFFFE000;
+	inline constexpr uint64_t NP_INDEX_SHIFT	= 13;
+
+	// a swapped out page: neither present nor on demand, its swap slot is in NP_INDEX
+	inline constexpr bool isSwapEntry(uint64_t entry) {
+		return entry != 0 && (entry & (NP_PRESENT | NP_ON_DEMAND)) == 0;
+	}
+
+	inline constexpr uint64_t swapSlot(uint64_t entry) {
+		return (entry & NP_INDEX) >> NP_INDEX_SHIFT;
+	}
 
 	struct PTE {
 		uint64_t raw;
@@ -136,6 +159,13 @@ namespace VirtualMemory {
 		INVALID_PARAMETER
 	};
 
+	// how the frames of a kernel heap range are provided
+	enum class HeapBacking {
+		LARGE_PAGES,	// a large page for every whole 2 MB chunk of the range, frames on first touch elsewhere
+		ON_DEMAND,		// frames on first touch only, for ranges which are sparse on purpose
+		POPULATED		// every page is backed right away, for memory touched where a page fault cannot get a frame
+	};
+
 	template<typename T> concept AddressType = std::is_same_v<T, uint64_t> || std::is_pointer<T>::value;
 	template<AddressType T> constexpr VirtualAddress parseVirtualAddress(T address) {
 		if constexpr (std::is_same_v<T, uint64_t>) {
@@ -208,9 +238,15 @@ namespace VirtualMemory {
 
 	template<AddressType T> void zeroPage(T address) {
 		if constexpr (std::is_same_v<T, uint64_t>) {
-			uint64_t* pagePtr = reinterpret_cast<uint64_t*>(address);
-			for (size_t qword = 0; qword < PhysicalMemory::FRAME_SIZE / sizeof(uint64_t); ++qword) {
-				*(pagePtr + qword) = 0;
+			uint64_t destination = address;
+
+			if (CPU::StaticHasFeature<CPU::Feature::ERMS>()) {
+				uint64_t count = PhysicalMemory::FRAME_SIZE;
+				__asm__ volatile("rep stosb" : "+D"(destination), "+c"(count) : "a"(0) : "memory");
+			}
+			else {
+				uint64_t count = PhysicalMemory::FRAME_SIZE / sizeof(uint64_t);
+				__asm__ volatile("rep stosq" : "+D"(destination), "+c"(count) : "a"(0) : "memory");
 			}
 		}
 		else {
@@ -218,13 +254,81 @@ namespace VirtualMemory {
 		}
 	};
 
+	// same as zeroPage, but the non-temporal stores leave the cache contents alone
+	template<AddressType T> void zeroPageNonTemporal(T address) {
+		if constexpr (std::is_same_v<T, uint64_t>) {
+			for (size_t offset = 0; offset < PhysicalMemory::FRAME_SIZE; offset += 4 * sizeof(uint64_t)) {
+				__asm__ volatile(
+					"movnti %1, 0(%0)\n\t"
+					"movnti %1, 8(%0)\n\t"
+					"movnti %1, 16(%0)\n\t"
+					"movnti %1, 24(%0)"
+					:: "r"(address + offset), "r"(static_cast<uint64_t>(0)) : "memory"
+				);
+			}
+
+			__asm__ volatile("sfence" ::: "memory");
+		}
+		else {
+			zeroPageNonTemporal(reinterpret_cast<uint64_t>(address));
+		}
+	};
+
+	inline void copyPage(void* destination, const void* source) {
+		if (CPU::StaticHasFeature<CPU::Feature::ERMS>()) {
+			uint64_t count = PhysicalMemory::FRAME_SIZE;
+			__asm__ volatile("rep movsb" : "+D"(destination), "+S"(source), "+c"(count) :: "memory");
+		}
+		else {
+			uint64_t count = PhysicalMemory::FRAME_SIZE / sizeof(uint64_t);
+			__asm__ volatile("rep movsq" : "+D"(destination), "+S"(source), "+c"(count) :: "memory");
+		}
+	}
+
+	// Linear view of the usable physical memory, built by Setup with the largest pages the alignment allows.
+	// Only the frames reported by PhysicalMemory::QueryMemoryRanges are mapped.
+	inline void* PhysToVirt(uint64_t physicalAddress) {
+		return reinterpret_cast<void*>(VirtualMemoryLayout::DIRECT_MAP + physicalAddress);
+	}
+
+	inline void* PhysToVirt(const void* physicalAddress) {
+		return PhysToVirt(reinterpret_cast<uint64_t>(physicalAddress));
+	}
+
+	// physical address behind a mapping of the current address space, 0 when the address is not mapped
+	uint64_t VirtToPhys(const void* address);
+
 	void UpdateSecondaryRecursiveMapping(void* newAddress);
 
+	// Pinned zeroed frame mapped read-only by the read faults on on-demand pages, every mapping holds a reference.
+	// Only valid once Setup has run.
+	void* QueryZeroPage();
+
 	StatusCode Setup();
 	StatusCode SetupTask(void* CR3);
 
+	// Shares the user memory allocations of the current task with the task set up by SetupTask at CR3.
+	// Writable pages become read-only copy-on-write pages in both tasks, only the allocator ranges are copied.
+	StatusCode CloneUserMemory(void* CR3);
+	// Drops every user memory allocation of the current task, which is what a clone does before loading a new image.
+	// Frames still shared with another task are only released with their last mapping, nothing gets copied.
+	StatusCode ReleaseUserMemory();
+
+	// Gives back every frame, swap slot and paging structure of the address space rooted at CR3, the root included.
+	// Only the user half and the process data are walked: the kernel half, the DMA zone frames and tables and the task image are shared.
+	// The address space must not be loaded on any CPU anymore. It is gone even on failure, which means a walk of the user memory
+	// stopped early and the frames past that point were left behind, as with a partial clone.
+	StatusCode DestroyAddressSpace(void* CR3);
+
+	// Swaps out up to pages of the user memory of the current task, returns the number of frames given back.
+	// A clock scan picks them: accessed pages get a second chance, shared and pinned frames are left alone.
+	uint64_t ReclaimUserPages(uint64_t pages);
+
 	void* AllocateDMA(uint64_t pages);
+	void* AllocateDMA(uint64_t pages, uint64_t alignment, uint64_t boundary);
+	// backed with HeapBacking::LARGE_PAGES
 	void* AllocateKernelHeap(uint64_t pages);
+	void* AllocateKernelHeap(uint64_t pages, HeapBacking backing);
 	void* AllocateUserPages(uint64_t pages);
 	void* AllocateUserPagesAt(uint64_t pages, void* ptr);
 
@@ -232,9 +336,24 @@ namespace VirtualMemory {
 	StatusCode FreeKernelHeap(void* ptr, uint64_t pages);
 	StatusCode FreeUserPages(void* ptr, uint64_t pages);
 
+	// maps pages consecutive frames starting at physicalAddress, attributes are PTE bits (PTE_PRESENT is implied)
+	StatusCode MapRange(void* address, void* physicalAddress, uint64_t pages, uint64_t attributes);
+	// clears the mappings of the range, the frames behind them are left to the caller
+	StatusCode UnmapRange(void* address, uint64_t pages);
+	// replaces the PROTECTION_FLAGS bits of every mapping of the range
+	StatusCode ProtectRange(void* address, uint64_t pages, uint64_t protection);
+
 	void* MapGeneralPage(void* page);
 	StatusCode UnmapGeneralPage(void* vpage);
 
+	// fixed temporary mapping slots of every CPU, at the start of GENERAL_PURPOSE_MAPPINGS
+	inline constexpr uint64_t LOCAL_MAPPING_SLOTS = 8;
+
+	// Maps a page in the next fixed slot of the current CPU, without searching or flushing other CPUs.
+	// Interrupts must stay disabled until the page is unmapped, and slots are released in reverse order.
+	void* MapLocalPage(void* page);
+	StatusCode UnmapLocalPage(void* vpage);
+
 	void* MapPCIConfiguration(void* configurationAddress);
 	StatusCode UnmapPCIConfiguration(void* vconfigurationAddress);
 }
@@ -25,6 +25,8 @@ namespace VirtualMemoryLayout {
 
 	inline constexpr uint64_t GENERAL_PURPOSE_MAPPINGS	= 0xFFFF8001BA800000;
 
+	inline constexpr uint64_t DIRECT_MAP				= 0xFFFF880000000000;
+
 	inline constexpr uint64_t SECONDARY_RECURSIVE_PML4	= 0xFFFFFE8000000000;
 
 	inline constexpr uint64_t RECURSIVE_MEMORY_MAPPING	= 0xFFFFFF0000000000;
@@ -38,7 +40,7 @@ namespace VirtualMemoryLayout {
 	inline constexpr uint64_t MAIN_CORE_DUMP 			= 0xFFFFFF8001000000;
 	inline constexpr uint64_t SECONDARY_CORE_DUMP 		= 0xFFFFFF8001008000;
 	inline constexpr uint64_t USER_MEMORY_CONTEXT		= 0xFFFFFF8001100000;
-	inline constexpr uint64_t USER_MEMORY_MANAGEMENT	= 0xFFFFFF8001100020;
+	inline constexpr uint64_t USER_MEMORY_MANAGEMENT	= 0xFFFFFF8001100040;
 
 	/// Sizes of the different zones
 
@@ -64,6 +66,8 @@ namespace VirtualMemoryLayout {
 
 	inline constexpr uint64_t GENERAL_PURPOSE_MAPPINGS_SIZE = 0x0000000005800000;
 
+	inline constexpr uint64_t DIRECT_MAP_SIZE				= 0x0000400000000000;
+
 	inline constexpr uint64_t RECURSIVE_MEMORY_MAPPING_SIZE	= 0x0000008000000000;
 
 	inline constexpr uint64_t RUNTIME_PROCESS_DATA_SIZE		= 0x0000008000000000;
@@ -7,4 +7,18 @@
 namespace Multitasking {
 	Task* setupKernelTask(void* entryPointPtr);
 	StatusCode loadKernelTask(void* entryPointPtr);
+
+	// The new task shares the user memory allocations of the current one, copy-on-write, and starts at entryPointPtr on a fresh stack.
+	// A clone which loads another image releases the shared memory with VirtualMemory::ReleaseUserMemory, nothing is copied in between.
+	Task* cloneKernelTask(void* entryPointPtr);
+	StatusCode spawnKernelTask(void* entryPointPtr);
+
+	// Frees a task which exited along with its whole address space, the task must be out of the task list and not running anywhere.
+	StatusCode destroyKernelTask(Task* task);
+
+	// Takes the current task out of the task list and returns the task to switch to, nullptr if it is the last one, which cannot exit.
+	// Its address space is still loaded until the switch: the task is only destroyed later by reapKernelTask, from another task.
+	Task* exitKernelTask();
+	// destroys one task which exited, returns false when there was none left
+	bool reapKernelTask();
 }
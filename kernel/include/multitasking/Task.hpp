@@ -14,12 +14,18 @@ namespace Multitasking {
 		Task* prev = nullptr;
 		Task* next = nullptr;
 		void* CR3 = nullptr;
+		uint64_t AddressSpaceID = 0;	// PCID tagging the TLB entries of the task, managed by CPU::SwitchAddressSpace
 		void* InstructionPointer = nullptr;
 		void* KernelStackTop = nullptr;
 		uint64_t TaskID = 0;
 
 		static uint64_t taskCount();
+		// TaskID of the next task added, IDs are not reused once a task is removed
+		static uint64_t nextTaskID();
+		static Task* currentTask();
 		static StatusCode addTask(Task* task);
+		// unlinks a task from the task list, the current task cannot be removed: switch away from it first
+		static StatusCode removeTask(Task* task);
 		static Task* taskSwitch();
 	};
 }
@@ -0,0 +1,125 @@
+#include <cpuid.h>
+#include <cstddef>
+#include <cstdint>
+
+#include <cpu/Features.hpp>
+
+extern "C" uint8_t cpu_alternatives_start[];
+extern "C" uint8_t cpu_alternatives_end[];
+
+uint64_t CPU::physicalAddressMask = 0x000FFFFFFFFFF000;
+
+namespace {
+	// one entry per static branch, emitted by StaticHasFeature
+	struct Alternative {
+		uint8_t* site;
+		uint64_t feature;
+	};
+
+	static constexpr uint64_t CR0_WP = 0x10000;
+	static constexpr uint8_t NOP5[5] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };
+
+	static uint64_t features = 0;
+	static uint8_t physicalAddressBits = 36;
+	static uint8_t linearAddressBits = 48;
+
+	static inline void setFeature(CPU::Feature feature, bool present) {
+		if (present) {
+			features |= static_cast<uint64_t>(1) << static_cast<uint64_t>(feature);
+		}
+	}
+
+	static inline bool bit(unsigned int value, unsigned int index) {
+		return ((value >> index) & 1) != 0;
+	}
+}
+
+void CPU::SetupFeatures() {
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	const unsigned int maxLeaf = __get_cpuid_max(0, nullptr);
+	const unsigned int maxExtendedLeaf = __get_cpuid_max(0x80000000, nullptr);
+
+	features = 0;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	setFeature(Feature::PGE, bit(edx, 13));
+	setFeature(Feature::PAT, bit(edx, 16));
+	setFeature(Feature::PCID, bit(ecx, 17));
+	setFeature(Feature::X2APIC, bit(ecx, 21));
+	setFeature(Feature::XSAVE, bit(ecx, 26));
+
+	if (maxLeaf >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		setFeature(Feature::SMEP, bit(ebx, 7));
+		setFeature(Feature::ERMS, bit(ebx, 9));
+		setFeature(Feature::INVPCID, bit(ebx, 10));
+		setFeature(Feature::SMAP, bit(ebx, 20));
+		setFeature(Feature::FSRM, bit(edx, 4));
+	}
+
+	if (maxLeaf >= 0xD && HasFeature(Feature::XSAVE)) {
+		__cpuid_count(0xD, 1, eax, ebx, ecx, edx);
+		setFeature(Feature::XSAVEOPT, bit(eax, 0));
+		setFeature(Feature::XSAVEC, bit(eax, 1));
+		setFeature(Feature::XSAVES, bit(eax, 3));
+	}
+
+	if (maxExtendedLeaf >= 0x80000001) {
+		__cpuid(0x80000001, eax, ebx, ecx, edx);
+		setFeature(Feature::NX, bit(edx, 20));
+		setFeature(Feature::PDPE1GB, bit(edx, 26));
+		setFeature(Feature::RDTSCP, bit(edx, 27));
+	}
+
+	if (maxExtendedLeaf >= 0x80000007) {
+		__cpuid(0x80000007, eax, ebx, ecx, edx);
+		setFeature(Feature::INVARIANT_TSC, bit(edx, 8));
+	}
+
+	if (maxExtendedLeaf >= 0x80000008) {
+		__cpuid(0x80000008, eax, ebx, ecx, edx);
+		physicalAddressBits = eax & 0xFF;
+		linearAddressBits = (eax >> 8) & 0xFF;
+	}
+
+	physicalAddressMask = ((static_cast<uint64_t>(1) << physicalAddressBits) - 1) & ~static_cast<uint64_t>(0xFFF);
+}
+
+bool CPU::HasFeature(Feature feature) {
+	return ((features >> static_cast<uint64_t>(feature)) & 1) != 0;
+}
+
+uint8_t CPU::QueryPhysicalAddressBits() {
+	return physicalAddressBits;
+}
+
+uint8_t CPU::QueryLinearAddressBits() {
+	return linearAddressBits;
+}
+
+void CPU::ApplyAlternatives() {
+	const Alternative* alternatives = reinterpret_cast<const Alternative*>(cpu_alternatives_start);
+	const size_t count = (cpu_alternatives_end - cpu_alternatives_start) / sizeof(Alternative);
+
+	// the loader maps the kernel text writable for now, write protection is only lifted so patching keeps working once it is not
+	uint64_t CR0;
+	__asm__ volatile("mov %%cr0, %0" : "=r"(CR0));
+	__asm__ volatile("mov %0, %%cr0" :: "r"(CR0 & ~CR0_WP) : "memory");
+
+	for (size_t i = 0; i < count; ++i) {
+		if (!HasFeature(static_cast<Feature>(alternatives[i].feature))) {
+			continue;
+		}
+
+		volatile uint8_t* site = alternatives[i].site;
+		for (size_t byte = 0; byte < sizeof(NOP5); ++byte) {
+			site[byte] = NOP5[byte];
+		}
+	}
+
+	__asm__ volatile("mov %0, %%cr0" :: "r"(CR0) : "memory");
+
+	// serialize, so no stale instruction is executed from the patched sites
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__cpuid(0, eax, ebx, ecx, edx);
+}
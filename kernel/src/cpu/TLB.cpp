@@ -0,0 +1,220 @@
+#include <cstddef>
+#include <cstdint>
+
+#include <cpu/CPU.hpp>
+#include <cpu/Features.hpp>
+#include <cpu/Spinlock.hpp>
+#include <cpu/TLB.hpp>
+
+namespace {
+	static constexpr uint64_t CR0_WP = 0x10000;
+	static constexpr uint64_t CR4_PGE = 0x80;
+	static constexpr uint64_t CR4_PCIDE = 0x20000;
+	static constexpr uint64_t CR3_PCID = 0xFFF;
+	// the translations tagged with the PCID are kept when CR3 is loaded
+	static constexpr uint64_t CR3_NO_FLUSH = 0x8000000000000000;
+
+	static constexpr uint64_t PCID_COUNT = 4096;
+	static constexpr uint64_t PCID_BITS = 12;
+
+	static constexpr uint64_t INVPCID_ADDRESS = 0;
+	static constexpr uint64_t INVPCID_ALL = 2;
+	// invalidates every context, global translations excepted
+	static constexpr uint64_t INVPCID_ALL_NON_GLOBAL = 3;
+
+	struct InvpcidDescriptor {
+		uint64_t pcid;
+		uint64_t address;
+	};
+
+	static uint64_t flushThreshold = 32;
+	static CPU::TLBStatistics statistics[CPU::MAX_CPUS];
+
+	static bool pcidEnabled = false;
+	static CPU::Spinlock pcidLock;
+	// Address space IDs are the generation followed by the PCID, PCID 0 stays with the boot address space.
+	// Once every PCID of a generation is handed out, the next generation starts over and each address space gets a new PCID when it is switched to.
+	static uint64_t pcidGeneration = 1;
+	static uint64_t nextPCID = 1;
+
+	static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t address) {
+		const InvpcidDescriptor descriptor = { .pcid = pcid, .address = address };
+		__asm__ volatile("invpcid %0, %1" :: "m"(descriptor), "r"(type) : "memory");
+	}
+
+	// every address space gets a new PCID, flushed when it is first loaded
+	static inline void retirePCIDs() {
+		CPU::LockGuard guard(&pcidLock);
+		++pcidGeneration;
+		nextPCID = 1;
+	}
+
+	// invlpg only drops the paging-structure caches of the current PCID, the other PCIDs may still hold shared ones
+	static inline void invalidateOtherContexts(const CPU::TLBBatch* batch) {
+		if (CPU::StaticHasFeature<CPU::Feature::INVPCID>()) {
+			const uint64_t contexts = __atomic_load_n(&nextPCID, __ATOMIC_RELAXED);
+
+			if (!batch->overflow && batch->count * contexts <= __atomic_load_n(&flushThreshold, __ATOMIC_RELAXED)) {
+				for (uint64_t pcid = 0; pcid < contexts; ++pcid) {
+					for (size_t i = 0; i < batch->count; ++i) {
+						invpcid(INVPCID_ADDRESS, pcid, batch->addresses[i]);
+					}
+				}
+			}
+			else {
+				invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+			}
+		}
+		else {
+			retirePCIDs();
+		}
+	}
+}
+
+void CPU::FlushTLB() {
+	if (StaticHasFeature<Feature::INVPCID>()) {
+		invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+	}
+	else {
+		// only the current PCID is flushed, make sure the others are before they are used again
+		if (pcidEnabled) {
+			retirePCIDs();
+		}
+
+		uint64_t CR3;
+		__asm__ volatile("mov %%cr3, %0" : "=r"(CR3));
+		__asm__ volatile("mov %0, %%cr3" :: "r"(CR3 & ~CR3_NO_FLUSH) : "memory");
+	}
+}
+
+void CPU::FlushGlobalTLB() {
+	if (StaticHasFeature<Feature::INVPCID>()) {
+		invpcid(INVPCID_ALL, 0, 0);
+		return;
+	}
+
+	uint64_t CR4;
+	__asm__ volatile("mov %%cr4, %0" : "=r"(CR4));
+
+	if ((CR4 & CR4_PGE) == 0) {
+		FlushTLB();
+		return;
+	}
+
+	// toggling CR4.PGE flushes the whole TLB, every PCID and global translation included
+	const uint64_t flags = disableInterrupts();
+	__asm__ volatile("mov %0, %%cr4" :: "r"(CR4 & ~CR4_PGE) : "memory");
+	__asm__ volatile("mov %0, %%cr4" :: "r"(CR4) : "memory");
+	restoreInterrupts(flags);
+}
+
+void CPU::CommitTLBBatch(TLBBatch* batch) {
+	if (batch->count == 0) {
+		return;
+	}
+
+	TLBStatistics* current = statistics + currentIndex();
+	++current->batches;
+
+	if (batch->overflow || batch->count > __atomic_load_n(&flushThreshold, __ATOMIC_RELAXED)) {
+		if (batch->global || batch->shared) {
+			FlushGlobalTLB();
+		}
+		else {
+			FlushTLB();
+		}
+		++current->fullFlushes;
+	}
+	else {
+		for (size_t i = 0; i < batch->count; ++i) {
+			FlushTLBPage(batch->addresses[i]);
+		}
+		current->pageFlushes += batch->count;
+
+		if (batch->shared && pcidEnabled) {
+			invalidateOtherContexts(batch);
+		}
+	}
+
+	batch->count = 0;
+	batch->overflow = false;
+	batch->global = false;
+	batch->shared = false;
+}
+
+void CPU::SetupAddressSpaces() {
+	// supervisor writes must fault on read-only pages as well, or they would land in shared frames like the zero page
+	uint64_t CR0;
+	__asm__ volatile("mov %%cr0, %0" : "=r"(CR0));
+	__asm__ volatile("mov %0, %%cr0" :: "r"(CR0 | CR0_WP) : "memory");
+
+	if (HasFeature(Feature::PGE)) {
+		uint64_t CR4;
+		__asm__ volatile("mov %%cr4, %0" : "=r"(CR4));
+		__asm__ volatile("mov %0, %%cr4" :: "r"(CR4 | CR4_PGE) : "memory");
+	}
+
+	if (!HasFeature(Feature::PCID)) {
+		return;
+	}
+
+	// CR4.PCIDE can only be set while the current PCID is 0
+	uint64_t CR3;
+	__asm__ volatile("mov %%cr3, %0" : "=r"(CR3));
+	if ((CR3 & CR3_PCID) != 0) {
+		__asm__ volatile("mov %0, %%cr3" :: "r"(CR3 & ~CR3_PCID) : "memory");
+	}
+
+	uint64_t CR4;
+	__asm__ volatile("mov %%cr4, %0" : "=r"(CR4));
+	__asm__ volatile("mov %0, %%cr4" :: "r"(CR4 | CR4_PCIDE) : "memory");
+
+	pcidEnabled = true;
+}
+
+bool CPU::PCIDEnabled() {
+	return pcidEnabled;
+}
+
+uint64_t CPU::SwitchAddressSpace(void* root, uint64_t* addressSpaceID) {
+	const uint64_t address = reinterpret_cast<uint64_t>(root) & ~CR3_PCID;
+
+	if (!pcidEnabled) {
+		return address;
+	}
+
+	LockGuard guard(&pcidLock);
+
+	if ((*addressSpaceID >> PCID_BITS) == pcidGeneration) {
+		return address | (*addressSpaceID & CR3_PCID) | CR3_NO_FLUSH;
+	}
+
+	if (nextPCID == PCID_COUNT) {
+		++pcidGeneration;
+		nextPCID = 1;
+	}
+
+	// the PCID may still tag translations of the address space that had it before, the first load flushes them
+	*addressSpaceID = (pcidGeneration << PCID_BITS) | nextPCID++;
+	return address | (*addressSpaceID & CR3_PCID);
+}
+
+void CPU::SetTLBFlushThreshold(uint64_t pages) {
+	__atomic_store_n(&flushThreshold, pages < TLB_BATCH_CAPACITY ? pages : TLB_BATCH_CAPACITY, __ATOMIC_RELAXED);
+}
+
+CPU::TLBStatistics CPU::QueryTLBStatistics() {
+	TLBStatistics total = {
+		.pageFlushes = 0,
+		.fullFlushes = 0,
+		.batches = 0
+	};
+
+	for (size_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+		total.pageFlushes += statistics[cpu].pageFlushes;
+		total.fullFlushes += statistics[cpu].fullFlushes;
+		total.batches += statistics[cpu].batches;
+	}
+
+	return total;
+}
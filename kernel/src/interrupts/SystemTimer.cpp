@@ -1,5 +1,7 @@
 #include <cstdint>
 
+#include <cpu/TLB.hpp>
+#include <interrupts/SystemTimer.hpp>
 #include <interrupts/pit.hpp>
 #include <multitasking/Task.hpp>
 #include <screen/Log.hpp>
@@ -8,23 +10,35 @@
 
 namespace {
 	struct ExecutionContext {
-		void* CR3;
+		uint64_t CR3;	// value loaded in CR3, with the PCID of the task
 		void* RSP;
 	};
 
+	static void (*tickHook)(void) = nullptr;
+
 	extern "C" ExecutionContext system_timer_event_handler(void) {
 		Interrupts::PIT::SYSTEM_TIMER_US += Interrupts::PIT::IRQ0_us;
+
+		void (*hook)(void) = __atomic_load_n(&tickHook, __ATOMIC_ACQUIRE);
+		if (hook != nullptr) {
+			hook();
+		}
+
 		Multitasking::Task* task = Multitasking::Task::taskSwitch();
 		if (task == nullptr) {
 			return ExecutionContext {
-				.CR3 = nullptr,
+				.CR3 = 0,
 				.RSP = nullptr
 			};
 		}
 
 		return ExecutionContext {
-			.CR3 = task->CR3,
+			.CR3 = CPU::SwitchAddressSpace(task->CR3, &task->AddressSpaceID),
 			.RSP = task->KernelStackTop
 		};
 	}
 }
+
+void Interrupts::SystemTimer::set_tick_hook(void (*hook)(void)) {
+	__atomic_store_n(&tickHook, hook, __ATOMIC_RELEASE);
+}
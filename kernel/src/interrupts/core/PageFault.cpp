@@ -1,8 +1,11 @@
 #include <cstddef>
 #include <cstdint>
 
+#include <cpu/CPU.hpp>
+#include <interrupts/Core.hpp>
 #include <interrupts/KernelPanic.hpp>
 #include <mm/PhysicalMemory.hpp>
+#include <mm/Swap.hpp>
 #include <mm/VirtualMemory.hpp>
 
 namespace {
@@ -16,9 +19,230 @@ namespace {
     static inline constexpr uint64_t PF_HLAT                        = 0x00000080;
     static inline constexpr uint64_t PF_SGX_VIOLATION               = 0x00008000;
 
+    static constexpr uint64_t FAULT_AROUND_REGIONS = 16;
+    // neighbouring pages read along with a swapped out page, when their slots follow its slot
+    static constexpr uint64_t SWAP_READ_AHEAD = 8;
+    // pages swapped out of the faulting task when the PMM runs dry
+    static constexpr uint64_t RECLAIM_PAGES = 32;
+
+    // sequential access tracking of a page table, regions are hashed by their PT
+    struct FaultAroundRegion {
+        uint64_t table;     // CR2 / 2 MB
+        uint64_t nextPage;  // first page after the last window, a fault there is sequential
+        uint64_t window;    // 0 when the slot is unused
+    };
+
+    static FaultAroundRegion faultAroundRegions[CPU::MAX_CPUS][FAULT_AROUND_REGIONS];
+    static uint64_t minimumWindow = 4;
+    static uint64_t maximumWindow = 16;
+
+    static inline FaultAroundRegion* findRegion(uint64_t table) {
+        return faultAroundRegions[CPU::currentIndex()] + table % FAULT_AROUND_REGIONS;
+    }
+
+    // grows the window of sequential faults, a stream crossing into the next page table keeps its window
+    static inline FaultAroundRegion* updateWindow(uint64_t page) {
+        const uint64_t table = page / VirtualMemory::PT_ENTRIES;
+        FaultAroundRegion* region = findRegion(table);
+
+        if (region->window != 0 && region->table == table && region->nextPage == page) {
+            region->window = region->window * 2 < maximumWindow ? region->window * 2 : maximumWindow;
+            return region;
+        }
+
+        const FaultAroundRegion* previous = findRegion(table - 1);
+        const uint64_t window = previous->window != 0 && previous->table == table - 1 && previous->nextPage == page
+            ? previous->window
+            : minimumWindow;
+
+        region->table = table;
+        region->window = window;
+        return region;
+    }
+
+    static inline bool isOnDemand(uint64_t entry) {
+        return (entry & (VirtualMemory::NP_PRESENT | VirtualMemory::NP_ON_DEMAND)) == VirtualMemory::NP_ON_DEMAND;
+    }
+
+    // the present entry of an on-demand one, the attributes move to their present positions
+    static inline uint64_t presentEntry(uint64_t entry, void* page) {
+        return ((entry & VirtualMemory::NP_PK) << 34)
+            | (PhysicalMemory::FilterAddress(page) & VirtualMemory::PTE_ADDRESS)
+            | ((entry & VirtualMemory::NP_GLOBAL) << 2)
+            | ((entry & VirtualMemory::NP_PAT) << 2)
+            | (entry & (VirtualMemory::NP_PCD | VirtualMemory::NP_PWT | VirtualMemory::NP_USERMODE | VirtualMemory::NP_READWRITE))
+            | VirtualMemory::PTE_PRESENT;
+    }
+
+    // Last resort of the fault paths: the user memory of the faulting task is swapped out to make room.
+    // Kernel faults do not reclaim, they may come from the swap paths themselves.
+    static inline void* allocateFrame(bool zeroed, uint64_t errv) {
+        void* page = zeroed ? PhysicalMemory::AllocateZeroed() : PhysicalMemory::Allocate();
+
+        if (page == nullptr && (errv & PF_USERMODE) != 0 && VirtualMemory::ReclaimUserPages(RECLAIM_PAGES) != 0) {
+            page = zeroed ? PhysicalMemory::AllocateZeroed() : PhysicalMemory::Allocate();
+        }
+
+        if (page == nullptr) {
+            Panic::Panic("THE COCONUT WENT NUTS (OUT OF MEMORY)\n\r", errv);
+        }
+
+        return page;
+    }
+
+    // populates the faulting entry and the on-demand entries following it in the window, frames are taken in a single batch
+    static inline void faultAround(VirtualMemory::PTE* pte, uint64_t CR2, uint64_t errv) {
+        const uint64_t page = CR2 / PhysicalMemory::FRAME_SIZE;
+        FaultAroundRegion* region = updateWindow(page);
+
+        // neighbours in the next page table are left to their own faults
+        const uint64_t tableLeft = VirtualMemory::PT_ENTRIES - page % VirtualMemory::PT_ENTRIES;
+        uint64_t span = region->window < tableLeft ? region->window : tableLeft;
+
+        uint64_t count = 0;
+        for (uint64_t i = 0; i < span; ++i) {
+            if (isOnDemand(pte[i].raw)) {
+                ++count;
+            }
+        }
+
+        void* frames[Interrupts::Core::FAULT_AROUND_LIMIT];
+
+        if (PhysicalMemory::AllocateZeroedBatch(count, frames) != PhysicalMemory::StatusCode::SUCCESS) {
+            // short on memory, only the faulting page is worth it
+            span = 1;
+            count = 1;
+
+            frames[0] = allocateFrame(true, errv);
+        }
+
+        for (uint64_t i = 0, frame = 0; i < span && frame < count; ++i) {
+            if (!isOnDemand(pte[i].raw)) {
+                continue;
+            }
+
+            pte[i].raw = presentEntry(pte[i].raw, frames[frame]);
+            ++frame;
+        }
+
+        region->nextPage = page + span;
+    }
+
+    // user reads of a never written page all share the zero frame, writable mappings of it are flagged for a private copy
+    static inline void mapZeroPage(VirtualMemory::PTE* pte, uint64_t errv) {
+        void* zeroPage = VirtualMemory::QueryZeroPage();
+        if (PhysicalMemory::Share(zeroPage) != PhysicalMemory::StatusCode::SUCCESS) {
+            Panic::Panic("ZERO PAGE REFERENCE OVERFLOW\n\r", errv);
+        }
+
+        const uint64_t entry = presentEntry(pte->raw, zeroPage);
+        pte->raw = (entry & VirtualMemory::PTE_READWRITE) != 0
+            ? (entry & ~VirtualMemory::PTE_READWRITE) | VirtualMemory::PTE_COW
+            : entry;
+    }
+
+    // write fault on a present page, returns false if it is a genuine violation
+    static inline bool copyOnWrite(uint64_t CR2, uint64_t errv) {
+        VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(CR2);
+        VirtualMemory::PDPTE* pdpte = VirtualMemory::getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+        VirtualMemory::PDE* pde = VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+        VirtualMemory::PTE* pte = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
+
+        // the fault came from a present mapping, so every level is present: only large pages end the walk early
+        if ((pdpte->raw & VirtualMemory::PDPTE_PAGE_SIZE) != 0 || (pde->raw & VirtualMemory::PDE_PAGE_SIZE) != 0
+            || (pte->raw & VirtualMemory::PTE_PRESENT) == 0
+            || ((errv & PF_USERMODE) != 0 && (pte->raw & VirtualMemory::PTE_USERMODE) == 0)
+        ) {
+            return false;
+        }
+
+        // resolved in the meantime, the TLB held the read-only translation
+        if ((pte->raw & VirtualMemory::PTE_READWRITE) != 0) {
+            __asm__ volatile("invlpg (%0)" :: "r"(CR2));
+            return true;
+        }
+
+        if ((pte->raw & VirtualMemory::PTE_COW) == 0) {
+            return false;
+        }
+
+        void* shared = reinterpret_cast<void*>(pte->raw & VirtualMemory::PTE_ADDRESS);
+        const bool zeroPage = shared == VirtualMemory::QueryZeroPage();
+
+        if (!zeroPage) {
+            const PhysicalMemory::PageFrame* frame = PhysicalMemory::QueryPageFrame(shared);
+            if (frame == nullptr) {
+                return false;
+            }
+
+            // the other mappings are gone (exited or released by an exec), the frame is private again
+            if (__atomic_load_n(&frame->refcount, __ATOMIC_ACQUIRE) == 1) {
+                pte->raw = (pte->raw & ~VirtualMemory::PTE_COW) | VirtualMemory::PTE_READWRITE;
+                __asm__ volatile("invlpg (%0)" :: "r"(CR2));
+                return true;
+            }
+        }
+
+        void* page = allocateFrame(zeroPage, errv);
+
+        if (!zeroPage) {
+            VirtualMemory::copyPage(VirtualMemory::PhysToVirt(page), VirtualMemory::PhysToVirt(shared));
+        }
+
+        pte->raw = (pte->raw & ~(VirtualMemory::PTE_ADDRESS | VirtualMemory::PTE_COW))
+            | (PhysicalMemory::FilterAddress(page) & VirtualMemory::PTE_ADDRESS)
+            | VirtualMemory::PTE_READWRITE;
+        __asm__ volatile("invlpg (%0)" :: "r"(CR2));
+
+        PhysicalMemory::Free(shared);
+
+        return true;
+    }
+
+    // reads the faulting page back, with the following entries of the page table whose slots follow its slot
+    static inline void swapIn(VirtualMemory::PTE* pte, uint64_t CR2, uint64_t errv) {
+        const uint64_t slot = VirtualMemory::swapSlot(pte->raw);
+        const uint64_t tableLeft = VirtualMemory::PT_ENTRIES - (CR2 / PhysicalMemory::FRAME_SIZE) % VirtualMemory::PT_ENTRIES;
+
+        uint64_t span = 1;
+        while (span < SWAP_READ_AHEAD && span < tableLeft
+            && VirtualMemory::isSwapEntry(pte[span].raw)
+            && VirtualMemory::swapSlot(pte[span].raw) == slot + span
+        ) {
+            ++span;
+        }
+
+        void* frames[SWAP_READ_AHEAD];
+
+        if (PhysicalMemory::AllocateBatch(span, frames) != PhysicalMemory::StatusCode::SUCCESS) {
+            span = 1;
+            frames[0] = allocateFrame(false, errv);
+        }
+
+        for (uint64_t i = 0; i < span; ++i) {
+            if (Swap::ReadSlot(slot + i, VirtualMemory::PhysToVirt(frames[i])) != Swap::StatusCode::SUCCESS) {
+                if (i == 0) {
+                    Panic::Panic("SWAP DEVICE READ FAILURE\n\r", errv);
+                }
+
+                // the read-ahead is only a bonus, the other pages stay swapped out
+                PhysicalMemory::FreeBatch(span - i, frames + i);
+                break;
+            }
+
+            pte[i].raw = presentEntry(pte[i].raw, frames[i]);
+            Swap::ReleaseSlot(slot + i);
+        }
+    }
+
     extern "C" void page_fault_handler(uint64_t errv) {
         if ((errv & PF_PRESENT) == 1) {
-            Panic::Panic("PAGE FAULT VIOLATION\n\r", errv);
+            uint64_t CR2 = 0;
+            __asm__ volatile("mov %%cr2, %0" : "=r"(CR2));
+
+            if ((errv & PF_WRITE) == 0 || !copyOnWrite(CR2, errv)) {
+                Panic::Panic("PAGE FAULT VIOLATION\n\r", errv);
+            }
         }
         else {
             uint64_t CR2 = 0;
@@ -31,40 +255,49 @@ namespace {
             VirtualMemory::PTE* pte = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
 
             if ((pml4e->raw & VirtualMemory::PML4E_PRESENT) == 0
-                || (pdpte->raw & VirtualMemory::PDPTE_PRESENT) == 0
-                || (pde->raw & VirtualMemory::PDE_PRESENT) == 0
-                || pte->raw == 0) {
+                || (pdpte->raw & VirtualMemory::PDPTE_PRESENT) == 0) {
+                Panic::Panic("WHAT DID YOU THINK WOULD HAPPEN??\n\r", errv);
+            }
+
+            // huge and large pages are mapped eagerly, there is no table below them: the TLB held a stale translation
+            if ((pdpte->raw & VirtualMemory::PDPTE_PAGE_SIZE) != 0) {
+                __asm__ volatile("invlpg (%0)" :: "r"(CR2));
+                return;
+            }
+
+            if ((pde->raw & VirtualMemory::PDE_PRESENT) == 0) {
+                Panic::Panic("WHAT DID YOU THINK WOULD HAPPEN??\n\r", errv);
+            }
+
+            if ((pde->raw & VirtualMemory::PDE_PAGE_SIZE) != 0) {
+                __asm__ volatile("invlpg (%0)" :: "r"(CR2));
+                return;
+            }
+
+            if (pte->raw == 0) {
                 Panic::Panic("WHAT DID YOU THINK WOULD HAPPEN??\n\r", errv);
             }
             
-            uint64_t PRESENT = VirtualMemory::PTE_PRESENT;
-            uint64_t READWRITE = pte->raw & VirtualMemory::NP_READWRITE;
-            uint64_t USERMODE = pte->raw & VirtualMemory::NP_USERMODE;
-            uint64_t PWT = pte->raw & VirtualMemory::NP_PWT;
-            uint64_t PCD = pte->raw & VirtualMemory::NP_PCD;
-            uint64_t PAT = (pte->raw & VirtualMemory::NP_PAT) << 2;
-            uint64_t GLOBAL = (pte->raw & VirtualMemory::NP_GLOBAL) << 2;
-            uint64_t PK = (pte->raw & VirtualMemory::NP_PK) << 34;
-            
-            if ((pte->raw & VirtualMemory::NP_ON_DEMAND) == 0) {
-                Panic::Panic("MEMORY SWAPPING UNSUPPORTED\n\r", errv);
+            if (VirtualMemory::isSwapEntry(pte->raw)) {
+                swapIn(pte, CR2, errv);
+            }
+            // kernel reads get private frames: a copy-on-write fault taken while the CPU pushes onto a kernel stack is a double fault
+            else if ((errv & PF_WRITE) == 0 && (errv & PF_USERMODE) != 0) {
+                mapZeroPage(pte, errv);
             }
             else {
-                void* page = PhysicalMemory::Allocate();
-                if (page == nullptr) {
-                    Panic::Panic("THE COCONUT WENT NUTS (OUT OF MEMORY)\n\r", errv);
-                }
-
-                pte->raw = PK
-                    | (PhysicalMemory::FilterAddress(page) & VirtualMemory::PTE_ADDRESS)
-                    | GLOBAL
-                    | PAT
-                    | PCD
-                    | PWT
-                    | USERMODE
-                    | READWRITE
-                    | PRESENT;
+                faultAround(pte, CR2, errv);
             }
         }
     }
 }
+
+bool Interrupts::Core::SetFaultAroundWindow(uint64_t minimumPages, uint64_t maximumPages) {
+    if (minimumPages == 0 || minimumPages > maximumPages || maximumPages > FAULT_AROUND_LIMIT) {
+        return false;
+    }
+
+    minimumWindow = minimumPages;
+    maximumWindow = maximumPages;
+    return true;
+}
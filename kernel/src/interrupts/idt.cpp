@@ -111,6 +111,8 @@ extern "C" void Interrupts::kernel_idt_setup() {
 	registerCoreInterrupt(30, &Interrupts::Core::int_security_error,			INTDPL::DPL0, INTTYPE::EXCEPTION);
 
 	registerCoreInterrupt(0x81, &Interrupts::Software::swFramebufferManager, 	INTDPL::DPL3, INTTYPE::TRAP);
+	registerCoreInterrupt(0x82, &Interrupts::Software::swIdleManager, 			INTDPL::DPL3, INTTYPE::EXCEPTION);
+	registerCoreInterrupt(0x83, &Interrupts::Software::swExitManager, 			INTDPL::DPL3, INTTYPE::EXCEPTION);
 }
 
 extern "C" void Interrupts::register_irq(unsigned int irqLine, void(*handler)(void), unsigned int isTrap) {
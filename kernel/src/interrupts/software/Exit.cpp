@@ -0,0 +1,30 @@
+#include <cstddef>
+#include <cstdint>
+
+#include <cpu/TLB.hpp>
+#include <interrupts/Software.hpp>
+#include <multitasking/KernelTask.hpp>
+#include <multitasking/Task.hpp>
+
+namespace {
+    struct ExecutionContext {
+        uint64_t CR3;   // value loaded in CR3, with the PCID of the task
+        void* RSP;
+    };
+
+    // the exited task is destroyed later from another task, by the idle time work
+    extern "C" ExecutionContext swExitTask(void) {
+        Multitasking::Task* task = Multitasking::exitKernelTask();
+        if (task == nullptr) {
+            return ExecutionContext {
+                .CR3 = 0,
+                .RSP = nullptr
+            };
+        }
+
+        return ExecutionContext {
+            .CR3 = CPU::SwitchAddressSpace(task->CR3, &task->AddressSpaceID),
+            .RSP = task->KernelStackTop
+        };
+    }
+}
@@ -0,0 +1,20 @@
+#include <cstddef>
+#include <cstdint>
+
+#include <interrupts/Software.hpp>
+#include <mm/PhysicalMemory.hpp>
+#include <multitasking/KernelTask.hpp>
+
+namespace {
+    // frames zeroed per call, keeps the time spent with interrupts disabled short
+    static constexpr uint64_t IDLE_ZERO_BATCH = 4;
+
+    // a single exited task is destroyed per call, its address space can take a while to walk
+    extern "C" void swIdleRefill(void) {
+        if (Multitasking::reapKernelTask()) {
+            return;
+        }
+
+        PhysicalMemory::RefillZeroPool(IDLE_ZERO_BATCH);
+    }
+}
@@ -0,0 +1,36 @@
+;;;;; Cocos task exit procedure
+;;;;
+;;;
+;;
+;; Called by a task to end itself, the next task runs in its place.
+;; The last task cannot exit: the call returns and it keeps running.
+
+BITS 64
+
+extern main_core_dump
+extern main_core_reload
+extern swExitTask
+
+global swExitManager
+
+section .data
+execution_context:
+    context_cr3: dq 0
+    context_rsp: dq 0
+
+section .text
+swExitManager:
+    call main_core_dump
+    lea rcx, [rel execution_context]
+    sub rsp, 40 ; shadow space, keeps the stack aligned
+    call swExitTask
+    add rsp, 40
+    cmp QWORD [rel context_cr3], 0
+    jz .L0
+    mov rax, [rel context_cr3]
+    mov rcx, [rel context_rsp]
+    mov cr3, rax
+    mov rsp, rcx
+.L0:
+    call main_core_reload
+    iretq
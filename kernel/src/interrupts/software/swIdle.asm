@@ -0,0 +1,24 @@
+;;;;; Cocos idle time procedures
+;;;;
+;;;
+;;
+;; Called by the idle tasks to run deferred kernel work.
+;; Installed as an interrupt gate: each call only does a small batch,
+;; so the system timer is never held off for long.
+
+BITS 64
+
+extern main_core_dump
+extern main_core_reload
+extern swIdleRefill
+
+global swIdleManager
+
+section .text
+swIdleManager:
+    call main_core_dump
+    sub rsp, 40 ; shadow space, keeps the stack aligned
+    call swIdleRefill
+    add rsp, 40
+    call main_core_reload
+    iretq
@@ -3,6 +3,9 @@
 
 #include <efi.h>
 
+#include <cpu/Features.hpp>
+#include <cpu/TLB.hpp>
+
 #include <devices/PS2/controller.hpp>
 #include <devices/PS2/Keyboard.hpp>
 
@@ -13,7 +16,9 @@
 #include <interrupts/SystemTimer.hpp>
 
 #include <mm/gdt.hpp>
+#include <mm/NUMA.hpp>
 #include <mm/PhysicalMemory.hpp>
+#include <mm/Swap.hpp>
 #include <mm/VirtualMemory.hpp>
 #include <mm/VirtualMemoryLayout.hpp>
 
@@ -58,6 +63,44 @@ namespace {
         }
     }
 
+    static inline void SetupNUMA() {
+        auto status = NUMA::Setup();
+        if (status == NUMA::StatusCode::NOT_SUPPORTED) {
+            Log::puts("No SRAT found, all memory is treated as a single node\n\r");
+            return;
+        }
+        else if (status != NUMA::StatusCode::SUCCESS) {
+            Log::puts("Invalid SRAT, all memory is treated as a single node\n\r");
+            return;
+        }
+
+        if (PhysicalMemory::SetupNodes() != PhysicalMemory::StatusCode::SUCCESS) {
+            Panic::PanicShutdown(rtServices, "PMM NODE INITIALIZATION FAILED\n\r");
+        }
+
+        Log::puts("NUMA Nodes Initialized\n\r");
+    }
+
+    // Compressed swap in RAM, with as many slots as half the memory has frames.
+    // Slots only take what their page compresses to, so running short of frames swaps instead of panicking.
+    static inline void SetupSwap() {
+        const PhysicalMemory::MemoryRange* ranges = nullptr;
+        const uint64_t rangeCount = PhysicalMemory::QueryMemoryRanges(&ranges);
+
+        uint64_t frames = 0;
+        for (uint64_t i = 0; i < rangeCount; ++i) {
+            frames += (ranges[i].end - ranges[i].start) / PhysicalMemory::FRAME_SIZE;
+        }
+
+        Swap::Device* device = Swap::CreateCompressedRamDisk(frames / 2);
+        if (device == nullptr || Swap::AttachDevice(device) != Swap::StatusCode::SUCCESS) {
+            Log::puts("Compressed swap initialization failed, running out of memory will panic\n\r");
+            return;
+        }
+
+        Log::puts("Compressed Swap Initialized\n\r");
+    }
+
     static inline void SetupPS2Keyboard() {
         uint32_t status = 0;
 
@@ -87,19 +130,149 @@ namespace {
         Log::puts("PS/2 Keyboard Initialized.\n\r");
         Interrupts::register_irq(1, &Devices::PS2::PS2_IRQ1_handler, 0);
     }
+
+    // Stress test of the physical allocator, off by default: the boot context and the timer IRQ allocate and free
+    // at the same time, through the cached fast path, the batches and the zeroed frames.
+    // Every frame is tagged with its owner, a frame handed out twice is caught, and the free memory must end where it started.
+    static constexpr bool PMM_STRESS_TEST = false;
+
+    static constexpr uint64_t STRESS_TICKS = 256;
+    static constexpr uint64_t STRESS_IRQ_FRAMES = 16;
+    static constexpr uint64_t STRESS_TASK_FRAMES = 64;
+    static constexpr uint64_t STRESS_IRQ_TAG = 0x8000000000000000;
+
+    static void* stressIrqFrames[STRESS_IRQ_FRAMES];
+    static uint64_t stressIrqCount = 0;
+    static volatile uint64_t stressTicks = 0;
+    static volatile bool stressFailed = false;
+
+    static inline void stressTag(void* frame, uint64_t tag) {
+        *static_cast<volatile uint64_t*>(VirtualMemory::PhysToVirt(frame)) = tag;
+    }
+
+    static inline bool stressCheck(void* frame, uint64_t tag) {
+        return *static_cast<volatile uint64_t*>(VirtualMemory::PhysToVirt(frame)) == tag;
+    }
+
+    // frees the frames of the previous tick, half of them one at a time, then allocates the next ones
+    static void stressTick() {
+        const uint64_t tick = stressTicks;
+        if (tick >= STRESS_TICKS) {
+            return;
+        }
+
+        for (uint64_t i = 0; i < stressIrqCount; ++i) {
+            if (!stressCheck(stressIrqFrames[i], STRESS_IRQ_TAG | ((tick - 1) << 8) | i)) {
+                stressFailed = true;
+            }
+        }
+
+        const uint64_t singles = stressIrqCount / 2;
+        for (uint64_t i = 0; i < singles; ++i) {
+            PhysicalMemory::Free(stressIrqFrames[i]);
+        }
+        PhysicalMemory::FreeBatch(stressIrqCount - singles, stressIrqFrames + singles);
+        stressIrqCount = 0;
+
+        // the last tick only frees
+        if (tick + 1 < STRESS_TICKS) {
+            if (tick % 2 == 0) {
+                if (PhysicalMemory::AllocateBatch(STRESS_IRQ_FRAMES, stressIrqFrames) == PhysicalMemory::StatusCode::SUCCESS) {
+                    stressIrqCount = STRESS_IRQ_FRAMES;
+                }
+            }
+            else {
+                while (stressIrqCount < STRESS_IRQ_FRAMES) {
+                    void* frame = PhysicalMemory::Allocate();
+                    if (frame == nullptr) {
+                        break;
+                    }
+                    stressIrqFrames[stressIrqCount++] = frame;
+                }
+            }
+
+            if (stressIrqCount != STRESS_IRQ_FRAMES) {
+                stressFailed = true;
+            }
+
+            for (uint64_t i = 0; i < stressIrqCount; ++i) {
+                stressTag(stressIrqFrames[i], STRESS_IRQ_TAG | (tick << 8) | i);
+            }
+        }
+
+        stressTicks = tick + 1;
+    }
+
+    static inline void RunPMMStressTest() {
+        const uint64_t freeMemory = PhysicalMemory::QueryMemoryUsage();
+
+        Interrupts::SystemTimer::set_tick_hook(&stressTick);
+        __asm__ volatile("sti");
+
+        void* frames[STRESS_TASK_FRAMES];
+
+        for (uint64_t round = 0; stressTicks < STRESS_TICKS; ++round) {
+            uint64_t count = 0;
+
+            for (; count < STRESS_TASK_FRAMES; ++count) {
+                void* frame = round % 4 == 0 ? PhysicalMemory::AllocateZeroed() : PhysicalMemory::Allocate();
+                if (frame == nullptr) {
+                    stressFailed = true;
+                    break;
+                }
+
+                frames[count] = frame;
+                stressTag(frame, (round << 8) | count);
+            }
+
+            for (uint64_t i = 0; i < count; ++i) {
+                if (!stressCheck(frames[i], (round << 8) | i)) {
+                    stressFailed = true;
+                }
+            }
+
+            if (round % 2 == 0) {
+                PhysicalMemory::FreeBatch(count, frames);
+            }
+            else {
+                for (uint64_t i = 0; i < count; ++i) {
+                    PhysicalMemory::Free(frames[i]);
+                }
+            }
+        }
+
+        __asm__ volatile("cli");
+        Interrupts::SystemTimer::set_tick_hook(nullptr);
+
+        if (stressFailed || PhysicalMemory::QueryMemoryUsage() != freeMemory) {
+            Panic::Panic("PMM STRESS TEST FAILED\n\r");
+        }
+
+        Log::puts("PMM Stress Test Passed\n\r");
+    }
 }
 
+// the idle tasks hand their time to the kernel for deferred work, such as zeroing frames
 __attribute__((section(".userembedded"))) void idleTask(void) {
-    while (1);
+    while (1) {
+        __asm__ volatile("int $0x82" ::: "memory");
+    }
 }
 
 __attribute__((section(".userembedded"))) void idleTask2(void) {
-    while (1);
+    while (1) {
+        __asm__ volatile("int $0x82" ::: "memory");
+    }
 }
 
 extern "C" int kmain() {
     __asm__ volatile("cli");
 
+    // static branches must be patched before anything else runs, constructors included
+    CPU::SetupFeatures();
+    CPU::ApplyAlternatives();
+    CPU::SetupAddressSpaces();
+
     _kernel_ctx_init();
 
     VirtualMemory::kernel_gdt_setup();
@@ -115,12 +288,19 @@ extern "C" int kmain() {
     SetupVirtualMemory();
     Log::puts("VMM Initialized\n\r");
 
+    SetupNUMA();
+    SetupSwap();
+
     Interrupts::register_irq(0, &Interrupts::SystemTimer::PIT_IRQ0_handler, 0);
     Interrupts::PIC::initialize_pic();
     Interrupts::PIT::initialize_pit();
 
     SetupPS2Keyboard();
 
+    if constexpr (PMM_STRESS_TEST) {
+        RunPMMStressTest();
+    }
+
     auto status = Multitasking::loadKernelTask(reinterpret_cast<void*>(&idleTask));
     if (status != Multitasking::StatusCode::SUCCESS) {
         Panic::Panic("Failed to load kernel task\n\r");
@@ -0,0 +1,558 @@
+#include <cstddef>
+#include <cstdint>
+
+#include <cpu/CPU.hpp>
+#include <cpu/Spinlock.hpp>
+#include <mm/PhysicalMemory.hpp>
+#include <mm/Swap.hpp>
+#include <mm/VirtualMemory.hpp>
+
+namespace {
+	typedef uint32_t unaligned_uint32_t __attribute__((aligned(1), may_alias));
+
+	/// Compressor: LZ4 block format, greedy matching through a hash table of the last position of every 4 bytes sequence.
+	/// A sequence is a token (literal length << 4 | match length - 4), the literals, then a 16 bits offset and the match.
+	/// Lengths of 15 and above continue in extra bytes of 255, the last sequence only has literals.
+
+	static constexpr uint64_t HASH_BITS = 12;
+	static constexpr uint64_t HASH_ENTRIES = static_cast<uint64_t>(1) << HASH_BITS;
+	static constexpr uint64_t MIN_MATCH = 4;
+	// the format requires the last bytes to be literals
+	static constexpr uint64_t LAST_LITERALS = 5;
+
+	static inline uint32_t load32(const uint8_t* address) {
+		return *reinterpret_cast<const unaligned_uint32_t*>(address);
+	}
+
+	static inline uint64_t hashSequence(uint32_t sequence) {
+		return (sequence * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	// writes a length continuation, returns nullptr when it does not fit
+	static inline uint8_t* writeLength(uint8_t* output, const uint8_t* outputEnd, uint64_t length) {
+		for (; length >= 255; length -= 255) {
+			if (output == outputEnd) {
+				return nullptr;
+			}
+			*output++ = 255;
+		}
+
+		if (output == outputEnd) {
+			return nullptr;
+		}
+		*output++ = static_cast<uint8_t>(length);
+		return output;
+	}
+
+	static inline uint8_t* writeSequence(uint8_t* output, const uint8_t* outputEnd, const uint8_t* literals, uint64_t literalLength, uint64_t offset, uint64_t matchLength) {
+		if (output == outputEnd) {
+			return nullptr;
+		}
+
+		uint8_t* token = output++;
+		*token = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4);
+
+		if (literalLength >= 15 && (output = writeLength(output, outputEnd, literalLength - 15)) == nullptr) {
+			return nullptr;
+		}
+
+		if (static_cast<uint64_t>(outputEnd - output) < literalLength) {
+			return nullptr;
+		}
+		for (uint64_t i = 0; i < literalLength; ++i) {
+			*output++ = literals[i];
+		}
+
+		// the last sequence stops after its literals
+		if (matchLength == 0) {
+			return output;
+		}
+
+		if (outputEnd - output < 2) {
+			return nullptr;
+		}
+		*output++ = static_cast<uint8_t>(offset);
+		*output++ = static_cast<uint8_t>(offset >> 8);
+
+		const uint64_t extraLength = matchLength - MIN_MATCH;
+		*token |= static_cast<uint8_t>(extraLength < 15 ? extraLength : 15);
+
+		if (extraLength >= 15 && (output = writeLength(output, outputEnd, extraLength - 15)) == nullptr) {
+			return nullptr;
+		}
+
+		return output;
+	}
+
+	// compresses a page into at most limit bytes, returns the compressed size or 0 when it does not fit
+	static uint64_t compressPage(const uint8_t* input, uint8_t* output, uint64_t limit, uint16_t* table) {
+		constexpr uint64_t size = PhysicalMemory::FRAME_SIZE;
+		static_assert(size <= 0x10000, "Positions and offsets are 16 bits");
+
+		for (uint64_t i = 0; i < HASH_ENTRIES; ++i) {
+			table[i] = 0;
+		}
+
+		uint8_t* const outputStart = output;
+		const uint8_t* const outputEnd = output + limit;
+		uint64_t position = 0;
+		uint64_t anchor = 0;
+
+		while (position + MIN_MATCH + LAST_LITERALS <= size) {
+			const uint32_t sequence = load32(input + position);
+			const uint64_t hash = hashSequence(sequence);
+			const uint64_t candidate = table[hash];
+			table[hash] = static_cast<uint16_t>(position);
+
+			// a stale or empty entry simply does not match
+			if (candidate >= position || load32(input + candidate) != sequence) {
+				++position;
+				continue;
+			}
+
+			uint64_t matchLength = MIN_MATCH;
+			while (position + matchLength < size - LAST_LITERALS && input[candidate + matchLength] == input[position + matchLength]) {
+				++matchLength;
+			}
+
+			output = writeSequence(output, outputEnd, input + anchor, position - anchor, position - candidate, matchLength);
+			if (output == nullptr) {
+				return 0;
+			}
+
+			position += matchLength;
+			anchor = position;
+		}
+
+		output = writeSequence(output, outputEnd, input + anchor, size - anchor, 0, 0);
+		if (output == nullptr) {
+			return 0;
+		}
+
+		return output - outputStart;
+	}
+
+	// reads a length continuation, returns false past the end of the input
+	static inline bool readLength(const uint8_t** input, const uint8_t* inputEnd, uint64_t* length) {
+		uint8_t byte;
+		do {
+			if (*input == inputEnd) {
+				return false;
+			}
+			byte = *(*input)++;
+			*length += byte;
+		} while (byte == 255);
+
+		return true;
+	}
+
+	// the input comes from compressPage, but every access is still checked: a corrupted object must not overflow the page
+	static bool decompressPage(const uint8_t* input, uint64_t length, uint8_t* output) {
+		const uint8_t* const inputEnd = input + length;
+		uint8_t* const outputStart = output;
+		uint8_t* const outputEnd = output + PhysicalMemory::FRAME_SIZE;
+
+		while (input < inputEnd) {
+			const uint8_t token = *input++;
+
+			uint64_t literalLength = token >> 4;
+			if (literalLength == 15 && !readLength(&input, inputEnd, &literalLength)) {
+				return false;
+			}
+
+			if (static_cast<uint64_t>(inputEnd - input) < literalLength || static_cast<uint64_t>(outputEnd - output) < literalLength) {
+				return false;
+			}
+			for (uint64_t i = 0; i < literalLength; ++i) {
+				*output++ = *input++;
+			}
+
+			if (input == inputEnd) {
+				break;
+			}
+
+			if (inputEnd - input < 2) {
+				return false;
+			}
+			const uint64_t offset = input[0] | (static_cast<uint64_t>(input[1]) << 8);
+			input += 2;
+
+			uint64_t matchLength = token & 0xF;
+			if (matchLength == 15 && !readLength(&input, inputEnd, &matchLength)) {
+				return false;
+			}
+			matchLength += MIN_MATCH;
+
+			if (offset == 0 || offset > static_cast<uint64_t>(output - outputStart) || static_cast<uint64_t>(outputEnd - output) < matchLength) {
+				return false;
+			}
+
+			// byte by byte, matches may overlap their own output
+			const uint8_t* match = output - offset;
+			for (uint64_t i = 0; i < matchLength; ++i) {
+				*output++ = *match++;
+			}
+		}
+
+		return output == outputEnd;
+	}
+
+	/// Objects: compressed pages are stored in size classes, each slab is a frame accessed through the direct map.
+	/// A slab starts with its header, its free objects are linked by their offset in the slab.
+
+	static constexpr uint64_t OBJECT_ALIGNMENT = 32;
+	// past this size the compression is not worth it, the page is kept as is
+	static constexpr uint64_t MAX_COMPRESSED_SIZE = 3072;
+	static constexpr uint64_t SIZE_CLASSES = MAX_COMPRESSED_SIZE / OBJECT_ALIGNMENT;
+
+	struct Slab {
+		Slab* next;				// slabs of the class with free objects
+		Slab* prev;
+		uint16_t freeObject;	// offset of the first free object, 0 when the slab is full
+		uint16_t used;
+		uint16_t sizeClass;
+	};
+
+	static constexpr uint64_t SLAB_HEADER = (sizeof(Slab) + OBJECT_ALIGNMENT - 1) & ~(OBJECT_ALIGNMENT - 1);
+
+	static_assert(PhysicalMemory::FRAME_SIZE - SLAB_HEADER >= MAX_COMPRESSED_SIZE, "The largest object must fit in a slab");
+
+	static inline uint64_t objectSize(uint64_t sizeClass) {
+		return (sizeClass + 1) * OBJECT_ALIGNMENT;
+	}
+
+	// Writes happen when reclaim has to free memory, so Allocate is likely to fail right then: frames set aside when the
+	// disk is created keep them going. A write takes at most one frame and the page it stored is freed right after.
+	static constexpr uint64_t RESERVE_FRAMES = 16;
+
+	enum class BlockKind : uint8_t {
+		EMPTY,
+		SAME_FILLED,		// value is the qword repeated over the page
+		COMPRESSED,			// value is the object, in the direct map
+		INCOMPRESSIBLE		// value is the frame, in the direct map
+	};
+
+	struct Block {
+		uint64_t value;
+		uint16_t length;
+		BlockKind kind;
+	};
+
+	struct CompressedDisk {
+		Swap::Device device;		// first, the callbacks get the disk back from the device
+		Block* blocks;
+		uint64_t blocksPages;
+		Slab* partialSlabs[SIZE_CLASSES];
+		void* reserve[RESERVE_FRAMES];
+		uint64_t reserveFrames;
+		Swap::CompressedStatistics statistics;
+		CPU::Spinlock lock;
+		uint16_t hashTable[HASH_ENTRIES];
+		uint8_t buffer[MAX_COMPRESSED_SIZE];
+	};
+
+	static constexpr uint64_t DISK_PAGES = (sizeof(CompressedDisk) + PhysicalMemory::FRAME_SIZE - 1) / PhysicalMemory::FRAME_SIZE;
+
+	static inline void unlinkSlab(CompressedDisk* disk, Slab* slab) {
+		if (slab->prev != nullptr) {
+			slab->prev->next = slab->next;
+		}
+		else {
+			disk->partialSlabs[slab->sizeClass] = slab->next;
+		}
+		if (slab->next != nullptr) {
+			slab->next->prev = slab->prev;
+		}
+	}
+
+	static inline void linkSlab(CompressedDisk* disk, Slab* slab) {
+		slab->prev = nullptr;
+		slab->next = disk->partialSlabs[slab->sizeClass];
+		if (slab->next != nullptr) {
+			slab->next->prev = slab;
+		}
+		disk->partialSlabs[slab->sizeClass] = slab;
+	}
+
+	// the disk lock is held by the frame helpers
+	static inline void* allocateFrame(CompressedDisk* disk) {
+		void* frame = PhysicalMemory::Allocate();
+
+		if (frame == nullptr && disk->reserveFrames > 0) {
+			frame = disk->reserve[--disk->reserveFrames];
+		}
+
+		return frame;
+	}
+
+	static inline void freeFrame(CompressedDisk* disk, void* frame) {
+		if (disk->reserveFrames < RESERVE_FRAMES) {
+			disk->reserve[disk->reserveFrames++] = frame;
+			return;
+		}
+
+		PhysicalMemory::Free(frame);
+	}
+
+	// gives back to the reserve what the writes made while memory was short took from it
+	static inline void refillReserve(CompressedDisk* disk) {
+		while (disk->reserveFrames < RESERVE_FRAMES) {
+			void* frame = PhysicalMemory::Allocate();
+			if (frame == nullptr) {
+				return;
+			}
+
+			disk->reserve[disk->reserveFrames++] = frame;
+		}
+	}
+
+	static uint8_t* allocateObject(CompressedDisk* disk, uint64_t length) {
+		const uint64_t sizeClass = (length - 1) / OBJECT_ALIGNMENT;
+		Slab* slab = disk->partialSlabs[sizeClass];
+
+		if (slab == nullptr) {
+			void* frame = allocateFrame(disk);
+			if (frame == nullptr) {
+				return nullptr;
+			}
+
+			slab = static_cast<Slab*>(VirtualMemory::PhysToVirt(frame));
+			slab->used = 0;
+			slab->sizeClass = static_cast<uint16_t>(sizeClass);
+			slab->freeObject = 0;
+
+			// linked from the end, so the first object is handed out first
+			const uint64_t size = objectSize(sizeClass);
+			for (uint64_t object = (PhysicalMemory::FRAME_SIZE - SLAB_HEADER) / size; object > 0; --object) {
+				const uint64_t offset = SLAB_HEADER + (object - 1) * size;
+				*reinterpret_cast<uint16_t*>(reinterpret_cast<uint8_t*>(slab) + offset) = slab->freeObject;
+				slab->freeObject = static_cast<uint16_t>(offset);
+			}
+
+			linkSlab(disk, slab);
+			++disk->statistics.usedFrames;
+		}
+
+		uint8_t* object = reinterpret_cast<uint8_t*>(slab) + slab->freeObject;
+		slab->freeObject = *reinterpret_cast<uint16_t*>(object);
+		++slab->used;
+
+		if (slab->freeObject == 0) {
+			unlinkSlab(disk, slab);
+		}
+
+		return object;
+	}
+
+	static void freeObject(CompressedDisk* disk, uint8_t* object) {
+		Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uint64_t>(object) & ~(PhysicalMemory::FRAME_SIZE - 1));
+
+		if (slab->freeObject == 0) {
+			linkSlab(disk, slab);
+		}
+
+		*reinterpret_cast<uint16_t*>(object) = slab->freeObject;
+		slab->freeObject = static_cast<uint16_t>(object - reinterpret_cast<uint8_t*>(slab));
+
+		if (--slab->used == 0) {
+			unlinkSlab(disk, slab);
+			freeFrame(disk, reinterpret_cast<void*>(VirtualMemory::VirtToPhys(slab)));
+			--disk->statistics.usedFrames;
+		}
+	}
+
+	// frees what the block holds, the disk lock is held
+	static void releaseBlock(CompressedDisk* disk, Block* block) {
+		switch (block->kind) {
+			case BlockKind::EMPTY:
+				return;
+			case BlockKind::SAME_FILLED:
+				--disk->statistics.sameFilledPages;
+				break;
+			case BlockKind::COMPRESSED:
+				freeObject(disk, reinterpret_cast<uint8_t*>(block->value));
+				disk->statistics.originalBytes -= PhysicalMemory::FRAME_SIZE;
+				disk->statistics.compressedBytes -= block->length;
+				break;
+			case BlockKind::INCOMPRESSIBLE:
+				freeFrame(disk, reinterpret_cast<void*>(VirtualMemory::VirtToPhys(reinterpret_cast<void*>(block->value))));
+				--disk->statistics.incompressiblePages;
+				--disk->statistics.usedFrames;
+				break;
+		}
+
+		--disk->statistics.storedPages;
+		block->kind = BlockKind::EMPTY;
+	}
+
+	static inline bool sameFilled(const void* page, uint64_t* value) {
+		const uint64_t* qwords = static_cast<const uint64_t*>(page);
+		for (uint64_t i = 1; i < PhysicalMemory::FRAME_SIZE / sizeof(uint64_t); ++i) {
+			if (qwords[i] != qwords[0]) {
+				return false;
+			}
+		}
+
+		*value = qwords[0];
+		return true;
+	}
+
+	static Swap::StatusCode compressedWrite(Swap::Device* device, uint64_t index, const void* page) {
+		CompressedDisk* disk = reinterpret_cast<CompressedDisk*>(device);
+		CPU::LockGuard guard(&disk->lock);
+
+		Block* block = disk->blocks + index;
+		releaseBlock(disk, block);
+		refillReserve(disk);
+
+		uint64_t value;
+		if (sameFilled(page, &value)) {
+			block->value = value;
+			block->kind = BlockKind::SAME_FILLED;
+			++disk->statistics.sameFilledPages;
+			++disk->statistics.storedPages;
+			return Swap::StatusCode::SUCCESS;
+		}
+
+		const uint64_t length = compressPage(static_cast<const uint8_t*>(page), disk->buffer, MAX_COMPRESSED_SIZE, disk->hashTable);
+
+		if (length == 0) {
+			void* frame = allocateFrame(disk);
+			if (frame == nullptr) {
+				return Swap::StatusCode::OUT_OF_MEMORY;
+			}
+
+			void* copy = VirtualMemory::PhysToVirt(frame);
+			VirtualMemory::copyPage(copy, page);
+
+			block->value = reinterpret_cast<uint64_t>(copy);
+			block->kind = BlockKind::INCOMPRESSIBLE;
+			++disk->statistics.incompressiblePages;
+			++disk->statistics.usedFrames;
+			++disk->statistics.storedPages;
+			return Swap::StatusCode::SUCCESS;
+		}
+
+		uint8_t* object = allocateObject(disk, length);
+		if (object == nullptr) {
+			return Swap::StatusCode::OUT_OF_MEMORY;
+		}
+
+		for (uint64_t i = 0; i < length; ++i) {
+			object[i] = disk->buffer[i];
+		}
+
+		block->value = reinterpret_cast<uint64_t>(object);
+		block->length = static_cast<uint16_t>(length);
+		block->kind = BlockKind::COMPRESSED;
+		disk->statistics.originalBytes += PhysicalMemory::FRAME_SIZE;
+		disk->statistics.compressedBytes += length;
+		++disk->statistics.storedPages;
+		return Swap::StatusCode::SUCCESS;
+	}
+
+	static Swap::StatusCode compressedRead(Swap::Device* device, uint64_t index, void* page) {
+		CompressedDisk* disk = reinterpret_cast<CompressedDisk*>(device);
+		const uint64_t start = CPU::readTimestamp();
+
+		CPU::LockGuard guard(&disk->lock);
+
+		const Block* block = disk->blocks + index;
+		bool valid = true;
+
+		switch (block->kind) {
+			case BlockKind::EMPTY:
+				return Swap::StatusCode::INVALID_PARAMETER;
+			case BlockKind::SAME_FILLED:
+				for (uint64_t i = 0; i < PhysicalMemory::FRAME_SIZE / sizeof(uint64_t); ++i) {
+					static_cast<uint64_t*>(page)[i] = block->value;
+				}
+				break;
+			case BlockKind::COMPRESSED:
+				valid = decompressPage(reinterpret_cast<const uint8_t*>(block->value), block->length, static_cast<uint8_t*>(page));
+				break;
+			case BlockKind::INCOMPRESSIBLE:
+				VirtualMemory::copyPage(page, reinterpret_cast<const void*>(block->value));
+				break;
+		}
+
+		if (!valid) {
+			return Swap::StatusCode::DEVICE_ERROR;
+		}
+
+		const uint64_t cycles = CPU::readTimestamp() - start;
+		++disk->statistics.reads;
+		disk->statistics.readCycles += cycles;
+		if (cycles > disk->statistics.maxReadCycles) {
+			disk->statistics.maxReadCycles = cycles;
+		}
+
+		return Swap::StatusCode::SUCCESS;
+	}
+
+	static void compressedDiscard(Swap::Device* device, uint64_t index) {
+		CompressedDisk* disk = reinterpret_cast<CompressedDisk*>(device);
+		CPU::LockGuard guard(&disk->lock);
+
+		releaseBlock(disk, disk->blocks + index);
+	}
+}
+
+Swap::Device* Swap::CreateCompressedRamDisk(uint64_t pages) {
+	if (pages == 0) {
+		return nullptr;
+	}
+
+	// Writes run when memory is short, so everything they touch is backed now: a kernel page fault cannot reclaim.
+	CompressedDisk* disk = static_cast<CompressedDisk*>(VirtualMemory::AllocateKernelHeap(DISK_PAGES, VirtualMemory::HeapBacking::POPULATED));
+	if (disk == nullptr) {
+		return nullptr;
+	}
+
+	disk->blocksPages = (pages * sizeof(Block) + PhysicalMemory::FRAME_SIZE - 1) / PhysicalMemory::FRAME_SIZE;
+	disk->blocks = static_cast<Block*>(VirtualMemory::AllocateKernelHeap(disk->blocksPages, VirtualMemory::HeapBacking::POPULATED));
+	if (disk->blocks == nullptr) {
+		VirtualMemory::FreeKernelHeap(disk, DISK_PAGES);
+		return nullptr;
+	}
+
+	// kernel heap pages start zeroed, every block is EMPTY
+	static_assert(static_cast<uint8_t>(BlockKind::EMPTY) == 0, "Blocks are not initialized");
+
+	for (uint64_t i = 0; i < SIZE_CLASSES; ++i) {
+		disk->partialSlabs[i] = nullptr;
+	}
+
+	disk->reserveFrames = 0;
+	refillReserve(disk);
+
+	if (disk->reserveFrames < RESERVE_FRAMES) {
+		PhysicalMemory::FreeBatch(disk->reserveFrames, disk->reserve);
+		VirtualMemory::FreeKernelHeap(disk->blocks, disk->blocksPages);
+		VirtualMemory::FreeKernelHeap(disk, DISK_PAGES);
+		return nullptr;
+	}
+
+	disk->statistics = CompressedStatistics {};
+	disk->lock = CPU::Spinlock {};
+
+	disk->device.blocks = pages;
+	disk->device.data = disk;
+	disk->device.read = compressedRead;
+	disk->device.write = compressedWrite;
+	disk->device.discard = compressedDiscard;
+
+	return &disk->device;
+}
+
+Swap::StatusCode Swap::QueryCompressedStatistics(const Device* device, CompressedStatistics* statistics) {
+	if (device == nullptr || statistics == nullptr || device->read != compressedRead) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	CompressedDisk* disk = static_cast<CompressedDisk*>(device->data);
+	CPU::LockGuard guard(&disk->lock);
+
+	*statistics = disk->statistics;
+	return StatusCode::SUCCESS;
+}
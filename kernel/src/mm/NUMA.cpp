@@ -0,0 +1,433 @@
+#include <cpuid.h>
+#include <cstddef>
+#include <cstdint>
+
+#include <cpu/Spinlock.hpp>
+#include <mm/NUMA.hpp>
+#include <mm/PhysicalMemory.hpp>
+#include <mm/VirtualMemory.hpp>
+#include <mm/VirtualMemoryLayout.hpp>
+
+#pragma pack(push)
+#pragma pack(1)
+struct ACPI_RSDP {
+	uint8_t		Signature[8];
+	uint8_t		Checksum;
+	uint8_t		OEMID[6];
+	uint8_t		Revision;
+	uint32_t	RsdtAddress;
+	uint32_t	Length;
+	uint64_t	XsdtAddress;
+	uint8_t		ExtendedChecksum;
+	uint8_t		Reserved[3];
+};
+
+struct ACPI_SDTH {
+	uint8_t		Signature[4];
+	uint32_t	Length;
+	uint8_t		Revision;
+	uint8_t		Checksum;
+	uint8_t		OEMID[6];
+	uint8_t		OEMTableID[8];
+	uint32_t	OEMRevision;
+	uint8_t		CreatorID[4];
+	uint32_t	CreatorRevision;
+};
+
+struct SRAT_ENTRY_HEADER {
+	uint8_t		Type;
+	uint8_t		Length;
+};
+
+struct SRAT_PROCESSOR_AFFINITY {
+	uint8_t		Type;
+	uint8_t		Length;
+	uint8_t		ProximityDomainLow;
+	uint8_t		APICID;
+	uint32_t	Flags;
+	uint8_t		LocalSAPICEID;
+	uint8_t		ProximityDomainHigh[3];
+	uint32_t	ClockDomain;
+};
+
+struct SRAT_MEMORY_AFFINITY {
+	uint8_t		Type;
+	uint8_t		Length;
+	uint32_t	ProximityDomain;
+	uint16_t	Reserved0;
+	uint64_t	BaseAddress;
+	uint64_t	RangeLength;
+	uint32_t	Reserved1;
+	uint32_t	Flags;
+	uint64_t	Reserved2;
+};
+
+struct SRAT_X2APIC_AFFINITY {
+	uint8_t		Type;
+	uint8_t		Length;
+	uint16_t	Reserved0;
+	uint32_t	ProximityDomain;
+	uint32_t	X2APICID;
+	uint32_t	Flags;
+	uint32_t	ClockDomain;
+	uint32_t	Reserved1;
+};
+#pragma pack(pop)
+
+namespace {
+	static constexpr uint64_t ACPI_SDTH_SIZE		= sizeof(ACPI_SDTH);
+	// SRAT: header, 4 reserved bytes (must be 1), 8 reserved bytes
+	static constexpr uint64_t SRAT_ENTRIES_OFFSET	= ACPI_SDTH_SIZE + 12;
+	// SLIT: header, 8 bytes locality count, then a count * count distance matrix
+	static constexpr uint64_t SLIT_MATRIX_OFFSET	= ACPI_SDTH_SIZE + 8;
+
+	static constexpr uint8_t SRAT_PROCESSOR			= 0;
+	static constexpr uint8_t SRAT_MEMORY			= 1;
+	static constexpr uint8_t SRAT_X2APIC			= 2;
+
+	static constexpr uint32_t SRAT_ENABLED			= 0x00000001;
+
+	static constexpr uint64_t MAX_MEMORY_RANGES		= 64;
+
+	struct MemoryRange {
+		uint64_t base;
+		uint64_t end;
+		uint8_t node;
+	};
+
+	static MemoryRange memoryRanges[MAX_MEMORY_RANGES];
+	static uint64_t memoryRangeCount = 0;
+
+	static uint32_t domains[NUMA::MAX_NODES];
+	static uint64_t nodeCount = 1;
+	static uint64_t currentNode = 0;
+
+	static uint8_t distances[NUMA::MAX_NODES][NUMA::MAX_NODES];
+	static uint8_t fallbackOrder[NUMA::MAX_NODES][NUMA::MAX_NODES];
+
+	// copies physical memory through local mappings, one page at a time
+	static bool readPhysical(void* _destination, uint64_t physicalAddress, uint64_t size) {
+		volatile uint8_t* destination = reinterpret_cast<volatile uint8_t*>(_destination);
+
+		while (size > 0) {
+			const uint64_t offset = physicalAddress % PhysicalMemory::FRAME_SIZE;
+			const uint64_t chunk = size < PhysicalMemory::FRAME_SIZE - offset ? size : PhysicalMemory::FRAME_SIZE - offset;
+
+			{
+				CPU::InterruptGuard guard;
+
+				const uint8_t* vpage = reinterpret_cast<const uint8_t*>(VirtualMemory::MapLocalPage(reinterpret_cast<void*>(physicalAddress - offset)));
+				if (vpage == nullptr) {
+					return false;
+				}
+
+				for (size_t i = 0; i < chunk; ++i) {
+					*destination++ = vpage[offset + i];
+				}
+
+				VirtualMemory::UnmapLocalPage(const_cast<uint8_t*>(vpage));
+			}
+
+			physicalAddress += chunk;
+			size -= chunk;
+		}
+
+		return true;
+	}
+
+	static bool isValidTable(uint64_t physicalAddress, uint64_t length) {
+		uint8_t sum = 0;
+		uint8_t buffer[64];
+
+		while (length > 0) {
+			const uint64_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+
+			if (!readPhysical(buffer, physicalAddress, chunk)) {
+				return false;
+			}
+
+			for (size_t i = 0; i < chunk; ++i) {
+				sum += buffer[i];
+			}
+
+			physicalAddress += chunk;
+			length -= chunk;
+		}
+
+		return sum == 0;
+	}
+
+	static inline bool hasSignature(const uint8_t* signature, const char* expected) {
+		return signature[0] == expected[0] && signature[1] == expected[1] && signature[2] == expected[2] && signature[3] == expected[3];
+	}
+
+	// returns the physical address of the table with the given signature through the RSDT/XSDT, 0 if not found
+	static uint64_t findTable(const char* signature) {
+		const uint64_t mmapSize = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_MEMORY_MAP_SIZE_OFFSET);
+		const uint64_t revision = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + mmapSize + VirtualMemoryLayout::BOOT_ACPI_REVISION);
+		const uint64_t RSDPAddress = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + mmapSize + VirtualMemoryLayout::BOOT_ACPI_RSDP);
+
+		if (RSDPAddress == 0) {
+			return 0;
+		}
+
+		ACPI_RSDP RSDP;
+		if (!readPhysical(&RSDP, RSDPAddress, sizeof(ACPI_RSDP))) {
+			return 0;
+		}
+
+		const bool extended = revision >= 2 && RSDP.Revision >= 2 && RSDP.XsdtAddress != 0;
+		const uint64_t rootAddress = extended ? RSDP.XsdtAddress : RSDP.RsdtAddress;
+		const uint64_t entrySize = extended ? sizeof(uint64_t) : sizeof(uint32_t);
+
+		ACPI_SDTH root;
+		if (rootAddress == 0 || !readPhysical(&root, rootAddress, sizeof(ACPI_SDTH)) || root.Length < ACPI_SDTH_SIZE) {
+			return 0;
+		}
+
+		const uint64_t entries = (root.Length - ACPI_SDTH_SIZE) / entrySize;
+
+		for (size_t i = 0; i < entries; ++i) {
+			uint64_t tableAddress = 0;
+			if (!readPhysical(&tableAddress, rootAddress + ACPI_SDTH_SIZE + i * entrySize, entrySize)) {
+				return 0;
+			}
+
+			ACPI_SDTH header;
+			if (tableAddress == 0 || !readPhysical(&header, tableAddress, sizeof(ACPI_SDTH))) {
+				continue;
+			}
+
+			if (hasSignature(header.Signature, signature) && header.Length >= ACPI_SDTH_SIZE && isValidTable(tableAddress, header.Length)) {
+				return tableAddress;
+			}
+		}
+
+		return 0;
+	}
+
+	static uint8_t nodeOfDomain(uint32_t domain) {
+		for (size_t node = 0; node < nodeCount; ++node) {
+			if (domains[node] == domain) {
+				return static_cast<uint8_t>(node);
+			}
+		}
+
+		if (nodeCount == NUMA::MAX_NODES) {
+			return static_cast<uint8_t>(NUMA::MAX_NODES - 1);
+		}
+
+		domains[nodeCount] = domain;
+		return static_cast<uint8_t>(nodeCount++);
+	}
+
+	static void addMemoryRange(uint64_t base, uint64_t length, uint8_t node) {
+		if (length == 0 || memoryRangeCount == MAX_MEMORY_RANGES) {
+			return;
+		}
+
+		// keep the ranges sorted by base address
+		size_t i = memoryRangeCount++;
+		for (; i > 0 && memoryRanges[i - 1].base > base; --i) {
+			memoryRanges[i] = memoryRanges[i - 1];
+		}
+
+		memoryRanges[i] = MemoryRange{ .base = base, .end = base + length, .node = node };
+	}
+
+	static void queryAPICID(uint32_t* APICID, uint32_t* X2APICID) {
+		unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+		__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+		*APICID = ebx >> 24;
+		*X2APICID = *APICID;
+
+		if (__get_cpuid_max(0, nullptr) >= 0xB) {
+			__cpuid_count(0xB, 0, eax, ebx, ecx, edx);
+			if (ebx != 0) {
+				*X2APICID = edx;
+			}
+		}
+	}
+
+	static bool parseSRAT(uint64_t SRATAddress) {
+		ACPI_SDTH header;
+		if (!readPhysical(&header, SRATAddress, sizeof(ACPI_SDTH))) {
+			return false;
+		}
+
+		uint32_t APICID = 0, X2APICID = 0;
+		queryAPICID(&APICID, &X2APICID);
+
+		bool foundMemory = false;
+		uint64_t offset = SRAT_ENTRIES_OFFSET;
+
+		while (offset + sizeof(SRAT_ENTRY_HEADER) <= header.Length) {
+			SRAT_ENTRY_HEADER entry;
+			if (!readPhysical(&entry, SRATAddress + offset, sizeof(SRAT_ENTRY_HEADER)) || entry.Length < sizeof(SRAT_ENTRY_HEADER)) {
+				return false;
+			}
+
+			if (entry.Type == SRAT_PROCESSOR && entry.Length >= sizeof(SRAT_PROCESSOR_AFFINITY)) {
+				SRAT_PROCESSOR_AFFINITY processor;
+				readPhysical(&processor, SRATAddress + offset, sizeof(SRAT_PROCESSOR_AFFINITY));
+
+				if ((processor.Flags & SRAT_ENABLED) != 0) {
+					const uint32_t domain = processor.ProximityDomainLow
+						| (static_cast<uint32_t>(processor.ProximityDomainHigh[0]) << 8)
+						| (static_cast<uint32_t>(processor.ProximityDomainHigh[1]) << 16)
+						| (static_cast<uint32_t>(processor.ProximityDomainHigh[2]) << 24);
+					const uint8_t node = nodeOfDomain(domain);
+
+					if (processor.APICID == APICID) {
+						currentNode = node;
+					}
+				}
+			}
+			else if (entry.Type == SRAT_X2APIC && entry.Length >= sizeof(SRAT_X2APIC_AFFINITY)) {
+				SRAT_X2APIC_AFFINITY processor;
+				readPhysical(&processor, SRATAddress + offset, sizeof(SRAT_X2APIC_AFFINITY));
+
+				if ((processor.Flags & SRAT_ENABLED) != 0) {
+					const uint8_t node = nodeOfDomain(processor.ProximityDomain);
+
+					if (processor.X2APICID == X2APICID) {
+						currentNode = node;
+					}
+				}
+			}
+			else if (entry.Type == SRAT_MEMORY && entry.Length >= sizeof(SRAT_MEMORY_AFFINITY)) {
+				SRAT_MEMORY_AFFINITY memory;
+				readPhysical(&memory, SRATAddress + offset, sizeof(SRAT_MEMORY_AFFINITY));
+
+				if ((memory.Flags & SRAT_ENABLED) != 0) {
+					addMemoryRange(memory.BaseAddress, memory.RangeLength, nodeOfDomain(memory.ProximityDomain));
+					foundMemory = true;
+				}
+			}
+
+			offset += entry.Length;
+		}
+
+		return foundMemory;
+	}
+
+	static void parseSLIT(uint64_t SLITAddress) {
+		uint64_t localities = 0;
+		if (!readPhysical(&localities, SLITAddress + ACPI_SDTH_SIZE, sizeof(uint64_t))) {
+			return;
+		}
+
+		for (size_t from = 0; from < nodeCount; ++from) {
+			for (size_t to = 0; to < nodeCount; ++to) {
+				if (domains[from] >= localities || domains[to] >= localities) {
+					continue;
+				}
+
+				uint8_t distance = 0;
+				readPhysical(&distance, SLITAddress + SLIT_MATRIX_OFFSET + domains[from] * localities + domains[to], sizeof(uint8_t));
+
+				// 0xFF marks unreachable localities, keep them last
+				distances[from][to] = distance;
+			}
+		}
+	}
+
+	static void setupDistances() {
+		for (size_t from = 0; from < NUMA::MAX_NODES; ++from) {
+			for (size_t to = 0; to < NUMA::MAX_NODES; ++to) {
+				distances[from][to] = from == to ? NUMA::LOCAL_DISTANCE : NUMA::REMOTE_DISTANCE;
+			}
+		}
+	}
+
+	static void setupFallbackOrder() {
+		for (size_t node = 0; node < nodeCount; ++node) {
+			uint8_t* order = fallbackOrder[node];
+
+			order[0] = static_cast<uint8_t>(node);
+			size_t count = 1;
+
+			// insertion sort by distance, ties keep the lowest node first
+			for (size_t other = 0; other < nodeCount; ++other) {
+				if (other == node) {
+					continue;
+				}
+
+				size_t i = count++;
+				for (; i > 1 && distances[node][order[i - 1]] > distances[node][other]; --i) {
+					order[i] = order[i - 1];
+				}
+
+				order[i] = static_cast<uint8_t>(other);
+			}
+		}
+	}
+}
+
+NUMA::StatusCode NUMA::Setup() {
+	setupDistances();
+
+	const uint64_t SRATAddress = findTable("SRAT");
+	if (SRATAddress == 0) {
+		return StatusCode::NOT_SUPPORTED;
+	}
+
+	nodeCount = 0;
+	memoryRangeCount = 0;
+
+	if (!parseSRAT(SRATAddress) || nodeCount == 0) {
+		nodeCount = 1;
+		memoryRangeCount = 0;
+		currentNode = 0;
+		return StatusCode::INVALID_TABLE;
+	}
+
+	const uint64_t SLITAddress = findTable("SLIT");
+	if (SLITAddress != 0) {
+		parseSLIT(SLITAddress);
+	}
+
+	setupFallbackOrder();
+
+	return StatusCode::SUCCESS;
+}
+
+uint64_t NUMA::QueryNodeCount() {
+	return nodeCount;
+}
+
+uint64_t NUMA::QueryCurrentNode() {
+	// application processors are not started yet, this is the node of the bootstrap processor
+	return currentNode;
+}
+
+uint64_t NUMA::QueryNode(uint64_t physicalAddress, uint64_t* end) {
+	for (size_t i = 0; i < memoryRangeCount; ++i) {
+		if (physicalAddress < memoryRanges[i].base) {
+			// not described by the SRAT, attributed to the first node up to the next range
+			*end = memoryRanges[i].base;
+			return 0;
+		}
+
+		if (physicalAddress < memoryRanges[i].end) {
+			*end = memoryRanges[i].end;
+			return memoryRanges[i].node;
+		}
+	}
+
+	*end = ~static_cast<uint64_t>(0);
+	return 0;
+}
+
+uint8_t NUMA::QueryDistance(uint64_t from, uint64_t to) {
+	if (from >= nodeCount || to >= nodeCount) {
+		return 0xFF;
+	}
+
+	return distances[from][to];
+}
+
+const uint8_t* NUMA::QueryFallbackOrder(uint64_t node) {
+	return fallbackOrder[node < nodeCount ? node : 0];
+}
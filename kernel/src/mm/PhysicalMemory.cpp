@@ -1,235 +1,1744 @@
-#include <cpuid.h>
 #include <cstdint>
 
 #include <efi.h>
 
+#include <cpu/CPU.hpp>
+#include <cpu/Spinlock.hpp>
+#include <mm/NUMA.hpp>
 #include <mm/PhysicalMemory.hpp>
 #include <mm/VirtualMemory.hpp>
 #include <mm/VirtualMemoryLayout.hpp>
+#include <screen/Log.hpp>
 
-struct MemMapBlock {
-	uint64_t physicalAddress;
-	uint64_t availablePages;
-};
+namespace {
+	using PhysicalMemory::PageFrame;
+	using PhysicalMemory::NO_FRAME;
+	using PhysicalMemory::FRAME_USABLE;
+	using PhysicalMemory::FRAME_FREE;
+	using PhysicalMemory::FRAME_CACHED;
+	using PhysicalMemory::FRAME_RESERVED;
+	using PhysicalMemory::FRAME_PINNED;
+	using PhysicalMemory::FRAME_PAGE_TABLE;
+	using PhysicalMemory::FRAME_DMA;
+	using PhysicalMemory::FRAME_LRU;
+	using PhysicalMemory::FRAME_USER_FLAGS;
+
+	static constexpr uint64_t FRAMES_PER_MAP_PAGE	= PhysicalMemory::FRAME_SIZE / sizeof(PageFrame);
+	static constexpr uint64_t MAX_FRAMES			= VirtualMemoryLayout::PHYSICAL_MEMORY_MAP_SIZE / sizeof(PageFrame);
+
+	static_assert(MAX_FRAMES <= NO_FRAME, "Frame numbers must fit in the 32 bits links of the free lists");
+
+	static PageFrame* const frames = reinterpret_cast<PageFrame*>(VirtualMemoryLayout::PHYSICAL_MEMORY_MAP);
+	static uint64_t frameCount = 0;
+
+	// one set of buddy free lists per NUMA node, blocks never span two nodes
+	struct Zone {
+		uint32_t freeLists[PhysicalMemory::MAX_ORDER + 1];
+		uint64_t freeBlocks[PhysicalMemory::MAX_ORDER + 1];
+		uint64_t availableMemory;
+
+		// allocated frames, most recently used first, linked through the same fields as the free lists
+		uint32_t lruHead;
+		uint32_t lruTail;
+		uint64_t lruFrames;
+	};
+
+	static Zone zones[NUMA::MAX_NODES];
+
+	// sum of the available memory of every zone
+	static uint64_t availableMemory = 0;
+
+	// protects the zones, the LRU lists, the depot, the reserves and the zero pool,
+	// the magazines of a CPU only need interrupts to be disabled
+	static CPU::Spinlock allocatorLock;
+
+	static constexpr uint64_t DMA_PAGES			= (VirtualMemoryLayout::DMA_ZONE_SIZE / PhysicalMemory::FRAME_SIZE);
+	static constexpr uint64_t DMA_BITMAP_SIZE	= (DMA_PAGES / 8);
+	static constexpr uint64_t DMA_BITMAP_WORDS	= (DMA_PAGES / 64);
+
+	// copy of the loader's DMA bitmap, so it can be scanned a qword at a time
+	static uint64_t DMA_bitmap[DMA_BITMAP_WORDS];
+	// next-fit position: searches start where the previous allocation ended
+	static uint64_t DMA_hint = 0;
+	static CPU::Spinlock DMALock;
+
+	static inline void pushBlock(uint32_t frame, uint64_t order) {
+		PageFrame* entry = frames + frame;
+		Zone* zone = zones + entry->node;
+
+		entry->next = zone->freeLists[order];
+		entry->prev = NO_FRAME;
+		entry->order = static_cast<uint8_t>(order);
+		entry->flags |= FRAME_FREE;
+
+		if (entry->next != NO_FRAME) {
+			frames[entry->next].prev = frame;
+		}
+
+		zone->freeLists[order] = frame;
+		++zone->freeBlocks[order];
+	}
+
+	static inline void unlinkBlock(uint32_t frame, uint64_t order) {
+		PageFrame* entry = frames + frame;
+		Zone* zone = zones + entry->node;
+
+		if (entry->prev != NO_FRAME) {
+			frames[entry->prev].next = entry->next;
+		}
+		else {
+			zone->freeLists[order] = entry->next;
+		}
+
+		if (entry->next != NO_FRAME) {
+			frames[entry->next].prev = entry->prev;
+		}
+
+		entry->flags &= ~FRAME_FREE;
+		--zone->freeBlocks[order];
+	}
+
+	// returns the first frame of a block of 2^order frames taken from the zone of node, or NO_FRAME
+	static inline uint32_t allocateZoneBlock(uint64_t order, uint64_t node) {
+		Zone* zone = zones + node;
+		uint64_t current = order;
+
+		while (current <= PhysicalMemory::MAX_ORDER && zone->freeLists[current] == NO_FRAME) {
+			++current;
+		}
+
+		if (current > PhysicalMemory::MAX_ORDER) {
+			return NO_FRAME;
+		}
+
+		const uint32_t frame = zone->freeLists[current];
+		unlinkBlock(frame, current);
+
+		// give back the upper halves until the block has the requested size
+		while (current > order) {
+			--current;
+			pushBlock(frame + (static_cast<uint32_t>(1) << current), current);
+		}
+
+		frames[frame].order = static_cast<uint8_t>(order);
+		zone->availableMemory -= PhysicalMemory::FRAME_SIZE << order;
+		availableMemory -= PhysicalMemory::FRAME_SIZE << order;
+
+		return frame;
+	}
+
+	// tries the zones by increasing distance from node
+	static inline uint32_t allocateBlock(uint64_t order, uint64_t node) {
+		const uint8_t* fallback = NUMA::QueryFallbackOrder(node);
+		const uint64_t nodes = NUMA::QueryNodeCount();
+
+		for (size_t i = 0; i < nodes; ++i) {
+			const uint32_t frame = allocateZoneBlock(order, fallback[i]);
+			if (frame != NO_FRAME) {
+				return frame;
+			}
+		}
+
+		return NO_FRAME;
+	}
+
+	static inline uint32_t allocateBlock(uint64_t order) {
+		return allocateBlock(order, NUMA::QueryCurrentNode());
+	}
+
+	// releases a block of 2^order frames, merging it with its buddies as long as they are free and on the same node
+	static inline void releaseBlock(uint32_t frame, uint64_t order) {
+		const uint8_t node = frames[frame].node;
+
+		zones[node].availableMemory += PhysicalMemory::FRAME_SIZE << order;
+		availableMemory += PhysicalMemory::FRAME_SIZE << order;
+
+		while (order < PhysicalMemory::MAX_ORDER) {
+			const uint32_t buddy = frame ^ (static_cast<uint32_t>(1) << order);
+
+			if (buddy + (static_cast<uint64_t>(1) << order) > frameCount) {
+				break;
+			}
+
+			const PageFrame* buddyEntry = frames + buddy;
+
+			if ((buddyEntry->flags & FRAME_FREE) == 0 || buddyEntry->order != order || buddyEntry->node != node) {
+				break;
+			}
+
+			unlinkBlock(buddy, order);
+			frame &= ~(static_cast<uint32_t>(1) << order);
+			++order;
+		}
+
+		pushBlock(frame, order);
+	}
+
+	// releases every frame in [first, first + count) as the largest naturally aligned blocks possible,
+	// the frames must already be usable and belong to the same node
+	static inline void releaseFrames(uint64_t first, uint64_t count) {
+		while (count > 0) {
+			uint64_t order = 63 - __builtin_clzll(count);
+
+			if (first != 0 && static_cast<uint64_t>(__builtin_ctzll(first)) < order) {
+				order = __builtin_ctzll(first);
+			}
+			if (order > PhysicalMemory::MAX_ORDER) {
+				order = PhysicalMemory::MAX_ORDER;
+			}
+
+			releaseBlock(static_cast<uint32_t>(first), order);
+
+			first += static_cast<uint64_t>(1) << order;
+			count -= static_cast<uint64_t>(1) << order;
+		}
+	}
+
+	static inline void releaseRange(uint64_t first, uint64_t count) {
+		for (uint64_t frame = first; frame < first + count; ++frame) {
+			frames[frame].flags = FRAME_USABLE;
+			frames[frame].refcount = 0;
+			frames[frame].node = 0;
+		}
+
+		releaseFrames(first, count);
+	}
+
+	static inline void lruPush(uint32_t frame) {
+		PageFrame* entry = frames + frame;
+		Zone* zone = zones + entry->node;
+
+		entry->next = zone->lruHead;
+		entry->prev = NO_FRAME;
+		entry->flags |= FRAME_LRU;
+
+		if (entry->next != NO_FRAME) {
+			frames[entry->next].prev = frame;
+		}
+		else {
+			zone->lruTail = frame;
+		}
+
+		zone->lruHead = frame;
+		++zone->lruFrames;
+	}
+
+	static inline void lruUnlink(uint32_t frame) {
+		PageFrame* entry = frames + frame;
+		Zone* zone = zones + entry->node;
+
+		if (entry->prev != NO_FRAME) {
+			frames[entry->prev].next = entry->next;
+		}
+		else {
+			zone->lruHead = entry->next;
+		}
+
+		if (entry->next != NO_FRAME) {
+			frames[entry->next].prev = entry->prev;
+		}
+		else {
+			zone->lruTail = entry->prev;
+		}
+
+		entry->flags &= ~FRAME_LRU;
+		--zone->lruFrames;
+	}
+
+	// returns the entry of an allocated frame of the buddy allocator, or nullptr
+	static inline PageFrame* allocatedFrame(const void* ptr) {
+		const uint64_t address = reinterpret_cast<uint64_t>(ptr);
+		const uint64_t frame = address / PhysicalMemory::FRAME_SIZE;
+
+		if (address % PhysicalMemory::FRAME_SIZE != 0 || frame >= frameCount) {
+			return nullptr;
+		}
+
+		PageFrame* entry = frames + frame;
+
+		if ((entry->flags & FRAME_USABLE) == 0 || entry->refcount == 0) {
+			return nullptr;
+		}
+
+		return entry;
+	}
+
+	static inline void* handOut(uint32_t frame) {
+		frames[frame].refcount = 1;
+		return reinterpret_cast<void*>(static_cast<uint64_t>(frame) * PhysicalMemory::FRAME_SIZE);
+	}
+
+	// rejects frames that are not managed here (DMA zone, holes, firmware memory) and double frees
+	static inline bool isReleasable(const PageFrame* entry) {
+		return (entry->flags & FRAME_USABLE) != 0
+			&& (entry->flags & (FRAME_FREE | FRAME_CACHED | FRAME_RESERVED)) == 0
+			&& entry->refcount != 0;
+	}
+
+	// drops a reference, returns true when it was the last one and the frame can go back to the allocator
+	static inline bool dropReference(uint32_t frame) {
+		PageFrame* entry = frames + frame;
+
+		// shared frames are only released with their last reference
+		if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+			return false;
+		}
+
+		if ((entry->flags & FRAME_LRU) != 0) {
+			CPU::LockGuard guard(&allocatorLock);
+
+			if ((entry->flags & FRAME_LRU) != 0) {
+				lruUnlink(frame);
+			}
+		}
+
+		entry->flags &= ~FRAME_USER_FLAGS;
+		return true;
+	}
+
+	// hands out whole blocks as single frames, largest blocks first, returns the number of frames written to batch
+	static inline uint64_t allocateBatch(uint64_t count, void** batch) {
+		uint64_t taken = 0;
+		uint64_t order = PhysicalMemory::MAX_ORDER;
+
+		while (taken < count) {
+			const uint64_t fit = 63 - __builtin_clzll(count - taken);
+			if (order > fit) {
+				order = fit;
+			}
+
+			// once a size fails, no larger block is left either
+			uint32_t block = allocateBlock(order);
+			while (block == NO_FRAME && order > 0) {
+				block = allocateBlock(--order);
+			}
+
+			if (block == NO_FRAME) {
+				break;
+			}
+
+			// every frame is freed on its own, as an order 0 block
+			for (uint32_t i = 0; i < (static_cast<uint32_t>(1) << order); ++i) {
+				frames[block + i].order = 0;
+				batch[taken++] = handOut(block + i);
+			}
+		}
+
+		return taken;
+	}
+}
+
+namespace {
+	static inline uint64_t lowMask(uint64_t bits) {
+		return (static_cast<uint64_t>(1) << bits) - 1;
+	}
+
+	static inline uint64_t alignUp(uint64_t value, uint64_t alignment) {
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+
+	// returns the first free DMA page in [page, limit), or limit
+	static inline uint64_t findFreeDMAPage(uint64_t page, uint64_t limit) {
+		while (page < limit) {
+			const uint64_t word = DMA_bitmap[page / 64] | lowMask(page % 64);
+
+			if (word != ~static_cast<uint64_t>(0)) {
+				page = (page & ~static_cast<uint64_t>(63)) + __builtin_ctzll(~word);
+				return page < limit ? page : limit;
+			}
+
+			page = (page & ~static_cast<uint64_t>(63)) + 64;
+		}
+
+		return limit;
+	}
+
+	// returns the first allocated DMA page in [page, limit), or limit
+	static inline uint64_t findUsedDMAPage(uint64_t page, uint64_t limit) {
+		while (page < limit) {
+			const uint64_t word = DMA_bitmap[page / 64] & ~lowMask(page % 64);
+
+			if (word != 0) {
+				page = (page & ~static_cast<uint64_t>(63)) + __builtin_ctzll(word);
+				return page < limit ? page : limit;
+			}
+
+			page = (page & ~static_cast<uint64_t>(63)) + 64;
+		}
+
+		return limit;
+	}
+
+	// looks for a run of free pages starting in [page, limit - pages], alignment and boundary are in pages (0 for no boundary)
+	static inline uint64_t findFreeDMARun(uint64_t page, uint64_t limit, uint64_t pages, uint64_t alignment, uint64_t boundary) {
+		page = alignUp(page, alignment);
+
+		while (page + pages <= limit) {
+			page = alignUp(findFreeDMAPage(page, limit), alignment);
+
+			if (page + pages > limit) {
+				break;
+			}
+
+			if (boundary != 0 && (page & ~(boundary - 1)) != ((page + pages - 1) & ~(boundary - 1))) {
+				// the run would cross a boundary, restart from the boundary itself
+				page = alignUp(page + 1, boundary);
+				continue;
+			}
+
+			const uint64_t used = findUsedDMAPage(page, page + pages);
+			if (used == page + pages) {
+				return page;
+			}
+
+			page = alignUp(used + 1, alignment);
+		}
+
+		return DMA_PAGES;
+	}
+
+	static inline void setDMARange(uint64_t page, uint64_t pages, bool allocated) {
+		while (pages > 0) {
+			const uint64_t bit = page % 64;
+			const uint64_t count = pages < 64 - bit ? pages : 64 - bit;
+			const uint64_t mask = (count == 64 ? ~static_cast<uint64_t>(0) : lowMask(count)) << bit;
+
+			if (allocated) {
+				DMA_bitmap[page / 64] |= mask;
+			}
+			else {
+				DMA_bitmap[page / 64] &= ~mask;
+			}
+
+			page += count;
+			pages -= count;
+		}
+	}
+}
+
+namespace {
+	// Per-CPU frame caches, following the magazine and depot design:
+	// each CPU owns a loaded and a previous magazine, and exchanges whole magazines with a shared depot.
+	// The depot is refilled from, and drained to, the buddy allocator a magazine at a time.
+	// A CPU owns its magazines with interrupts disabled, only the depot and the buddy allocator need allocatorLock.
+
+	static constexpr uint64_t MAGAZINE_ORDER	= 5;
+	static constexpr uint64_t MAGAZINE_SIZE		= static_cast<uint64_t>(1) << MAGAZINE_ORDER;
+	static constexpr uint64_t DEPOT_MAGAZINES	= 64;
+	static constexpr uint64_t TOTAL_MAGAZINES	= 2 * CPU::MAX_CPUS + DEPOT_MAGAZINES;
+
+	// the frames of a magazine all come from the same node
+	struct Magazine {
+		uint64_t rounds;
+		uint64_t node;		// only meaningful while rounds > 0
+		uint32_t frames[MAGAZINE_SIZE];
+	};
+
+	struct alignas(64) FrameCache {
+		Magazine* loaded;
+		Magazine* previous;
+
+		uint64_t allocationHits;
+		uint64_t allocationMisses;
+		uint64_t freeHits;
+		uint64_t freeMisses;
+	};
+
+	static Magazine magazines[TOTAL_MAGAZINES];
+	static FrameCache frameCaches[CPU::MAX_CPUS];
+
+	static struct {
+		Magazine* full[TOTAL_MAGAZINES];
+		Magazine* empty[TOTAL_MAGAZINES];
+		uint64_t fullCount;
+		uint64_t emptyCount;
+		uint64_t frames;			// frames held by the full magazines
+
+		uint64_t lowWatermark;		// refills bring the depot back up to this many frames
+		uint64_t highWatermark;		// above this many frames, the depot is drained down to the low watermark
+
+		uint64_t refills;
+		uint64_t drains;
+	} depot;
+
+	// only takes frames of node, remote memory is never cached
+	static inline void fillMagazine(Magazine* magazine, uint64_t node) {
+		// take a whole block when possible, so a refill costs a single trip through the free lists
+		const uint32_t block = magazine->rounds == 0 ? allocateZoneBlock(MAGAZINE_ORDER, node) : NO_FRAME;
+		magazine->node = node;
+
+		if (block != NO_FRAME) {
+			for (uint32_t i = 0; i < MAGAZINE_SIZE; ++i) {
+				frames[block + i].flags |= FRAME_CACHED;
+				magazine->frames[i] = block + i;
+			}
+			magazine->rounds = MAGAZINE_SIZE;
+			return;
+		}
+
+		while (magazine->rounds < MAGAZINE_SIZE) {
+			const uint32_t frame = allocateZoneBlock(0, node);
+			if (frame == NO_FRAME) {
+				break;
+			}
+
+			frames[frame].flags |= FRAME_CACHED;
+			magazine->frames[magazine->rounds++] = frame;
+		}
+	}
+
+	static inline void drainMagazine(Magazine* magazine) {
+		while (magazine->rounds > 0) {
+			const uint32_t frame = magazine->frames[--magazine->rounds];
+
+			frames[frame].flags &= ~FRAME_CACHED;
+			releaseBlock(frame, 0);
+		}
+	}
+
+	// removes a full magazine of node from the depot, or returns nullptr
+	static inline Magazine* takeFullMagazine(uint64_t node) {
+		for (uint64_t i = depot.fullCount; i > 0; --i) {
+			Magazine* magazine = depot.full[i - 1];
+
+			if (magazine->node == node) {
+				depot.full[i - 1] = depot.full[--depot.fullCount];
+				depot.frames -= magazine->rounds;
+				return magazine;
+			}
+		}
+
+		return nullptr;
+	}
+
+	// brings the full magazines of node back up to the low watermark, returns false if none could be filled
+	static inline bool refillDepot(uint64_t node) {
+		uint64_t target = depot.lowWatermark / MAGAZINE_SIZE;
+		if (target == 0) {
+			target = 1;
+		}
+
+		uint64_t count = 0;
+		for (uint64_t i = 0; i < depot.fullCount; ++i) {
+			count += depot.full[i]->node == node ? 1 : 0;
+		}
+
+		const uint64_t initialCount = count;
+
+		while (count < target && depot.emptyCount > 0) {
+			Magazine* magazine = depot.empty[depot.emptyCount - 1];
+
+			fillMagazine(magazine, node);
+			if (magazine->rounds == 0) {
+				break;
+			}
+
+			--depot.emptyCount;
+			depot.full[depot.fullCount++] = magazine;
+			depot.frames += magazine->rounds;
+			++depot.refills;
+			++count;
+		}
+
+		return count > initialCount;
+	}
+
+	static inline void drainDepot(uint64_t targetFrames) {
+		while (depot.frames > targetFrames && depot.fullCount > 0) {
+			Magazine* magazine = depot.full[--depot.fullCount];
+
+			depot.frames -= magazine->rounds;
+			drainMagazine(magazine);
+			depot.empty[depot.emptyCount++] = magazine;
+			++depot.drains;
+		}
+	}
+
+	static inline uint32_t cacheAllocate() {
+		CPU::InterruptGuard guard;
+		FrameCache* cache = frameCaches + CPU::currentIndex();
+
+		if (cache->loaded->rounds > 0) {
+			++cache->allocationHits;
+		}
+		else if (cache->previous->rounds > 0) {
+			Magazine* temp = cache->loaded;
+			cache->loaded = cache->previous;
+			cache->previous = temp;
+			++cache->allocationHits;
+		}
+		else {
+			CPU::LockGuard depotGuard(&allocatorLock);
+			++cache->allocationMisses;
+
+			// the magazines of the other nodes stay in the depot, remote frames are never cached
+			const uint64_t node = NUMA::QueryCurrentNode();
+			Magazine* full = takeFullMagazine(node);
+
+			if (full == nullptr && refillDepot(node)) {
+				full = takeFullMagazine(node);
+			}
+			if (full == nullptr) {
+				return NO_FRAME;
+			}
+
+			// trade the empty previous magazine for a full one
+			depot.empty[depot.emptyCount++] = cache->previous;
+
+			cache->previous = cache->loaded;
+			cache->loaded = full;
+		}
+
+		const uint32_t frame = cache->loaded->frames[--cache->loaded->rounds];
+		frames[frame].flags &= ~FRAME_CACHED;
+
+		return frame;
+	}
+
+	static inline void cacheFree(uint32_t frame) {
+		// the caches only hold memory local to their CPU, frames of other nodes go straight back to their zone
+		// and the depot hands a CPU only the magazines of its node
+		if (frames[frame].node != NUMA::QueryCurrentNode()) {
+			CPU::LockGuard guard(&allocatorLock);
+			releaseBlock(frame, 0);
+			return;
+		}
+
+		CPU::InterruptGuard guard;
+		FrameCache* cache = frameCaches + CPU::currentIndex();
+
+		if (cache->loaded->rounds < MAGAZINE_SIZE) {
+			++cache->freeHits;
+		}
+		else if (cache->previous->rounds == 0) {
+			Magazine* temp = cache->loaded;
+			cache->loaded = cache->previous;
+			cache->previous = temp;
+			++cache->freeHits;
+		}
+		else {
+			CPU::LockGuard depotGuard(&allocatorLock);
+			++cache->freeMisses;
+
+			if (depot.emptyCount == 0) {
+				// every magazine is in use, give the frames of the previous one back instead
+				drainMagazine(cache->previous);
+				++depot.drains;
+			}
+			else {
+				// trade the full previous magazine for an empty one
+				depot.full[depot.fullCount++] = cache->previous;
+				depot.frames += cache->previous->rounds;
+				cache->previous = depot.empty[--depot.emptyCount];
+			}
+
+			Magazine* temp = cache->loaded;
+			cache->loaded = cache->previous;
+			cache->previous = temp;
+
+			if (depot.frames > depot.highWatermark) {
+				drainDepot(depot.lowWatermark);
+			}
+		}
+
+		if (cache->loaded->rounds == 0) {
+			cache->loaded->node = frames[frame].node;
+		}
+
+		frames[frame].flags |= FRAME_CACHED;
+		cache->loaded->frames[cache->loaded->rounds++] = frame;
+	}
+
+	// empties the magazines of the current CPU into batch without going through the depot, returns the number of frames taken
+	static inline uint64_t cacheAllocateBatch(uint64_t count, void** batch) {
+		CPU::InterruptGuard guard;
+		FrameCache* cache = frameCaches + CPU::currentIndex();
+		Magazine* const loaded[2] = { cache->loaded, cache->previous };
+		uint64_t taken = 0;
+
+		for (Magazine* magazine : loaded) {
+			while (taken < count && magazine->rounds > 0) {
+				const uint32_t frame = magazine->frames[--magazine->rounds];
+
+				frames[frame].flags &= ~FRAME_CACHED;
+				batch[taken++] = handOut(frame);
+			}
+		}
+
+		cache->allocationHits += taken;
+
+		return taken;
+	}
+
+	// runs of contiguous frames skip the caches, so the blocks split by allocateBatch merge back right away
+	static inline void releaseBatchRun(uint64_t first, uint64_t count) {
+		if (count == 1) {
+			cacheFree(static_cast<uint32_t>(first));
+		}
+		else if (count > 1) {
+			CPU::LockGuard guard(&allocatorLock);
+			releaseFrames(first, count);
+		}
+	}
+
+	// the magazines of the other CPUs are read without synchronization, the result is only a snapshot
+	static inline uint64_t countCachedFrames() {
+		uint64_t cached = depot.frames;
+
+		for (size_t cpu = 0; cpu < CPU::MAX_CPUS; ++cpu) {
+			cached += frameCaches[cpu].loaded->rounds + frameCaches[cpu].previous->rounds;
+		}
+
+		return cached;
+	}
+
+	// gives every frame cached by the depot and the current CPU back to the buddy allocator, allocatorLock must be held
+	static inline void flushFrameCaches() {
+		FrameCache* cache = frameCaches + CPU::currentIndex();
+
+		drainMagazine(cache->loaded);
+		drainMagazine(cache->previous);
+		drainDepot(0);
+	}
+
+	static inline void setupFrameCaches() {
+		for (size_t cpu = 0; cpu < CPU::MAX_CPUS; ++cpu) {
+			frameCaches[cpu].loaded = magazines + 2 * cpu;
+			frameCaches[cpu].previous = magazines + 2 * cpu + 1;
+		}
+
+		for (size_t i = 2 * CPU::MAX_CPUS; i < TOTAL_MAGAZINES; ++i) {
+			depot.empty[depot.emptyCount++] = magazines + i;
+		}
+
+		depot.lowWatermark = 4 * MAGAZINE_SIZE;
+		depot.highWatermark = 16 * MAGAZINE_SIZE;
+	}
+}
+
+namespace {
+	// Pool of frames zeroed ahead of time by the idle tasks, the frames are allocated as far as the buddy allocator is concerned.
+	// The pool is protected by allocatorLock, frames are zeroed without holding it.
+	static constexpr uint64_t ZERO_POOL_SIZE = 512;
+
+	static uint32_t zeroPool[ZERO_POOL_SIZE];
+	static uint64_t zeroPoolFrames = 0;
+
+	// zeroes a frame through the direct map, without pulling it into the caches
+	static inline void zeroFrame(uint32_t frame) {
+		VirtualMemory::zeroPageNonTemporal(VirtualMemory::PhysToVirt(static_cast<uint64_t>(frame) * PhysicalMemory::FRAME_SIZE));
+	}
+
+	static inline uint32_t takeZeroedFrame() {
+		if (zeroPoolFrames == 0) {
+			return NO_FRAME;
+		}
+
+		return zeroPool[--zeroPoolFrames];
+	}
+
+	// gives the zeroed frames back to the buddy allocator
+	static inline void flushZeroPool() {
+		while (zeroPoolFrames > 0) {
+			releaseBlock(zeroPool[--zeroPoolFrames], 0);
+		}
+	}
+}
+
+namespace {
+	// Per-node reserves of 2 MB and 1 GB blocks, set aside at setup and refilled by frees,
+	// so large mappings still find memory once the free lists are fragmented.
+	// The reserves are only used when the buddy allocator cannot serve a block of the same size,
+	// or as the last resort of the single frame allocations, in which case the idle tasks refill them later.
+
+	static constexpr uint64_t RESERVE_CLASSES		= 2;
+	static constexpr uint64_t HUGE_RESERVE			= 0;
+	static constexpr uint64_t LARGE_RESERVE			= 1;
+	static constexpr uint64_t RESERVE_CAPACITY		= 64;
+	// a zone never gives more than 1/RESERVE_SHARE of its free memory to a reserve
+	static constexpr uint64_t RESERVE_SHARE			= 8;
+
+	// largest class first, so 2 MB reserves do not break up the 1 GB blocks
+	static constexpr uint64_t reserveOrders[RESERVE_CLASSES] = { PhysicalMemory::HUGE_PAGE_ORDER, PhysicalMemory::LARGE_PAGE_ORDER };
+
+	struct BlockReserve {
+		uint32_t blocks[RESERVE_CAPACITY];
+		uint64_t count;
+	};
+
+	static BlockReserve reserves[NUMA::MAX_NODES][RESERVE_CLASSES];
+	static uint64_t reserveTargets[RESERVE_CLASSES] = { 1, 16 };
+	static uint64_t reserveHits = 0;
+	static uint64_t reserveTrims = 0;
+	static bool reservesTrimmed = false;		// a reserve gave a block up to the single frame allocations
+
+	static inline int64_t reserveClass(uint64_t order) {
+		for (size_t i = 0; i < RESERVE_CLASSES; ++i) {
+			if (reserveOrders[i] == order) {
+				return i;
+			}
+		}
+
+		return -1;
+	}
+
+	static inline void fillReserves(uint64_t node) {
+		for (size_t i = 0; i < RESERVE_CLASSES; ++i) {
+			BlockReserve* reserve = &reserves[node][i];
+			const uint64_t blockSize = PhysicalMemory::FRAME_SIZE << reserveOrders[i];
+
+			while (reserve->count < reserveTargets[i] && zones[node].availableMemory >= RESERVE_SHARE * blockSize) {
+				const uint32_t block = allocateZoneBlock(reserveOrders[i], node);
+				if (block == NO_FRAME) {
+					break;
+				}
+
+				frames[block].flags |= FRAME_RESERVED;
+				reserve->blocks[reserve->count++] = block;
+			}
+		}
+	}
+
+	// gives the blocks above the targets back to the buddy allocator, everything when all is true
+	static inline void trimReserves(uint64_t node, bool all) {
+		for (size_t i = 0; i < RESERVE_CLASSES; ++i) {
+			BlockReserve* reserve = &reserves[node][i];
+			const uint64_t target = all ? 0 : reserveTargets[i];
+
+			while (reserve->count > target) {
+				const uint32_t block = reserve->blocks[--reserve->count];
+
+				frames[block].flags &= ~FRAME_RESERVED;
+				releaseBlock(block, reserveOrders[i]);
+			}
+		}
+	}
+
+	static inline uint32_t takeReserved(uint64_t order, uint64_t node) {
+		const int64_t i = reserveClass(order);
+		if (i < 0 || reserves[node][i].count == 0) {
+			return NO_FRAME;
+		}
+
+		const uint32_t block = reserves[node][i].blocks[--reserves[node][i].count];
+		frames[block].flags &= ~FRAME_RESERVED;
+		++reserveHits;
+
+		return block;
+	}
+
+	// keeps a freed block if the reserve of its node is below target, returns false if the block was not taken
+	static inline bool refillReserve(uint32_t block, uint64_t order) {
+		const int64_t i = reserveClass(order);
+		if (i < 0) {
+			return false;
+		}
+
+		BlockReserve* reserve = &reserves[frames[block].node][i];
+		if (reserve->count >= reserveTargets[i]) {
+			return false;
+		}
+
+		frames[block].flags |= FRAME_RESERVED;
+		reserve->blocks[reserve->count++] = block;
+
+		return true;
+	}
+
+	// the free lists of every node by increasing distance first, then their reserves in the same order
+	static inline uint32_t allocateLargeBlock(uint64_t order) {
+		const uint32_t block = allocateBlock(order);
+		if (block != NO_FRAME) {
+			return block;
+		}
+
+		const uint8_t* fallback = NUMA::QueryFallbackOrder(NUMA::QueryCurrentNode());
+		const uint64_t nodes = NUMA::QueryNodeCount();
+
+		for (size_t i = 0; i < nodes; ++i) {
+			const uint32_t reserved = takeReserved(order, fallback[i]);
+			if (reserved != NO_FRAME) {
+				return reserved;
+			}
+		}
+
+		return NO_FRAME;
+	}
+
+	// Gives a reserved block back to the free lists once single frames ran out, nearest node and smallest block first.
+	// Returns false when every reserve is empty.
+	static inline bool releaseReservedBlock() {
+		const uint8_t* fallback = NUMA::QueryFallbackOrder(NUMA::QueryCurrentNode());
+		const uint64_t nodes = NUMA::QueryNodeCount();
+
+		for (size_t i = 0; i < nodes; ++i) {
+			for (size_t j = RESERVE_CLASSES; j > 0; --j) {
+				BlockReserve* reserve = &reserves[fallback[i]][j - 1];
+				if (reserve->count == 0) {
+					continue;
+				}
+
+				const uint32_t block = reserve->blocks[--reserve->count];
+				frames[block].flags &= ~FRAME_RESERVED;
+				releaseBlock(block, reserveOrders[j - 1]);
+
+				++reserveTrims;
+				reservesTrimmed = true;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// tops up the reserves trimmed by releaseReservedBlock, in the limit of what the zones can spare
+	static inline void refillTrimmedReserves() {
+		if (!reservesTrimmed) {
+			return;
+		}
+
+		reservesTrimmed = false;
+
+		for (size_t node = 0; node < NUMA::QueryNodeCount(); ++node) {
+			fillReserves(node);
+
+			for (size_t i = 0; i < RESERVE_CLASSES; ++i) {
+				if (reserves[node][i].count < reserveTargets[i]) {
+					reservesTrimmed = true;
+				}
+			}
+		}
+	}
+}
+
+namespace {
+	// A frame of the current node from the caches, otherwise from the nearest node which has one.
+	// The large block reserves are broken up next, and the zero pool is the last reserve.
+	static inline uint32_t allocateFrame() {
+		uint32_t frame = cacheAllocate();
+		if (frame != NO_FRAME) {
+			return frame;
+		}
+
+		CPU::LockGuard guard(&allocatorLock);
+
+		frame = allocateBlock(0);
+		while (frame == NO_FRAME && releaseReservedBlock()) {
+			frame = allocateBlock(0);
+		}
+		if (frame == NO_FRAME) {
+			frame = takeZeroedFrame();
+		}
+
+		return frame;
+	}
+}
+
+namespace {
+	// Boot-time helpers, only used by PhysicalMemory::Setup before the buddy allocator is ready.
+
+	static uint8_t* bootMemoryMap = nullptr;
+	static size_t bootDescriptorCount = 0;
+	static uint64_t bootDescriptorSize = 0;
+	static EFI_MEMORY_DESCRIPTOR* bootstrapSource = nullptr;
+
+	static PhysicalMemory::MemoryRange memoryRanges[PhysicalMemory::MAX_MEMORY_RANGES];
+	static uint64_t memoryRangeCount = 0;
+
+	// inserts [start, end) in the sorted ranges, merging it with the ranges it touches
+	// Returns false when the range needs a slot of its own and none is left.
+	static bool recordMemoryRange(uint64_t start, uint64_t end) {
+		size_t index = 0;
+		while (index < memoryRangeCount && memoryRanges[index].end < start) {
+			++index;
+		}
+
+		if (index < memoryRangeCount && memoryRanges[index].start <= end) {
+			if (start < memoryRanges[index].start) {
+				memoryRanges[index].start = start;
+			}
+			if (end > memoryRanges[index].end) {
+				memoryRanges[index].end = end;
+			}
+
+			// the grown range may now reach the next ones
+			while (index + 1 < memoryRangeCount && memoryRanges[index + 1].start <= memoryRanges[index].end) {
+				if (memoryRanges[index + 1].end > memoryRanges[index].end) {
+					memoryRanges[index].end = memoryRanges[index + 1].end;
+				}
+
+				for (size_t i = index + 1; i + 1 < memoryRangeCount; ++i) {
+					memoryRanges[i] = memoryRanges[i + 1];
+				}
+				--memoryRangeCount;
+			}
+
+			return true;
+		}
+
+		if (memoryRangeCount == PhysicalMemory::MAX_MEMORY_RANGES) {
+			return false;
+		}
+
+		for (size_t i = memoryRangeCount; i > index; --i) {
+			memoryRanges[i] = memoryRanges[i - 1];
+		}
+
+		memoryRanges[index] = { .start = start, .end = end };
+		++memoryRangeCount;
+
+		return true;
+	}
+
+	static inline EFI_MEMORY_DESCRIPTOR* getBootDescriptor(size_t index) {
+		return reinterpret_cast<EFI_MEMORY_DESCRIPTOR*>(bootMemoryMap + index * bootDescriptorSize);
+	}
+
+	static inline bool isUsableDescriptor(const EFI_MEMORY_DESCRIPTOR* descriptor) {
+		return descriptor->Type == EfiConventionalMemory || descriptor->Type == EfiLoaderCode || descriptor->Type == EfiLoaderData
+			|| descriptor->Type == EfiBootServicesCode || descriptor->Type == EfiBootServicesData || descriptor->Type == LoaderTemporaryMemory;
+	}
+
+	// takes a frame from the end of the largest usable range, returns 0 if none is left
+	static uint64_t bootstrapFrame() {
+		if (bootstrapSource == nullptr || bootstrapSource->NumberOfPages == 0) {
+			bootstrapSource = nullptr;
+
+			for (size_t i = 0; i < bootDescriptorCount; ++i) {
+				EFI_MEMORY_DESCRIPTOR* descriptor = getBootDescriptor(i);
+
+				if (isUsableDescriptor(descriptor) && descriptor->NumberOfPages > 0
+					&& (bootstrapSource == nullptr || descriptor->NumberOfPages > bootstrapSource->NumberOfPages)
+				) {
+					bootstrapSource = descriptor;
+				}
+			}
+
+			if (bootstrapSource == nullptr) {
+				return 0;
+			}
+		}
+
+		return bootstrapSource->PhysicalStart + PhysicalMemory::FRAME_SIZE * (--bootstrapSource->NumberOfPages);
+	}
+
+	static bool bootstrapIsMapped(uint64_t virtualAddress) {
+		VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(virtualAddress);
+
+		return (VirtualMemory::getPML4EAddress(mapping.PML4_offset)->raw & VirtualMemory::PML4E_PRESENT) != 0
+			&& (VirtualMemory::getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset)->raw & VirtualMemory::PDPTE_PRESENT) != 0
+			&& (VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset)->raw & VirtualMemory::PDE_PRESENT) != 0
+			&& (VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw & VirtualMemory::PTE_PRESENT) != 0;
+	}
+
+	static bool bootstrapMapPage(uint64_t virtualAddress, uint64_t physicalAddress, bool writable) {
+		VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(virtualAddress);
+
+		VirtualMemory::PML4E* pml4e = VirtualMemory::getPML4EAddress(mapping.PML4_offset);
+
+		if ((pml4e->raw & VirtualMemory::PML4E_PRESENT) == 0) {
+			const uint64_t page = bootstrapFrame();
+			if (page == 0) {
+				return false;
+			}
+
+			pml4e->raw = (PhysicalMemory::FilterAddress(page) & VirtualMemory::PML4E_ADDRESS)
+				| VirtualMemory::PML4E_READWRITE
+				| VirtualMemory::PML4E_PRESENT;
+
+			VirtualMemory::PDPTE* pdpt = VirtualMemory::getPDPTAddress(mapping.PML4_offset);
+			__asm__ volatile("invlpg (%0)" :: "r"(pdpt));
+			VirtualMemory::zeroPage(pdpt);
+		}
+
+		VirtualMemory::PDPTE* pdpte = VirtualMemory::getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+
+		if ((pdpte->raw & VirtualMemory::PDPTE_PRESENT) == 0) {
+			const uint64_t page = bootstrapFrame();
+			if (page == 0) {
+				return false;
+			}
+
+			pdpte->raw = (PhysicalMemory::FilterAddress(page) & VirtualMemory::PDPTE_ADDRESS)
+				| VirtualMemory::PDPTE_READWRITE
+				| VirtualMemory::PDPTE_PRESENT;
+
+			VirtualMemory::PDE* pd = VirtualMemory::getPDAddress(mapping.PML4_offset, mapping.PDPT_offset);
+			__asm__ volatile("invlpg (%0)" :: "r"(pd));
+			VirtualMemory::zeroPage(pd);
+		}
+
+		VirtualMemory::PDE* pde = VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+
+		if ((pde->raw & VirtualMemory::PDE_PRESENT) == 0) {
+			const uint64_t page = bootstrapFrame();
+			if (page == 0) {
+				return false;
+			}
+
+			pde->raw = (PhysicalMemory::FilterAddress(page) & VirtualMemory::PDE_ADDRESS)
+				| VirtualMemory::PDE_READWRITE
+				| VirtualMemory::PDE_PRESENT;
+
+			VirtualMemory::PTE* pt = VirtualMemory::getPTAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+			__asm__ volatile("invlpg (%0)" :: "r"(pt));
+			VirtualMemory::zeroPage(pt);
+		}
+
+		VirtualMemory::PTE* pte = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
+		pte->raw = VirtualMemory::PTE_XD
+			| (PhysicalMemory::FilterAddress(physicalAddress) & VirtualMemory::PTE_ADDRESS)
+			| VirtualMemory::PTE_GLOBAL
+			| (writable ? VirtualMemory::PTE_READWRITE : 0)
+			| VirtualMemory::PTE_PRESENT;
+
+		__asm__ volatile("invlpg (%0)" :: "r"(virtualAddress));
+
+		return true;
+	}
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::Setup() {
+	const uint64_t mmapSize = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_MEMORY_MAP_SIZE_OFFSET);
+	bootDescriptorSize = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_MEMORY_MAP_DESCRIPTOR_SIZE_OFFSET);
+	bootMemoryMap = reinterpret_cast<uint8_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_FLAT_MEMORY_MAP_OFFSET);
+	bootDescriptorCount = mmapSize / bootDescriptorSize;
+
+	const uint8_t* bootDMABitmap = reinterpret_cast<uint8_t*>(VirtualMemoryLayout::OS_BOOT_DATA + mmapSize + VirtualMemoryLayout::BOOT_DMA_ZONE_BITMAP_OFFSET);
+
+	for (size_t i = 0; i < DMA_BITMAP_SIZE; ++i) {
+		DMA_bitmap[i / 8] |= static_cast<uint64_t>(bootDMABitmap[i]) << (8 * (i % 8));
+	}
+
+	for (size_t node = 0; node < NUMA::MAX_NODES; ++node) {
+		for (size_t order = 0; order <= MAX_ORDER; ++order) {
+			zones[node].freeLists[order] = NO_FRAME;
+			zones[node].freeBlocks[order] = 0;
+		}
+
+		zones[node].lruHead = NO_FRAME;
+		zones[node].lruTail = NO_FRAME;
+	}
+
+	// keep the DMA zone out of the general purpose ranges and find the highest usable frame
+	for (size_t i = 0; i < bootDescriptorCount; ++i) {
+		EFI_MEMORY_DESCRIPTOR* descriptor = getBootDescriptor(i);
+
+		if (!isUsableDescriptor(descriptor)) {
+			continue;
+		}
+
+		if (descriptor->NumberOfPages > 0 && descriptor->PhysicalStart / FRAME_SIZE < MAX_FRAMES) {
+			const uint64_t end = descriptor->PhysicalStart + FRAME_SIZE * descriptor->NumberOfPages;
+
+			// a range left out would not be in the direct map, so its frames must not reach the allocator either
+			if (!recordMemoryRange(descriptor->PhysicalStart, end < MAX_FRAMES * FRAME_SIZE ? end : MAX_FRAMES * FRAME_SIZE)) {
+				Log::puts("Too many memory ranges, some usable memory is left unused\n\r");
+				descriptor->NumberOfPages = 0;
+				continue;
+			}
+		}
+
+		if (descriptor->PhysicalStart < VirtualMemoryLayout::DMA_ZONE_SIZE) {
+			int64_t endDMAOffset = descriptor->PhysicalStart + FRAME_SIZE * descriptor->NumberOfPages - VirtualMemoryLayout::DMA_ZONE_SIZE;
+
+			if (endDMAOffset <= 0) {
+				descriptor->NumberOfPages = 0;
+				continue;
+			}
+
+			descriptor->NumberOfPages = endDMAOffset / FRAME_SIZE;
+			descriptor->PhysicalStart = VirtualMemoryLayout::DMA_ZONE_SIZE;
+		}
+
+		const uint64_t lastFrame = descriptor->PhysicalStart / FRAME_SIZE + descriptor->NumberOfPages;
+
+		if (lastFrame > frameCount) {
+			frameCount = lastFrame;
+		}
+	}
+
+	// frames above what the frame map can describe are left unused
+	if (frameCount > MAX_FRAMES) {
+		frameCount = MAX_FRAMES;
+	}
+
+	for (size_t i = 0; i < bootDescriptorCount; ++i) {
+		EFI_MEMORY_DESCRIPTOR* descriptor = getBootDescriptor(i);
+		const uint64_t firstFrame = descriptor->PhysicalStart / FRAME_SIZE;
+
+		if (isUsableDescriptor(descriptor) && firstFrame >= frameCount) {
+			descriptor->NumberOfPages = 0;
+		}
+		else if (isUsableDescriptor(descriptor) && firstFrame + descriptor->NumberOfPages > frameCount) {
+			descriptor->NumberOfPages = frameCount - firstFrame;
+		}
+	}
+
+	if (frameCount == 0) {
+		return StatusCode::OUT_OF_MEMORY;
+	}
+
+	// the DMA zone is not managed by the buddy allocator, but its frames are described all the same
+	if (frameCount < DMA_PAGES) {
+		frameCount = DMA_PAGES;
+	}
+
+	for (uint64_t mapPage = 0; mapPage < DMA_PAGES / FRAMES_PER_MAP_PAGE; ++mapPage) {
+		const uint64_t virtualAddress = VirtualMemoryLayout::PHYSICAL_MEMORY_MAP + mapPage * FRAME_SIZE;
+
+		const uint64_t page = bootstrapFrame();
+		if (page == 0 || !bootstrapMapPage(virtualAddress, page, true)) {
+			return StatusCode::OUT_OF_MEMORY;
+		}
+
+		VirtualMemory::zeroPage(virtualAddress);
+	}
+
+	// back the frame map with memory wherever it describes usable frames
+	for (size_t i = 0; i < bootDescriptorCount; ++i) {
+		EFI_MEMORY_DESCRIPTOR* descriptor = getBootDescriptor(i);
+
+		if (!isUsableDescriptor(descriptor) || descriptor->NumberOfPages == 0) {
+			continue;
+		}
+
+		const uint64_t firstFrame = descriptor->PhysicalStart / FRAME_SIZE;
+		const uint64_t firstMapPage = firstFrame / FRAMES_PER_MAP_PAGE;
+		const uint64_t lastMapPage = (firstFrame + descriptor->NumberOfPages - 1) / FRAMES_PER_MAP_PAGE;
+
+		for (uint64_t mapPage = firstMapPage; mapPage <= lastMapPage; ++mapPage) {
+			const uint64_t virtualAddress = VirtualMemoryLayout::PHYSICAL_MEMORY_MAP + mapPage * FRAME_SIZE;
+
+			if (bootstrapIsMapped(virtualAddress)) {
+				continue;
+			}
+
+			const uint64_t page = bootstrapFrame();
+			if (page == 0 || !bootstrapMapPage(virtualAddress, page, true)) {
+				return StatusCode::OUT_OF_MEMORY;
+			}
+
+			VirtualMemory::zeroPage(virtualAddress);
+		}
+	}
+
+	// the parts of the frame map describing holes all share a single read-only zeroed frame:
+	// their entries are never written, and read as neither usable nor free when looking up buddies
+	uint64_t zeroFrame = 0;
+	const uint64_t mapPages = (frameCount + FRAMES_PER_MAP_PAGE - 1) / FRAMES_PER_MAP_PAGE;
+
+	for (uint64_t mapPage = 0; mapPage < mapPages; ++mapPage) {
+		const uint64_t virtualAddress = VirtualMemoryLayout::PHYSICAL_MEMORY_MAP + mapPage * FRAME_SIZE;
+
+		if (bootstrapIsMapped(virtualAddress)) {
+			continue;
+		}
+
+		if (zeroFrame == 0) {
+			zeroFrame = bootstrapFrame();
+			if (zeroFrame == 0 || !bootstrapMapPage(virtualAddress, zeroFrame, true)) {
+				return StatusCode::OUT_OF_MEMORY;
+			}
+
+			VirtualMemory::zeroPage(virtualAddress);
+		}
+
+		if (!bootstrapMapPage(virtualAddress, zeroFrame, false)) {
+			return StatusCode::OUT_OF_MEMORY;
+		}
+	}
+
+	// hand over what remains of every usable range to the buddy allocator
+	for (size_t i = 0; i < bootDescriptorCount; ++i) {
+		EFI_MEMORY_DESCRIPTOR* descriptor = getBootDescriptor(i);
+
+		if (isUsableDescriptor(descriptor) && descriptor->NumberOfPages > 0) {
+			releaseRange(descriptor->PhysicalStart / FRAME_SIZE, descriptor->NumberOfPages);
+		}
+	}
+
+	if (availableMemory == 0) {
+		// not enough memory to setup the Physical Memory Manager (PMM)
+		return StatusCode::OUT_OF_MEMORY;
+	}
+
+	setupFrameCaches();
+	fillReserves(0);
+
+	DMA_bitmap[0] |= 1; // reserve the first DMA page to make NULL pointers invalid.
+
+	for (uint64_t page = 0; page < DMA_PAGES; ++page) {
+		frames[page].next = NO_FRAME;
+		frames[page].prev = NO_FRAME;
+		frames[page].refcount = (DMA_bitmap[page / 64] >> (page % 64)) & 1;
+		frames[page].flags = FRAME_DMA;
+	}
+
+	return StatusCode::SUCCESS;
+}
+
+uint64_t PhysicalMemory::QueryMemoryUsage() {
+	return availableMemory + (countCachedFrames() + zeroPoolFrames) * FRAME_SIZE;
+}
+
+uint64_t PhysicalMemory::QueryMemoryUsage(uint64_t node) {
+	if (node >= NUMA::QueryNodeCount()) {
+		return 0;
+	}
+
+	// cached and pre-zeroed frames are local to the current node
+	if (node == NUMA::QueryCurrentNode()) {
+		return zones[node].availableMemory + (countCachedFrames() + zeroPoolFrames) * FRAME_SIZE;
+	}
+
+	return zones[node].availableMemory;
+}
+
+uint64_t PhysicalMemory::QueryMemoryRanges(const MemoryRange** ranges) {
+	*ranges = memoryRanges;
+	return memoryRangeCount;
+}
+
+PhysicalMemory::FrameCacheStatistics PhysicalMemory::QueryFrameCacheStatistics() {
+	FrameCacheStatistics statistics = {
+		.allocationHits = 0,
+		.allocationMisses = 0,
+		.freeHits = 0,
+		.freeMisses = 0,
+		.depotRefills = depot.refills,
+		.depotDrains = depot.drains,
+		.cachedFrames = countCachedFrames()
+	};
+
+	for (size_t cpu = 0; cpu < CPU::MAX_CPUS; ++cpu) {
+		statistics.allocationHits += frameCaches[cpu].allocationHits;
+		statistics.allocationMisses += frameCaches[cpu].allocationMisses;
+		statistics.freeHits += frameCaches[cpu].freeHits;
+		statistics.freeMisses += frameCaches[cpu].freeMisses;
+	}
+
+	return statistics;
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::SetupNodes() {
+	const uint64_t nodes = NUMA::QueryNodeCount();
+	if (nodes <= 1) {
+		return StatusCode::SUCCESS;
+	}
+
+	CPU::LockGuard guard(&allocatorLock);
+
+	// every free frame has to be on the free lists to be moved to its zone
+	flushFrameCaches();
+	flushZeroPool();
+	trimReserves(0, true);
+
+	// detach every free block, clearing FRAME_FREE so they cannot merge with each other while being moved
+	uint32_t chains[NUMA::MAX_NODES][MAX_ORDER + 1];
+
+	for (size_t node = 0; node < NUMA::MAX_NODES; ++node) {
+		for (size_t order = 0; order <= MAX_ORDER; ++order) {
+			chains[node][order] = zones[node].freeLists[order];
+
+			for (uint32_t frame = chains[node][order]; frame != NO_FRAME; frame = frames[frame].next) {
+				frames[frame].flags &= ~FRAME_FREE;
+			}
+
+			zones[node].freeLists[order] = NO_FRAME;
+			zones[node].freeBlocks[order] = 0;
+		}
+
+		zones[node].availableMemory = 0;
+	}
+
+	availableMemory = 0;
+
+	// the LRU lists are rebuilt the same way once the frames are labelled
+	uint32_t lruChains[NUMA::MAX_NODES];
+
+	for (size_t node = 0; node < NUMA::MAX_NODES; ++node) {
+		lruChains[node] = zones[node].lruTail;
+
+		zones[node].lruHead = NO_FRAME;
+		zones[node].lruTail = NO_FRAME;
+		zones[node].lruFrames = 0;
+	}
+
+	// label every usable frame with its node
+	for (uint64_t frame = 0; frame < frameCount;) {
+		uint64_t end = 0;
+		const uint8_t node = static_cast<uint8_t>(NUMA::QueryNode(frame * FRAME_SIZE, &end));
+
+		uint64_t lastFrame = end / FRAME_SIZE;
+		if (lastFrame <= frame) {
+			lastFrame = frame + 1;
+		}
+		if (lastFrame > frameCount) {
+			lastFrame = frameCount;
+		}
+
+		for (; frame < lastFrame; ++frame) {
+			if ((frames[frame].flags & FRAME_USABLE) != 0) {
+				frames[frame].node = node;
+			}
+		}
+	}
+
+	// give the blocks back, split wherever they cross from one node to another
+	for (size_t node = 0; node < NUMA::MAX_NODES; ++node) {
+		for (size_t order = 0; order <= MAX_ORDER; ++order) {
+			uint32_t block = chains[node][order];
+
+			while (block != NO_FRAME) {
+				const uint32_t next = frames[block].next;
+
+				uint64_t first = block;
+				uint64_t count = static_cast<uint64_t>(1) << order;
+
+				while (count > 0) {
+					uint64_t run = 1;
+					while (run < count && frames[first + run].node == frames[first].node) {
+						++run;
+					}
+
+					releaseFrames(first, run);
+
+					first += run;
+					count -= run;
+				}
+
+				block = next;
+			}
+		}
+	}
 
-namespace {
-	static uint8_t MAXPHYADDR = 0;
+	// from the least recently used, so the order of the lists is kept
+	for (size_t node = 0; node < NUMA::MAX_NODES; ++node) {
+		uint32_t frame = lruChains[node];
+
+		while (frame != NO_FRAME) {
+			const uint32_t prev = frames[frame].prev;
+			lruPush(frame);
+			frame = prev;
+		}
+	}
+
+	for (size_t node = 0; node < nodes; ++node) {
+		fillReserves(node);
+	}
+
+	return StatusCode::SUCCESS;
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::SetFrameCacheWatermarks(uint64_t lowWatermark, uint64_t highWatermark) {
+	if (lowWatermark > highWatermark || highWatermark > DEPOT_MAGAZINES * MAGAZINE_SIZE) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	CPU::LockGuard guard(&allocatorLock);
 
-	static uint64_t _setup_filter_address(uint64_t _addr);
-	static uint64_t(*_filter_address_handler)(uint64_t _addr) = &_setup_filter_address;	
+	depot.lowWatermark = lowWatermark;
+	depot.highWatermark = highWatermark;
 
-	static uint64_t _filter_address(uint64_t _addr) {
-		return _addr & (((uint64_t)1 << MAXPHYADDR) - 1) & ~0xFFF;
+	if (depot.frames > depot.highWatermark) {
+		drainDepot(depot.lowWatermark);
 	}
-	static uint64_t _setup_filter_address(uint64_t _addr) {
-		unsigned int eax = 0, unused = 0;
-		__get_cpuid(0x80000008, &eax, &unused, &unused, &unused);
-		MAXPHYADDR = eax & 0xFF;
-		_filter_address_handler = &_filter_address;
-		return PhysicalMemory::FilterAddress(_addr);
+
+	return StatusCode::SUCCESS;
+}
+
+PhysicalMemory::LargePageStatistics PhysicalMemory::QueryLargePageStatistics() {
+	LargePageStatistics statistics = {
+		.reservedLargePages = 0,
+		.reservedHugePages = 0,
+		.reserveHits = reserveHits,
+		.reserveTrims = reserveTrims
+	};
+
+	for (size_t node = 0; node < NUMA::QueryNodeCount(); ++node) {
+		statistics.reservedHugePages += reserves[node][HUGE_RESERVE].count;
+		statistics.reservedLargePages += reserves[node][LARGE_RESERVE].count;
 	}
+
+	return statistics;
 }
 
-namespace {
-	static uint64_t availableBlockMemory = 0;
-	static uint64_t availableMemory = 0;
-	static uint64_t storedBlocks = 0;
+PhysicalMemory::StatusCode PhysicalMemory::SetLargePageReserve(uint64_t largePages, uint64_t hugePages) {
+	if (largePages > RESERVE_CAPACITY || hugePages > RESERVE_CAPACITY) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-	static uint8_t* DMA_bitmap = nullptr;
+	CPU::LockGuard guard(&allocatorLock);
 
-	static constexpr uint64_t DMA_PAGES			= (VirtualMemoryLayout::DMA_ZONE_SIZE / PhysicalMemory::FRAME_SIZE);
-	static constexpr uint64_t DMA_BITMAP_SIZE	= (DMA_PAGES / 8);
+	reserveTargets[HUGE_RESERVE] = hugePages;
+	reserveTargets[LARGE_RESERVE] = largePages;
+
+	for (size_t node = 0; node < NUMA::QueryNodeCount(); ++node) {
+		trimReserves(node, false);
+		fillReserves(node);
+	}
+
+	return StatusCode::SUCCESS;
 }
 
-uint64_t PhysicalMemory::FilterAddress(uint64_t address) {
-	return _filter_address_handler(address);
+PhysicalMemory::StatusCode PhysicalMemory::QueryDMAAddress(uint64_t address) {
+	uint64_t page = address / FRAME_SIZE;
+	if (address >= VirtualMemoryLayout::DMA_ZONE_SIZE) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	// a single qword read, no need for the lock
+	return ((__atomic_load_n(&DMA_bitmap[page / 64], __ATOMIC_RELAXED) >> (page % 64)) & 1) == 0 ? StatusCode::FREE : StatusCode::ALLOCATED;
 }
 
-uint64_t PhysicalMemory::FilterAddress(void* address) {
-	return _filter_address_handler(reinterpret_cast<uint64_t>(address));
+void* PhysicalMemory::AllocateDMA(uint64_t pages) {
+	return AllocateDMA(pages, FRAME_SIZE, 0);
 }
 
-PhysicalMemory::StatusCode PhysicalMemory::Setup() {
-	const uint64_t mmapSize = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_MEMORY_MAP_SIZE_OFFSET);
-	const uint64_t descriptorSize = *reinterpret_cast<uint64_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_MEMORY_MAP_DESCRIPTOR_SIZE_OFFSET);
-	uint8_t* const mmap = reinterpret_cast<uint8_t*>(VirtualMemoryLayout::OS_BOOT_DATA + VirtualMemoryLayout::BOOT_FLAT_MEMORY_MAP_OFFSET);
-	const size_t descriptorCount = mmapSize / descriptorSize;
+void* PhysicalMemory::AllocateDMA(uint64_t pages, uint64_t alignment, uint64_t boundary) {
+	if (alignment < FRAME_SIZE) {
+		alignment = FRAME_SIZE;
+	}
 
-	DMA_bitmap = reinterpret_cast<uint8_t*>(VirtualMemoryLayout::OS_BOOT_DATA + mmapSize + VirtualMemoryLayout::BOOT_DMA_ZONE_BITMAP_OFFSET);
+	if (pages == 0 || pages > DMA_PAGES || (alignment & (alignment - 1)) != 0
+		|| (boundary != 0 && ((boundary & (boundary - 1)) != 0 || boundary < pages * FRAME_SIZE))
+	) {
+		return nullptr;
+	}
 
-	MemMapBlock* currentBlockPtr = reinterpret_cast<MemMapBlock*>(VirtualMemoryLayout::PHYSICAL_MEMORY_MAP);
+	const uint64_t alignmentPages = alignment / FRAME_SIZE;
+	const uint64_t boundaryPages = boundary / FRAME_SIZE;
 
-	for (size_t i = 0; i < descriptorCount; ++i) {
-		EFI_MEMORY_DESCRIPTOR* descriptor = reinterpret_cast<EFI_MEMORY_DESCRIPTOR*>(mmap + i * descriptorSize);
+	CPU::LockGuard guard(&DMALock);
 
-		if (descriptor->Type == EfiConventionalMemory || descriptor->Type == EfiLoaderCode || descriptor->Type == EfiLoaderData
-			|| descriptor->Type == EfiBootServicesCode || descriptor->Type == EfiBootServicesData || descriptor->Type == LoaderTemporaryMemory
-		) {
-			if (descriptor->PhysicalStart < VirtualMemoryLayout::DMA_ZONE_SIZE) {
-				int64_t endDMAOffset = descriptor->PhysicalStart + FRAME_SIZE * descriptor->NumberOfPages - VirtualMemoryLayout::DMA_ZONE_SIZE;
+	uint64_t page = findFreeDMARun(DMA_hint, DMA_PAGES, pages, alignmentPages, boundaryPages);
 
-				if (endDMAOffset <= 0) {
-					continue;
-				}
+	if (page == DMA_PAGES && DMA_hint != 0) {
+		// wrap around, up to the last run that could have started before the hint
+		const uint64_t limit = DMA_hint + pages - 1 < DMA_PAGES ? DMA_hint + pages - 1 : DMA_PAGES;
+		page = findFreeDMARun(0, limit, pages, alignmentPages, boundaryPages);
+	}
 
-				descriptor->NumberOfPages = endDMAOffset / FRAME_SIZE;
-				descriptor->PhysicalStart = VirtualMemoryLayout::DMA_ZONE_SIZE;
-			}
+	if (page == DMA_PAGES) {
+		return nullptr;
+	}
 
-			if (descriptor->NumberOfPages == 0) {
-				continue;
-			}
-			else if (availableBlockMemory == 0) {
-				uint64_t pageAddress = descriptor->PhysicalStart + FRAME_SIZE * (--descriptor->NumberOfPages);
+	setDMARange(page, pages, true);
+	DMA_hint = (page + pages) % DMA_PAGES;
 
-				VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(reinterpret_cast<uint64_t>(currentBlockPtr));
+	for (uint64_t i = page; i < page + pages; ++i) {
+		frames[i].refcount = 1;
+	}
+
+	return reinterpret_cast<void*>(page * FRAME_SIZE);
+}
 
-				VirtualMemory::PML4E* pml4e = VirtualMemory::getPML4EAddress(mapping.PML4_offset);
+void* PhysicalMemory::Allocate() {
+	const uint32_t frame = allocateFrame();
+	if (frame == NO_FRAME) {
+		return nullptr;
+	}
 
-				if ((pml4e->raw & VirtualMemory::PML4E_PRESENT) == 0) {
-					// use the last page and try again
-					pml4e->raw = (FilterAddress(pageAddress) & VirtualMemory::PML4E_ADDRESS)
-						| VirtualMemory::PML4E_READWRITE
-						| VirtualMemory::PML4E_PRESENT;
+	return handOut(frame);
+}
 
-					VirtualMemory::PDPTE* pdpt = VirtualMemory::getPDPTEAddress(mapping.PML4_offset, 0);
-					VirtualMemory::zeroPage(pdpt);
+void* PhysicalMemory::Allocate(uint64_t node) {
+	if (node >= NUMA::QueryNodeCount()) {
+		return nullptr;
+	}
 
-					if (descriptor->NumberOfPages == 0) {
-						continue;
-					}
-					pageAddress = descriptor->PhysicalStart + FRAME_SIZE * (--descriptor->NumberOfPages);
-				}
+	if (node == NUMA::QueryCurrentNode()) {
+		return Allocate();
+	}
 
-				VirtualMemory::PDPTE* pdpte = VirtualMemory::getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+	CPU::LockGuard guard(&allocatorLock);
 
-				if ((pdpte->raw & VirtualMemory::PDPTE_PRESENT) == 0) {
-					pdpte->raw = (FilterAddress(pageAddress) & VirtualMemory::PDPTE_ADDRESS)
-						| VirtualMemory::PDPTE_READWRITE
-						| VirtualMemory::PDPTE_PRESENT;
+	const uint32_t frame = allocateBlock(0, node);
+	if (frame == NO_FRAME) {
+		return nullptr;
+	}
 
-					VirtualMemory::PDE* pd = VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, 0);
-					VirtualMemory::zeroPage(pd);
+	return handOut(frame);
+}
 
-					if (descriptor->NumberOfPages == 0) {
-						continue;
-					}
-					pageAddress = descriptor->PhysicalStart + FRAME_SIZE * (--descriptor->NumberOfPages);
-				}
+void* PhysicalMemory::AllocateZeroed() {
+	uint32_t frame = NO_FRAME;
 
-				VirtualMemory::PDE* pde = VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+	{
+		CPU::LockGuard guard(&allocatorLock);
+		frame = takeZeroedFrame();
+	}
 
-				if ((pde->raw & VirtualMemory::PDE_PRESENT) == 0) {
-					pde->raw = (FilterAddress(pageAddress) & VirtualMemory::PDE_ADDRESS)
-						| VirtualMemory::PDE_READWRITE
-						| VirtualMemory::PDE_PRESENT;
-					
-					VirtualMemory::PTE* pt = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, 0);
-					VirtualMemory::zeroPage(pt);
+	if (frame == NO_FRAME) {
+		frame = allocateFrame();
+		if (frame == NO_FRAME) {
+			return nullptr;
+		}
 
-					if (descriptor->NumberOfPages == 0) {
-						continue;
-					}
-					pageAddress = descriptor->PhysicalStart + FRAME_SIZE * (--descriptor->NumberOfPages);
-				}
+		zeroFrame(frame);
+	}
 
-				VirtualMemory::PTE* pte = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
-				pte->raw = VirtualMemory::PTE_XD
-					| (FilterAddress(pageAddress) & VirtualMemory::PTE_ADDRESS)
-					| VirtualMemory::PTE_READWRITE
-					| VirtualMemory::PTE_PRESENT;
+	return handOut(frame);
+}
 
-				if (descriptor->NumberOfPages == 0) {
-					continue;
-				}
+void* PhysicalMemory::AllocatePageTable() {
+	void* page = AllocateZeroed();
 
-				availableBlockMemory += FRAME_SIZE;
-			}
+	if (page != nullptr) {
+		frames[reinterpret_cast<uint64_t>(page) / FRAME_SIZE].flags |= FRAME_PAGE_TABLE;
+	}
+
+	return page;
+}
+
+uint64_t PhysicalMemory::RefillZeroPool(uint64_t count) {
+	uint64_t zeroed = 0;
+
+	{
+		CPU::LockGuard guard(&allocatorLock);
+		refillTrimmedReserves();
+	}
+
+	while (zeroed < count && zeroPoolFrames < ZERO_POOL_SIZE) {
+		const uint32_t frame = cacheAllocate();
+		if (frame == NO_FRAME) {
+			break;
+		}
+
+		zeroFrame(frame);
 
-			currentBlockPtr->physicalAddress = descriptor->PhysicalStart;
-			currentBlockPtr->availablePages = descriptor->NumberOfPages;
-			++currentBlockPtr;
-			++storedBlocks;
-			availableMemory += FRAME_SIZE * descriptor->NumberOfPages;
-			availableBlockMemory -= sizeof(MemMapBlock);
+		CPU::LockGuard guard(&allocatorLock);
+
+		if (zeroPoolFrames == ZERO_POOL_SIZE) {
+			// another CPU filled the pool in the meantime
+			releaseBlock(frame, 0);
+			break;
 		}
+
+		zeroPool[zeroPoolFrames++] = frame;
+		++zeroed;
 	}
 
-	if (currentBlockPtr == reinterpret_cast<MemMapBlock*>(VirtualMemoryLayout::PHYSICAL_MEMORY_MAP)) {
-		// not enough memory to setup the Physical Memory Manager (PMM)
-		return StatusCode::OUT_OF_MEMORY;
+	return zeroed;
+}
+
+void* PhysicalMemory::AllocatePages(uint64_t order) {
+	if (order == 0) {
+		return Allocate();
+	}
+	else if (order > MAX_ORDER) {
+		return nullptr;
 	}
 
-	DMA_bitmap[0] |= 1; // reserve the first DMA page to make NULL pointers invalid.
+	CPU::LockGuard guard(&allocatorLock);
 
-	return StatusCode::SUCCESS;
+	uint32_t frame = allocateLargeBlock(order);
+
+	if (frame == NO_FRAME && (countCachedFrames() > 0 || zeroPoolFrames > 0)) {
+		// cached and pre-zeroed frames cannot merge with their buddies, give them back and try again
+		flushFrameCaches();
+		flushZeroPool();
+		frame = allocateLargeBlock(order);
+	}
+
+	if (frame == NO_FRAME) {
+		return nullptr;
+	}
+
+	return handOut(frame);
 }
 
-uint64_t PhysicalMemory::QueryMemoryUsage() {
-	return availableMemory;
+void* PhysicalMemory::AllocateLargePage() {
+	return AllocatePages(LARGE_PAGE_ORDER);
 }
 
-PhysicalMemory::StatusCode PhysicalMemory::QueryDMAAddress(uint64_t address) {
-	uint64_t page = address / FRAME_SIZE;
-	if (address >= VirtualMemoryLayout::DMA_ZONE_SIZE) {
+void* PhysicalMemory::AllocateHugePage() {
+	return AllocatePages(HUGE_PAGE_ORDER);
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::AllocateBatch(uint64_t count, void** batch) {
+	if (batch == nullptr && count > 0) {
 		return StatusCode::INVALID_PARAMETER;
 	}
 
-	return ((DMA_bitmap[page / 8] & (1 << (page % 8))) == 0) ? StatusCode::FREE : StatusCode::ALLOCATED;
-}
+	uint64_t taken = cacheAllocateBatch(count, batch);
 
-void* PhysicalMemory::AllocateDMA(uint64_t pages) {
-	if (pages == 0) {
-		return nullptr;
-	}
+	if (taken < count) {
+		CPU::LockGuard guard(&allocatorLock);
 
-	uint64_t startPage = 0;
-	uint64_t pagesFound = 0;
+		taken += allocateBatch(count - taken, batch + taken);
 
-	for (size_t i = 0; i < DMA_BITMAP_SIZE; ++i) {
-		uint8_t byte = DMA_bitmap[i];
+		while (taken < count && releaseReservedBlock()) {
+			taken += allocateBatch(count - taken, batch + taken);
+		}
 
-		for (size_t j = 0; j < 8; ++j) {
-			if ((byte & (1 << j)) != 0) {
-				pagesFound = 0;
-			}
-			else {
-				if (pagesFound++ == 0) {
-					startPage = static_cast<uint64_t>(8) * i + j;
-				}
+		// the zero pool is the last reserve
+		while (taken < count) {
+			const uint32_t frame = takeZeroedFrame();
+			if (frame == NO_FRAME) {
+				break;
 			}
 
-			if (pagesFound >= pages) {
-				for (size_t p = startPage; p < startPage + pages; ++p) {
-					size_t x = p / 8;
-					size_t y = p % 8;
+			batch[taken++] = handOut(frame);
+		}
+	}
+
+	if (taken < count) {
+		FreeBatch(taken, batch);
+		return StatusCode::OUT_OF_MEMORY;
+	}
+
+	return StatusCode::SUCCESS;
+}
 
-					DMA_bitmap[x] |= 1 << y;
-				}
-				return reinterpret_cast<void*>(startPage * FRAME_SIZE);
+PhysicalMemory::StatusCode PhysicalMemory::AllocateZeroedBatch(uint64_t count, void** batch) {
+	if (batch == nullptr && count > 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	uint64_t taken = 0;
+
+	{
+		CPU::LockGuard guard(&allocatorLock);
+
+		while (taken < count) {
+			const uint32_t frame = takeZeroedFrame();
+			if (frame == NO_FRAME) {
+				break;
 			}
+
+			batch[taken++] = handOut(frame);
 		}
 	}
 
-	return nullptr;
-}
+	if (taken == count) {
+		return StatusCode::SUCCESS;
+	}
 
-void* PhysicalMemory::Allocate() {
-	if (storedBlocks == 0 || availableMemory < FRAME_SIZE) {
-		return nullptr;
+	if (AllocateBatch(count - taken, batch + taken) != StatusCode::SUCCESS) {
+		FreeBatch(taken, batch);
+		return StatusCode::OUT_OF_MEMORY;
 	}
 
-	MemMapBlock* mmb = reinterpret_cast<MemMapBlock*>(VirtualMemoryLayout::PHYSICAL_MEMORY_MAP) + storedBlocks - 1;
+	for (uint64_t i = taken; i < count; ++i) {
+		zeroFrame(static_cast<uint32_t>(reinterpret_cast<uint64_t>(batch[i]) / FRAME_SIZE));
+	}
 
-	void* page = reinterpret_cast<void*>(mmb->physicalAddress + FRAME_SIZE * (--mmb->availablePages));
+	return StatusCode::SUCCESS;
+}
 
-	if (mmb->availablePages == 0) {
-		--storedBlocks;
-		availableBlockMemory += sizeof(MemMapBlock);
+PhysicalMemory::StatusCode PhysicalMemory::AllocatePageTableBatch(uint64_t count, void** batch) {
+	const StatusCode status = AllocateZeroedBatch(count, batch);
+	if (status != StatusCode::SUCCESS) {
+		return status;
 	}
-	availableMemory -= FRAME_SIZE;
 
-	return page;
+	for (uint64_t i = 0; i < count; ++i) {
+		frames[reinterpret_cast<uint64_t>(batch[i]) / FRAME_SIZE].flags |= FRAME_PAGE_TABLE;
+	}
+
+	return StatusCode::SUCCESS;
 }
 
 PhysicalMemory::StatusCode PhysicalMemory::FreeDMA(void* ptr, uint64_t pages) {
@@ -241,103 +1750,218 @@ PhysicalMemory::StatusCode PhysicalMemory::FreeDMA(void* ptr, uint64_t pages) {
 		return StatusCode::INVALID_PARAMETER;
 	}
 
-	const uint64_t firstPage = address / FRAME_SIZE;
+	CPU::LockGuard guard(&DMALock);
 
-	for (size_t p = firstPage; p < firstPage + pages; ++p) {
-		size_t x = p / 8;
-		size_t y = p % 8;
+	setDMARange(address / FRAME_SIZE, pages, false);
 
-		DMA_bitmap[x] &= ~(1 << y);
+	for (uint64_t i = address / FRAME_SIZE; i < address / FRAME_SIZE + pages; ++i) {
+		frames[i].refcount = 0;
+		frames[i].flags &= ~FRAME_USER_FLAGS;
 	}
 
 	return StatusCode::SUCCESS;
 }
 
 PhysicalMemory::StatusCode PhysicalMemory::Free(void* ptr) {
+	return FreePages(ptr, 0);
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::FreeLargePage(void* ptr) {
+	return FreePages(ptr, LARGE_PAGE_ORDER);
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::FreeHugePage(void* ptr) {
+	return FreePages(ptr, HUGE_PAGE_ORDER);
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::FreePages(void* ptr, uint64_t order) {
 	const uint64_t address = reinterpret_cast<uint64_t>(ptr);
 
-	MemMapBlock* blockPtr = reinterpret_cast<MemMapBlock*>(VirtualMemoryLayout::PHYSICAL_MEMORY_MAP) + storedBlocks;
+	if (order > MAX_ORDER || address % (FRAME_SIZE << order) != 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-	if (availableBlockMemory == 0) {
-		if (storedBlocks * sizeof(MemMapBlock) >= VirtualMemoryLayout::PHYSICAL_MEMORY_MAP_SIZE) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
+	const uint64_t frame = address / FRAME_SIZE;
 
-		VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(blockPtr);
+	if (frame + (static_cast<uint64_t>(1) << order) > frameCount) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-		VirtualMemory::PML4E* pml4e = VirtualMemory::getPML4EAddress(mapping.PML4_offset);
+	// a block is only freed whole, with the order it was allocated with
+	if (!isReleasable(frames + frame) || frames[frame].order != order) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-		if ((pml4e->raw & VirtualMemory::PML4E_PRESENT) == 0) {
-			void* _page = Allocate();
+	if (!dropReference(static_cast<uint32_t>(frame))) {
+		return StatusCode::SUCCESS;
+	}
 
-			if (_page == nullptr) {
-				return StatusCode::OUT_OF_MEMORY;
-			}
+	if (order == 0) {
+		cacheFree(static_cast<uint32_t>(frame));
+		return StatusCode::SUCCESS;
+	}
 
-			pml4e->raw = (FilterAddress(_page) & VirtualMemory::PML4E_ADDRESS)
-				| VirtualMemory::PML4E_READWRITE
-				| VirtualMemory::PML4E_PRESENT;
+	CPU::LockGuard guard(&allocatorLock);
 
-			VirtualMemory::PDPTE* pdpt = VirtualMemory::getPDPTEAddress(mapping.PML4_offset, 0);
-			VirtualMemory::zeroPage(pdpt);
-		}
+	if (!refillReserve(static_cast<uint32_t>(frame), order)) {
+		releaseBlock(static_cast<uint32_t>(frame), order);
+	}
 
-		VirtualMemory::PDPTE* pdpte = VirtualMemory::getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+	return StatusCode::SUCCESS;
+}
 
-		if ((pdpte->raw & VirtualMemory::PDPTE_PRESENT) == 0) {
-			void* _page = Allocate();
+PhysicalMemory::StatusCode PhysicalMemory::SplitPages(void* ptr, uint64_t order) {
+	const uint64_t address = reinterpret_cast<uint64_t>(ptr);
 
-			if (_page == nullptr) {
-				return StatusCode::OUT_OF_MEMORY;
-			}
+	if (order > MAX_ORDER || address % (FRAME_SIZE << order) != 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-			pdpte->raw = (FilterAddress(_page) & VirtualMemory::PDPTE_ADDRESS)
-				| VirtualMemory::PDPTE_READWRITE
-				| VirtualMemory::PDPTE_PRESENT;
+	const uint64_t frame = address / FRAME_SIZE;
 
-			VirtualMemory::PDE* pd = VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, 0);
-			VirtualMemory::zeroPage(pd);
-		}
+	if (frame + (static_cast<uint64_t>(1) << order) > frameCount) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-		VirtualMemory::PDE* pde = VirtualMemory::getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PDPT_offset);
+	if (!isReleasable(frames + frame) || frames[frame].order != order || __atomic_load_n(&frames[frame].refcount, __ATOMIC_ACQUIRE) != 1) {
+		return StatusCode::INVALID_PARAMETER;
+	}
 
-		if ((pde->raw & VirtualMemory::PDE_PRESENT) == 0) {
-			void* _page = Allocate();
+	// the other frames of the block are not referenced by anyone else, the lock is not needed
+	const uint16_t userFlags = frames[frame].flags & FRAME_USER_FLAGS;
+	frames[frame].order = 0;
 
-			if (_page == nullptr) {
-				return StatusCode::OUT_OF_MEMORY;
-			}
+	for (uint64_t i = 1; i < (static_cast<uint64_t>(1) << order); ++i) {
+		handOut(static_cast<uint32_t>(frame + i));
+		frames[frame + i].order = 0;
+		frames[frame + i].flags = (frames[frame + i].flags & ~FRAME_USER_FLAGS) | userFlags;
+	}
 
-			pde->raw = (FilterAddress(_page) & VirtualMemory::PDE_ADDRESS)
-				| VirtualMemory::PDE_READWRITE
-				| VirtualMemory::PDE_PRESENT;
+	return StatusCode::SUCCESS;
+}
 
-			VirtualMemory::PTE* pt = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, 0);
-			VirtualMemory::zeroPage(pt);
+PhysicalMemory::StatusCode PhysicalMemory::FreeBatch(uint64_t count, void* const* batch) {
+	if (batch == nullptr && count > 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	StatusCode status = StatusCode::SUCCESS;
+	uint64_t runFirst = 0;
+	uint64_t runCount = 0;
+
+	for (uint64_t i = 0; i < count; ++i) {
+		const uint64_t address = reinterpret_cast<uint64_t>(batch[i]);
+		const uint64_t frame = address / FRAME_SIZE;
+
+		if (address % FRAME_SIZE != 0 || frame >= frameCount || !isReleasable(frames + frame) || frames[frame].order != 0) {
+			status = StatusCode::INVALID_PARAMETER;
+			continue;
 		}
 
-		VirtualMemory::PTE* pte = VirtualMemory::getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
-		void* _page = Allocate();
-		availableBlockMemory += FRAME_SIZE;
+		if (!dropReference(static_cast<uint32_t>(frame))) {
+			continue;
+		}
 
-		if (_page == nullptr) {
-			pte->raw = VirtualMemory::PTE_XD
-				| (FilterAddress(ptr) & VirtualMemory::PTE_ADDRESS)
-				| VirtualMemory::PTE_READWRITE
-				| VirtualMemory::PTE_PRESENT;
-			return StatusCode::SUCCESS;
+		if (runCount > 0 && frame == runFirst + runCount && frames[frame].node == frames[runFirst].node) {
+			++runCount;
+			continue;
 		}
 
-		pte->raw = VirtualMemory::PTE_XD
-			| (FilterAddress(_page) & VirtualMemory::PTE_ADDRESS)
-			| VirtualMemory::PTE_READWRITE
-			| VirtualMemory::PTE_PRESENT;
+		releaseBatchRun(runFirst, runCount);
+		runFirst = frame;
+		runCount = 1;
+	}
+
+	releaseBatchRun(runFirst, runCount);
+
+	return status;
+}
+
+const PhysicalMemory::PageFrame* PhysicalMemory::QueryPageFrame(const void* ptr) {
+	const uint64_t frame = reinterpret_cast<uint64_t>(ptr) / FRAME_SIZE;
+
+	if (frame >= frameCount || (frames[frame].flags & (FRAME_USABLE | FRAME_DMA)) == 0) {
+		return nullptr;
+	}
+
+	return frames + frame;
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::Share(void* ptr) {
+	PageFrame* entry = allocatedFrame(ptr);
+	if (entry == nullptr) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	// the frame may be freed concurrently, never resurrect a frame whose count already dropped to 0
+	uint32_t refcount = __atomic_load_n(&entry->refcount, __ATOMIC_RELAXED);
+
+	do {
+		if (refcount == 0 || refcount == 0xFFFFFFFF) {
+			return StatusCode::INVALID_PARAMETER;
+		}
+	} while (!__atomic_compare_exchange_n(&entry->refcount, &refcount, refcount + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return StatusCode::SUCCESS;
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::UpdateFrameFlags(void* ptr, uint16_t set, uint16_t clear) {
+	CPU::LockGuard guard(&allocatorLock);
+
+	PageFrame* entry = allocatedFrame(ptr);
+	if (entry == nullptr || ((set | clear) & ~FRAME_USER_FLAGS) != 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	entry->flags = (entry->flags & ~clear) | set;
+
+	// pinned frames are never reclaim candidates
+	if ((entry->flags & (FRAME_PINNED | FRAME_LRU)) == (FRAME_PINNED | FRAME_LRU)) {
+		lruUnlink(static_cast<uint32_t>(entry - frames));
+	}
+
+	return StatusCode::SUCCESS;
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::TouchFrame(void* ptr) {
+	CPU::LockGuard guard(&allocatorLock);
+
+	PageFrame* entry = allocatedFrame(ptr);
+	if (entry == nullptr || (entry->flags & FRAME_PINNED) != 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	const uint32_t frame = static_cast<uint32_t>(entry - frames);
+
+	if ((entry->flags & FRAME_LRU) != 0) {
+		lruUnlink(frame);
+	}
+
+	lruPush(frame);
+	return StatusCode::SUCCESS;
+}
+
+PhysicalMemory::StatusCode PhysicalMemory::UntrackFrame(void* ptr) {
+	CPU::LockGuard guard(&allocatorLock);
+
+	PageFrame* entry = allocatedFrame(ptr);
+	if (entry == nullptr) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	if ((entry->flags & FRAME_LRU) != 0) {
+		lruUnlink(static_cast<uint32_t>(entry - frames));
 	}
 
-	blockPtr->availablePages = 1;
-	blockPtr->physicalAddress = address;
-	++storedBlocks;
-	availableBlockMemory -= sizeof(MemMapBlock);
-	availableMemory += FRAME_SIZE;
 	return StatusCode::SUCCESS;
 }
+
+void* PhysicalMemory::QueryLeastRecentlyUsed(uint64_t node) {
+	CPU::LockGuard guard(&allocatorLock);
+
+	if (node >= NUMA::QueryNodeCount() || zones[node].lruTail == NO_FRAME) {
+		return nullptr;
+	}
+
+	return reinterpret_cast<void*>(static_cast<uint64_t>(zones[node].lruTail) * FRAME_SIZE);
+}
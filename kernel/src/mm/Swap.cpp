@@ -0,0 +1,198 @@
+#include <cstddef>
+#include <cstdint>
+
+#include <cpu/Spinlock.hpp>
+#include <mm/Heap.hpp>
+#include <mm/PhysicalMemory.hpp>
+#include <mm/Swap.hpp>
+#include <mm/VirtualMemory.hpp>
+
+namespace {
+	// references of every slot, 0 when free
+	static uint16_t* slotMap = nullptr;
+	static uint64_t slotMapPages = 0;
+	static uint64_t slotCount = 0;
+	static uint64_t freeSlots = 0;
+	static uint64_t slotHint = 1;		// lowest slot which may be free
+	static Swap::Device* device = nullptr;
+	static CPU::Spinlock swapLock;
+
+	static inline bool validSlot(uint64_t slot) {
+		return slot != 0 && slot < slotCount;
+	}
+
+	// replaces the device and its slot map, fails while a slot is in use
+	static inline bool swapDevice(Swap::Device* newDevice, uint16_t** map, uint64_t* pages) {
+		CPU::LockGuard guard(&swapLock);
+
+		if (device != nullptr && freeSlots != slotCount - 1) {
+			return false;
+		}
+
+		uint16_t* const previousMap = slotMap;
+		const uint64_t previousPages = slotMapPages;
+
+		slotMap = *map;
+		slotMapPages = *pages;
+		slotCount = newDevice != nullptr ? newDevice->blocks : 0;
+		freeSlots = newDevice != nullptr ? slotCount - 1 : 0;
+		slotHint = 1;
+		device = newDevice;
+
+		*map = previousMap;
+		*pages = previousPages;
+		return true;
+	}
+
+	static Swap::StatusCode ramDiskRead(Swap::Device* ramDisk, uint64_t block, void* page) {
+		VirtualMemory::copyPage(page, static_cast<uint8_t*>(ramDisk->data) + block * PhysicalMemory::FRAME_SIZE);
+		return Swap::StatusCode::SUCCESS;
+	}
+
+	static Swap::StatusCode ramDiskWrite(Swap::Device* ramDisk, uint64_t block, const void* page) {
+		VirtualMemory::copyPage(static_cast<uint8_t*>(ramDisk->data) + block * PhysicalMemory::FRAME_SIZE, page);
+		return Swap::StatusCode::SUCCESS;
+	}
+}
+
+Swap::StatusCode Swap::AttachDevice(Device* newDevice) {
+	// slot 0 is reserved, a device needs at least one more block
+	if (newDevice == nullptr || newDevice->blocks < 2 || newDevice->read == nullptr || newDevice->write == nullptr) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	uint64_t pages = (newDevice->blocks * sizeof(uint16_t) + PhysicalMemory::FRAME_SIZE - 1) / PhysicalMemory::FRAME_SIZE;
+	// slots are allocated by the reclaim path once memory ran out, where a kernel page fault could not get a frame
+	uint16_t* map = static_cast<uint16_t*>(VirtualMemory::AllocateKernelHeap(pages, VirtualMemory::HeapBacking::POPULATED));
+	if (map == nullptr) {
+		return StatusCode::OUT_OF_MEMORY;
+	}
+
+	// kernel heap pages start zeroed: every slot is free
+
+	// on success, map and pages receive the previous slot map
+	const bool attached = swapDevice(newDevice, &map, &pages);
+
+	if (map != nullptr) {
+		VirtualMemory::FreeKernelHeap(map, pages);
+	}
+
+	return attached ? StatusCode::SUCCESS : StatusCode::INVALID_PARAMETER;
+}
+
+Swap::StatusCode Swap::DetachDevice() {
+	uint16_t* map = nullptr;
+	uint64_t pages = 0;
+
+	if (!swapDevice(nullptr, &map, &pages)) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	if (map != nullptr) {
+		VirtualMemory::FreeKernelHeap(map, pages);
+	}
+
+	return StatusCode::SUCCESS;
+}
+
+Swap::Device* Swap::CreateRamDisk(uint64_t pages) {
+	Device* ramDisk = static_cast<Device*>(Heap::Allocate(sizeof(Device)));
+	if (ramDisk == nullptr) {
+		return nullptr;
+	}
+
+	// the storage is mapped on demand, a block takes a frame on its first access, the write of the first page swapped out to it
+	ramDisk->data = VirtualMemory::AllocateKernelHeap(pages, VirtualMemory::HeapBacking::ON_DEMAND);
+	if (ramDisk->data == nullptr) {
+		Heap::Free(ramDisk);
+		return nullptr;
+	}
+
+	ramDisk->blocks = pages;
+	ramDisk->read = ramDiskRead;
+	ramDisk->write = ramDiskWrite;
+	ramDisk->discard = nullptr;
+
+	return ramDisk;
+}
+
+uint64_t Swap::QueryFreeSlots() {
+	CPU::LockGuard guard(&swapLock);
+	return freeSlots;
+}
+
+uint64_t Swap::AllocateSlot() {
+	CPU::LockGuard guard(&swapLock);
+
+	if (freeSlots == 0) {
+		return 0;
+	}
+
+	for (uint64_t slot = slotHint; slot < slotCount; ++slot) {
+		if (slotMap[slot] == 0) {
+			slotMap[slot] = 1;
+			slotHint = slot + 1;
+			--freeSlots;
+			return slot;
+		}
+	}
+
+	return 0;
+}
+
+Swap::StatusCode Swap::ShareSlot(uint64_t slot) {
+	CPU::LockGuard guard(&swapLock);
+
+	if (!validSlot(slot) || slotMap[slot] == 0 || slotMap[slot] == 0xFFFF) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	++slotMap[slot];
+	return StatusCode::SUCCESS;
+}
+
+Swap::StatusCode Swap::ReleaseSlot(uint64_t slot) {
+	CPU::LockGuard guard(&swapLock);
+
+	if (!validSlot(slot) || slotMap[slot] == 0) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	if (--slotMap[slot] == 0) {
+		if (device->discard != nullptr) {
+			device->discard(device, slot);
+		}
+
+		++freeSlots;
+		if (slot < slotHint) {
+			slotHint = slot;
+		}
+	}
+
+	return StatusCode::SUCCESS;
+}
+
+// The slot is owned by the caller, so the device cannot be detached during the transfer.
+// The transfers run without the lock, a slow device does not hold back the slot allocations.
+
+Swap::StatusCode Swap::WriteSlot(uint64_t slot, const void* page) {
+	if (device == nullptr) {
+		return StatusCode::NO_DEVICE;
+	}
+	if (!validSlot(slot)) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	return device->write(device, slot, page);
+}
+
+Swap::StatusCode Swap::ReadSlot(uint64_t slot, void* page) {
+	if (device == nullptr) {
+		return StatusCode::NO_DEVICE;
+	}
+	if (!validSlot(slot)) {
+		return StatusCode::INVALID_PARAMETER;
+	}
+
+	return device->read(device, slot, page);
+}
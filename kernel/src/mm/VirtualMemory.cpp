@@ -1,7 +1,12 @@
 #include <cstddef>
 #include <cstdint>
 
+#include <cpu/CPU.hpp>
+#include <cpu/Spinlock.hpp>
+#include <cpu/TLB.hpp>
+
 #include <mm/PhysicalMemory.hpp>
+#include <mm/Swap.hpp>
 #include <mm/VirtualMemory.hpp>
 #include <mm/VirtualMemoryLayout.hpp>
 
@@ -9,17 +14,41 @@
 
 #include <screen/Log.hpp>
 
-struct VMemMapBlock {
-	uint64_t virtualStart;
-	uint64_t availablePages;
+// free virtual range, linked in two AVL trees: by address and by size
+struct VMemRange {
+	uint64_t start;
+	uint64_t pages;
+	uint64_t largest;			// largest range of the address subtree
+	VMemRange* addressLeft;
+	VMemRange* addressRight;	// links the free nodes when unused
+	VMemRange* sizeLeft;
+	VMemRange* sizeRight;
+	uint8_t addressHeight;
+	uint8_t sizeHeight;
 };
 
+static_assert(sizeof(VMemRange) == 64, "Nodes must not straddle pages of the management zone");
+
 struct MemoryContext {
 	uint64_t availableMemory;
-	uint64_t availableBlockMemory;
-	uint64_t storedBlocks;
+	VMemRange* addressRoot;
+	VMemRange* sizeRoot;
+	VMemRange* freeNodes;
+	uint64_t carvedNodes;
+	uint64_t reclaimCursor;		// clock hand of ReclaimUserPages
 };
 
+static_assert(
+	sizeof(MemoryContext) <= VirtualMemoryLayout::USER_MEMORY_MANAGEMENT - VirtualMemoryLayout::USER_MEMORY_CONTEXT,
+	"The user memory context overlaps its management zone"
+);
+static_assert(VirtualMemoryLayout::USER_MEMORY_MANAGEMENT % sizeof(VMemRange) == 0, "Misaligned user memory management zone");
+
+static_assert(
+	VirtualMemoryLayout::PHYSICAL_MEMORY_MAP_SIZE / sizeof(PhysicalMemory::PageFrame) * PhysicalMemory::FRAME_SIZE <= VirtualMemoryLayout::DIRECT_MAP_SIZE,
+	"The direct map must cover every frame the PMM can describe"
+);
+
 enum class AccessPrivilege {
 	HIGH,		// every paging structure has the user mode bit cleared
 	MEDIUM,		// intermediate paging structures have the user bit set, the PTE has the user bit cleared (should only be used for the legacy DMA zone)
@@ -30,12 +59,31 @@ namespace VirtualMemory {
 	namespace {
 		static MemoryContext kernelContext {
 			.availableMemory = VirtualMemoryLayout::KERNEL_HEAP_SIZE,
-			.availableBlockMemory = 0,
-			.storedBlocks = 0
+			.addressRoot = nullptr,
+			.sizeRoot = nullptr,
+			.freeNodes = nullptr,
+			.carvedNodes = 0,
+			.reclaimCursor = 0
 		};
 
 		static MemoryContext* const userContext = reinterpret_cast<MemoryContext*>(VirtualMemoryLayout::USER_MEMORY_CONTEXT);
 
+		// the general purpose window starts with the fixed slots of every CPU, the other slots are tracked by a bitmap
+		static constexpr uint64_t LOCAL_MAPPINGS_PAGES = CPU::MAX_CPUS * LOCAL_MAPPING_SLOTS;
+		static constexpr uint64_t GENERAL_MAPPINGS = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS + LOCAL_MAPPINGS_PAGES * PhysicalMemory::FRAME_SIZE;
+		static constexpr uint64_t GENERAL_MAPPINGS_PAGES = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS_SIZE / PhysicalMemory::FRAME_SIZE - LOCAL_MAPPINGS_PAGES;
+		static constexpr uint64_t GENERAL_MAPPINGS_WORDS = GENERAL_MAPPINGS_PAGES / 64;
+
+		static_assert(GENERAL_MAPPINGS_PAGES % 64 == 0, "The general purpose mappings bitmap must not have a partial word");
+
+		static uint64_t generalMappings[GENERAL_MAPPINGS_WORDS];		// set bits are used slots
+		static uint64_t generalMappingsHint = 0;						// lowest word which may have a free slot
+		static CPU::Spinlock generalMappingsLock;
+
+		static uint8_t localMappingsDepth[CPU::MAX_CPUS];
+
+		static void* zeroPageFrame = nullptr;
+
 		static inline constexpr uint64_t buildVirtualAddress(const VirtualAddress& mapping) {
 			return (((mapping.PML4_offset & 0x100) != 0) ? 0xFFFF000000000000 : 0)
 				| ((uint64_t)mapping.PML4_offset << 39)
@@ -55,7 +103,7 @@ namespace VirtualMemory {
 			PML4E* pml4e = getPML4EAddress<usePrimary>(mapping.PML4_offset);
 
 			if ((pml4e->raw & PML4E_PRESENT) == 0) {
-				void* page = PhysicalMemory::Allocate();
+				void* page = PhysicalMemory::AllocatePageTable();
 				if (page == nullptr) {
 					return StatusCode::OUT_OF_MEMORY;
 				}
@@ -66,13 +114,12 @@ namespace VirtualMemory {
 
 				PDPTE* pdpt = getPDPTAddress<usePrimary>(mapping.PML4_offset);
 				__asm__ volatile("invlpg (%0)" :: "r"(pdpt));
-				zeroPage(pdpt);
 			}
 
 			PDPTE* pdpte = getPDPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset);
 
 			if ((pdpte->raw & PDPTE_PRESENT) == 0) {
-				void* page = PhysicalMemory::Allocate();
+				void* page = PhysicalMemory::AllocatePageTable();
 				if (page == nullptr) {
 					return StatusCode::OUT_OF_MEMORY;
 				}
@@ -83,13 +130,12 @@ namespace VirtualMemory {
 
 				PDE* pd = getPDAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset);
 				__asm__ volatile("invlpg (%0)" :: "r"(pd));
-				zeroPage(pd);
 			}
 
 			PDE* pde = getPDEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
 
 			if ((pde->raw & PDE_PRESENT) == 0) {
-				void* page = PhysicalMemory::Allocate();
+				void* page = PhysicalMemory::AllocatePageTable();
 				if (page == nullptr) {
 					return StatusCode::OUT_OF_MEMORY;
 				}
@@ -100,11 +146,11 @@ namespace VirtualMemory {
 				
 				PTE* pt = getPTAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
 				__asm__ volatile("invlpg (%0)" :: "r"(pt));
-				zeroPage(pt);
 			}
 
 			PTE* pte = getPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
 			pte->raw = (PhysicalMemory::FilterAddress(_physicalAddress) & PTE_ADDRESS)
+				| (privilege == AccessPrivilege::HIGH && CPU::IsSharedAddress(_virtualAddress) ? PTE_GLOBAL : 0)
 				| (privilege == AccessPrivilege::LOW ? PTE_USERMODE : 0)
 				| PTE_READWRITE
 				| PTE_PRESENT;
@@ -114,361 +160,1766 @@ namespace VirtualMemory {
 			return StatusCode::SUCCESS;
 		}
 
-		template<bool usePrimary = true>
-		static inline StatusCode mapOnDemand(const void* _address, uint64_t pages, AccessPrivilege privilege) {
-			const uint8_t* address = reinterpret_cast<const uint8_t*>(_address);
-
-			for (size_t i = 0; i < pages; ++i) {
-				VirtualAddress mapping = parseVirtualAddress(address);
+		// page tables needed by a mapping, taken from the PMM a batch at a time
+		struct TableBatch {
+			void* tables[16];
+			uint64_t count;		// tables left in the array
+			uint64_t missing;	// tables still to be allocated
+		};
 
-				PML4E* pml4e = getPML4EAddress<usePrimary>(mapping.PML4_offset);
+		static inline void* takeTable(TableBatch* batch) {
+			if (batch->count == 0) {
+				constexpr uint64_t capacity = sizeof(batch->tables) / sizeof(batch->tables[0]);
+				const uint64_t size = batch->missing < capacity ? batch->missing : capacity;
 
-				if ((pml4e->raw & PML4E_PRESENT) == 0) {
-					void* page = PhysicalMemory::Allocate();
-					if (page == nullptr) {
-						return StatusCode::OUT_OF_MEMORY;
-					}
-					pml4e->raw = (PhysicalMemory::FilterAddress(page) & PML4E_ADDRESS)
-						| PML4E_READWRITE
-						| PML4E_PRESENT;
+				if (size == 0) {
+					// the estimate fell short, fall back to a single table
+					return PhysicalMemory::AllocatePageTable();
+				}
 
-					PDPTE* pdpt = getPDPTAddress<usePrimary>(mapping.PML4_offset);
-					__asm__ volatile("invlpg (%0)" :: "r"(pdpt));
-					zeroPage(pdpt);
+				if (PhysicalMemory::AllocatePageTableBatch(size, batch->tables) != PhysicalMemory::StatusCode::SUCCESS) {
+					return nullptr;
 				}
 
-				PDPTE* pdpte = getPDPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset);
+				batch->count = size;
+				batch->missing -= size;
+			}
 
-				if ((pdpte->raw & PDPTE_PRESENT) == 0) {
-					void* page = PhysicalMemory::Allocate();
-					if (page == nullptr) {
-						return StatusCode::OUT_OF_MEMORY;
-					}
-					pdpte->raw = (PhysicalMemory::FilterAddress(page) & PDPTE_ADDRESS)
-						| PDPTE_READWRITE
-						| PDPTE_PRESENT;
+			return batch->tables[--batch->count];
+		}
 
-					PDE* pd = getPDAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset);
-					__asm__ volatile("invlpg (%0)" :: "r"(pd));
-					zeroPage(pd);
+		static inline void releaseTables(TableBatch* batch) {
+			PhysicalMemory::FreeBatch(batch->count, batch->tables);
+			batch->count = 0;
+		}
+
+		// counts the paging structures that mapping the range will have to create
+		template<bool usePrimary = true>
+		static inline uint64_t countMissingTables(uint64_t address, uint64_t pages) {
+			const uint64_t end = address + pages * PhysicalMemory::FRAME_SIZE;
+			uint64_t lastPDPT = ~static_cast<uint64_t>(0);
+			uint64_t lastPD = ~static_cast<uint64_t>(0);
+			uint64_t missing = 0;
+
+			for (uint64_t current = address & ~(PDE_COVERAGE - 1); current < end; current += PDE_COVERAGE) {
+				VirtualAddress mapping = parseVirtualAddress(current);
+
+				const bool missingPDPT = (getPML4EAddress<usePrimary>(mapping.PML4_offset)->raw & PML4E_PRESENT) == 0;
+				const bool missingPD = missingPDPT
+					|| (getPDPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset)->raw & PDPTE_PRESENT) == 0;
+				const bool missingPT = missingPD
+					|| (getPDEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset)->raw & PDE_PRESENT) == 0;
+
+				if (missingPDPT && current / PML4E_COVERAGE != lastPDPT) {
+					lastPDPT = current / PML4E_COVERAGE;
+					++missing;
+				}
+				if (missingPD && current / PDPTE_COVERAGE != lastPD) {
+					lastPD = current / PDPTE_COVERAGE;
+					++missing;
 				}
+				if (missingPT) {
+					++missing;
+				}
+			}
 
-				PDE* pde = getPDEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+			return missing;
+		}
 
-				if ((pde->raw & PDE_PRESENT) == 0) {
-					void* page = PhysicalMemory::Allocate();
-					if (page == nullptr) {
-						return StatusCode::OUT_OF_MEMORY;
-					}
-					pde->raw = (PhysicalMemory::FilterAddress(page) & PDE_ADDRESS)
-						| PDE_READWRITE
-						| PDE_PRESENT;
+		// Maps the 2 MB chunk at address with a single PDE backed by a large page, the chunk starts zeroed like on-demand pages.
+		// Returns false when no large page is available, or when the chunk already has 4 KB mappings.
+		static inline bool mapLargePage(uint64_t address) {
+			VirtualAddress mapping = parseVirtualAddress(address);
+			PML4E* pml4e = getPML4EAddress(mapping.PML4_offset);
 
-					PTE* pt = getPTAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
-					__asm__ volatile("invlpg (%0)" :: "r"(pt));
-					zeroPage(pt);
+			if ((pml4e->raw & PML4E_PRESENT) == 0) {
+				void* page = PhysicalMemory::AllocatePageTable();
+				if (page == nullptr) {
+					return false;
 				}
+				pml4e->raw = (PhysicalMemory::FilterAddress(page) & PML4E_ADDRESS)
+					| PML4E_READWRITE
+					| PML4E_PRESENT;
 
-				PTE* pte = getPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
-				pte->raw = NP_ON_DEMAND
-					| (privilege == AccessPrivilege::LOW ? NP_USERMODE : 0)
-					| NP_READWRITE;
+				PDPTE* pdpt = getPDPTAddress(mapping.PML4_offset);
+				__asm__ volatile("invlpg (%0)" :: "r"(pdpt));
+			}
 
-				__asm__ volatile("invlpg (%0)" :: "r"(address));
+			PDPTE* pdpte = getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+
+			if ((pdpte->raw & PDPTE_PRESENT) == 0) {
+				void* page = PhysicalMemory::AllocatePageTable();
+				if (page == nullptr) {
+					return false;
+				}
+				pdpte->raw = (PhysicalMemory::FilterAddress(page) & PDPTE_ADDRESS)
+					| PDPTE_READWRITE
+					| PDPTE_PRESENT;
 
-				address += PhysicalMemory::FRAME_SIZE;
+				PDE* pd = getPDAddress(mapping.PML4_offset, mapping.PDPT_offset);
+				__asm__ volatile("invlpg (%0)" :: "r"(pd));
 			}
 
-			return StatusCode::SUCCESS;
-		}
+			PDE* pde = getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+			PTE* pt = getPTAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+			void* table = nullptr;
 
-		static inline StatusCode expandVirtualMemoryMap(uint64_t start, uint64_t blocks) {
-			void* page = PhysicalMemory::Allocate();
-			if (page == nullptr) {
-				return StatusCode::OUT_OF_MEMORY;
+			// a page table left behind by freed 4 KB mappings is replaced, as long as it is empty
+			if ((pde->raw & PDE_PRESENT) != 0) {
+				if ((pde->raw & PDE_PAGE_SIZE) != 0) {
+					return false;
+				}
+
+				for (size_t i = 0; i < PT_ENTRIES; ++i) {
+					if (pt[i].raw != 0) {
+						return false;
+					}
+				}
+
+				table = reinterpret_cast<void*>(pde->raw & PDE_ADDRESS);
 			}
 
-			return mapPage(reinterpret_cast<uint64_t>(page), start + blocks * sizeof(VMemMapBlock), AccessPrivilege::HIGH);
-		}
+			void* largePage = PhysicalMemory::AllocateLargePage();
+			if (largePage == nullptr) {
+				return false;
+			}
 
-		// sorts (to the right) by descending number of available pages
-		static inline void sortVirtualMemoryMap(VMemMapBlock* start, size_t n) {
-			if (n > 2) {
-				VMemMapBlock temp;
-				for (size_t i = 0; i < n - 1 && (start + 1)->availablePages > start->availablePages; ++i) {
-					temp = *start;
-					*start = *(start + 1);
-					*++start = temp;
-				}
+			pde->raw = (PhysicalMemory::FilterAddress(largePage) & PDE_LARGE_ADDRESS)
+				| PDE_GLOBAL
+				| PDE_PAGE_SIZE
+				| PDE_READWRITE
+				| PDE_PRESENT;
+
+			// other address spaces may have cached the PDE pointing to the old table
+			CPU::TLBBatch flush;
+			CPU::QueueTLBInvalidation(&flush, reinterpret_cast<uint64_t>(pt));
+			CPU::QueueTLBTableInvalidation(&flush, address);
+			CPU::CommitTLBBatch(&flush);
+
+			if (table != nullptr) {
+				PhysicalMemory::Free(table);
 			}
-		}
-		
-		// reverse sorts (to the left) by ascending number of available pages
-		static inline void rsortVirtualMemoryMap(VMemMapBlock* start, size_t n) {
-			if (n > 2) {
-				VMemMapBlock temp;
-				for (size_t i = 0; i < n - 1 && (start - 1)->availablePages < start->availablePages; ++i) {
-					temp = *start;
-					*start = *(start - 1);
-					*--start = temp;
-				}
+
+			for (size_t i = 0; i < PT_ENTRIES; ++i) {
+				zeroPage(address + i * PhysicalMemory::FRAME_SIZE);
 			}
+
+			return true;
 		}
 
-		template<AccessPrivilege privilege>
-		static inline void* AllocateHintCore(VMemMapBlock* block, uint64_t offset, uint64_t pages) {
-			MemoryContext* ctx = privilege == AccessPrivilege::HIGH ? &kernelContext : userContext;
+		// replaces the 2 MB mapping covering address with a page table mapping the same frames, so part of it can be changed
+		template<bool usePrimary = true>
+		static inline StatusCode splitLargePage(uint64_t address) {
+			VirtualAddress mapping = parseVirtualAddress(address);
+			PDE* pde = getPDEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+
+			const uint64_t largePage = pde->raw & PDE_LARGE_ADDRESS;
+			const uint64_t attributes = (pde->raw & (PDE_READWRITE | PDE_USERMODE | PDE_PWT | PDE_PCD | PDE_GLOBAL | PDE_PK | PDE_XD))
+				| ((pde->raw & PDE_LARGE_PAT) != 0 ? PTE_PAT : 0)
+				| PTE_PRESENT;
 
-			void* pagesStart = reinterpret_cast<void*>(block->virtualStart);
+			void* table = PhysicalMemory::AllocatePageTable();
+			if (table == nullptr) {
+				return StatusCode::OUT_OF_MEMORY;
+			}
 
-			if (mapOnDemand(pagesStart, pages, AccessPrivilege::LOW) != StatusCode::SUCCESS) {
-				return nullptr;
+			if (PhysicalMemory::SplitPages(reinterpret_cast<void*>(largePage), PhysicalMemory::LARGE_PAGE_ORDER) != PhysicalMemory::StatusCode::SUCCESS) {
+				PhysicalMemory::Free(table);
+				return StatusCode::INVALID_PARAMETER;
 			}
 
-			block->availablePages -= pages;
-			block->virtualStart += pages * PhysicalMemory::FRAME_SIZE;
+			// the large page keeps being mapped while the table is filled
+			PTE* vtable = reinterpret_cast<PTE*>(PhysToVirt(table));
+			for (size_t i = 0; i < PT_ENTRIES; ++i) {
+				vtable[i].raw = ((largePage + i * PhysicalMemory::FRAME_SIZE) & PTE_ADDRESS) | attributes;
+			}
 
-			sortVirtualMemoryMap(block, ctx->storedBlocks - offset);
+			pde->raw = (PhysicalMemory::FilterAddress(table) & PDE_ADDRESS)
+				| (pde->raw & (PDE_READWRITE | PDE_USERMODE))
+				| PDE_PRESENT;
 
-			ctx->availableMemory -= pages * PhysicalMemory::FRAME_SIZE;
-			return pagesStart;
+			PTE* pt = getPTAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+			__asm__ volatile("invlpg (%0)" :: "r"(pt));
+			__asm__ volatile("invlpg (%0)" :: "r"(address));
+
+			return StatusCode::SUCCESS;
 		}
 
-		template<AccessPrivilege privilege, bool useHint = false>
-		static inline void* AllocateCore(uint64_t pages, [[maybe_unused]] void* hintPtr) {
-			constexpr uint64_t managementBase =privilege == AccessPrivilege::HIGH
-				? VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT
-				: VirtualMemoryLayout::USER_MEMORY_MANAGEMENT;
-			
-			MemoryContext* ctx = privilege == AccessPrivilege::HIGH ? &kernelContext : userContext;
+		// first address of the next region covered by an entry of the given coverage, clamped to end
+		static inline uint64_t nextBoundary(uint64_t address, uint64_t coverage, uint64_t end) {
+			const uint64_t next = (address & ~(coverage - 1)) + coverage;
+			return (next > end || next <= address) ? end : next;
+		}
 
-			VMemMapBlock* vmmb = reinterpret_cast<VMemMapBlock*>(managementBase);
-			
-			if (ctx->availableMemory < pages * PhysicalMemory::FRAME_SIZE || vmmb->availablePages < pages) {
-				return nullptr;
-			}
+		// Range operations, applied by walkRange to the entries of one page table at a time.
+		// entries: the count entries starting at pte, which map address onwards
+		// largePage: a 2 MB mapping entirely covered by the range
+		// hole: a range without paging structures (only reached when walkRange does not create them)
 
-			size_t index = 0;
+		// on-demand entries, the frames are allocated by the page fault handler
+		struct OnDemandFill {
+			static constexpr bool SPLIT_LARGE_PAGES = false;
 
-			if (pages == 0) {
-				return nullptr;
+			uint64_t entry;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t address, CPU::TLBBatch* flush) {
+				for (uint64_t i = 0; i < count; ++i, address += PhysicalMemory::FRAME_SIZE) {
+					if ((pte[i].raw & PTE_PRESENT) != 0) {
+						CPU::QueueTLBInvalidation(flush, address);
+					}
+					pte[i].raw = entry;
+				}
+				return StatusCode::SUCCESS;
 			}
-			else if (pages == 1) {
-				index = ctx->storedBlocks - 1;
-				vmmb += index;
+
+			StatusCode largePage(PDE*, uint64_t, CPU::TLBBatch*) {
+				return StatusCode::INVALID_PARAMETER;
 			}
-			else {
-				for (++index, ++vmmb;; ++index, ++vmmb) {
-					if (index >= ctx->storedBlocks || vmmb->availablePages < pages) {
-						--index;
-						--vmmb;
-						break;
+
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
+
+		// consecutive frames starting at physicalAddress
+		struct FrameFill {
+			static constexpr bool SPLIT_LARGE_PAGES = false;
+
+			uint64_t physicalAddress;
+			uint64_t attributes;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t address, CPU::TLBBatch* flush) {
+				for (uint64_t i = 0; i < count; ++i, address += PhysicalMemory::FRAME_SIZE) {
+					if ((pte[i].raw & PTE_PRESENT) != 0) {
+						CPU::QueueTLBInvalidation(flush, address);
 					}
+					pte[i].raw = (PhysicalMemory::FilterAddress(physicalAddress) & PTE_ADDRESS) | attributes;
+					physicalAddress += PhysicalMemory::FRAME_SIZE;
 				}
+				return StatusCode::SUCCESS;
 			}
 
-			if constexpr (useHint) {
-				if (hintPtr != nullptr && (reinterpret_cast<uint64_t>(hintPtr) % PhysicalMemory::FRAME_SIZE) == 0) {
-					const uint64_t hint = reinterpret_cast<uint64_t>(hintPtr);
-					size_t indexOffset = 0;
-					unsigned int fitFound = 0;
-
-					for (size_t i = 0; i <= index; ++i) {
-						VMemMapBlock* newBlock = vmmb - i;
-
-						if (newBlock->virtualStart <= hint
-							&& hint + pages * PhysicalMemory::FRAME_SIZE
-							<= newBlock->virtualStart + newBlock->availablePages * PhysicalMemory::FRAME_SIZE
-						) {
-							indexOffset = i;
-							fitFound = 1;
-							break;
-						}
-						else if (newBlock->virtualStart < vmmb->virtualStart && newBlock->virtualStart >= hint) {
-							if (hint + pages * PhysicalMemory::FRAME_SIZE
-								<= newBlock->virtualStart + newBlock->availablePages * PhysicalMemory::FRAME_SIZE
-							) {
-								indexOffset = i;
-								fitFound = 1;
-								continue;
+			StatusCode largePage(PDE*, uint64_t, CPU::TLBBatch*) {
+				return StatusCode::INVALID_PARAMETER;
+			}
+
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
+
+		// clears the entries, and frees the frames behind them when release is set
+		// strict unmaps refuse ranges with invalid entries, like the user memory ones
+		template<bool release>
+		struct Unmap {
+			static constexpr bool SPLIT_LARGE_PAGES = true;
+
+			bool strict;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t address, CPU::TLBBatch* flush) {
+				for (uint64_t i = 0; i < count; ++i, address += PhysicalMemory::FRAME_SIZE) {
+					if (strict && pte[i].raw == 0) {
+						return StatusCode::INVALID_PARAMETER;
+					}
+
+					if ((pte[i].raw & PTE_PRESENT) != 0) {
+						if constexpr (release) {
+							if (PhysicalMemory::Free(reinterpret_cast<void*>(pte[i].raw & PTE_ADDRESS)) != PhysicalMemory::StatusCode::SUCCESS) {
+								return StatusCode::OUT_OF_MEMORY;
 							}
 						}
+						CPU::QueueTLBInvalidation(flush, address);
+					}
+					else if (isSwapEntry(pte[i].raw)) {
+						Swap::ReleaseSlot(swapSlot(pte[i].raw));
+					}
+					pte[i].raw = 0;
+				}
+				return StatusCode::SUCCESS;
+			}
+
+			StatusCode largePage(PDE* pde, uint64_t address, CPU::TLBBatch* flush) {
+				if constexpr (release) {
+					if (PhysicalMemory::FreeLargePage(reinterpret_cast<void*>(pde->raw & PDE_LARGE_ADDRESS)) != PhysicalMemory::StatusCode::SUCCESS) {
+						return StatusCode::OUT_OF_MEMORY;
 					}
+				}
+				pde->raw = 0;
+				CPU::QueueTLBInvalidation(flush, address);
+				return StatusCode::SUCCESS;
+			}
 
-					if (fitFound && vmmb->availablePages > pages) {
-						vmmb -= indexOffset;
-						index -= indexOffset;
-
-						if (vmmb->virtualStart <= hint) {
-							VMemMapBlock prevBlock = {
-								.virtualStart = vmmb->virtualStart,
-								.availablePages = (hint - vmmb->virtualStart) / PhysicalMemory::FRAME_SIZE
-							};
-							VMemMapBlock nextBlock = {
-								.virtualStart = hint + pages * PhysicalMemory::FRAME_SIZE,
-								.availablePages = (
-									vmmb->virtualStart
-									+ vmmb->availablePages * PhysicalMemory::FRAME_SIZE
-									- (hint + pages * PhysicalMemory::FRAME_SIZE)) / PhysicalMemory::FRAME_SIZE
-							};
-
-							if (prevBlock.availablePages == 0) {
-								return AllocateHintCore<privilege>(vmmb, index, pages);
-							}
-							else if (nextBlock.availablePages == 0) {
-								if (mapOnDemand(hintPtr, pages, privilege) != StatusCode::SUCCESS) {
-									return nullptr;
-								}
-
-								*vmmb = prevBlock;
-								sortVirtualMemoryMap(vmmb, ctx->storedBlocks - index);
-								ctx->availableMemory -= pages * PhysicalMemory::FRAME_SIZE;
-								
-								return hintPtr;
-							}
-							else {
-								if (ctx->availableBlockMemory == 0) {
-									if (expandVirtualMemoryMap(managementBase, ctx->storedBlocks) != StatusCode::SUCCESS) {
-										return nullptr;
-									}
-									ctx->availableBlockMemory += PhysicalMemory::FRAME_SIZE;
-								}
-
-								if (mapOnDemand(hintPtr, pages, privilege) != StatusCode::SUCCESS) {
-									return nullptr;
-								}
-
-								VMemMapBlock* splitResidue = reinterpret_cast<VMemMapBlock*>(managementBase) + ctx->storedBlocks++;
-
-								if (prevBlock.availablePages > nextBlock.availablePages) {
-									*vmmb = prevBlock;
-									*splitResidue = nextBlock;
-								}
-								else {
-									*vmmb = nextBlock;
-									*splitResidue = prevBlock;
-								}
-
-								sortVirtualMemoryMap(vmmb, ctx->storedBlocks - index);
-								rsortVirtualMemoryMap(splitResidue, ctx->storedBlocks);
-								ctx->availableMemory -= pages * PhysicalMemory::FRAME_SIZE;
-								ctx->availableBlockMemory -= sizeof(VMemMapBlock);
-
-								return hintPtr;
-							}
+			StatusCode hole(uint64_t, uint64_t) {
+				return strict ? StatusCode::INVALID_PARAMETER : StatusCode::SUCCESS;
+			}
+		};
+
+		// replaces the protection bits of present and on-demand entries
+		struct Protect {
+			static constexpr bool SPLIT_LARGE_PAGES = true;
+
+			uint64_t protection;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t address, CPU::TLBBatch* flush) {
+				for (uint64_t i = 0; i < count; ++i, address += PhysicalMemory::FRAME_SIZE) {
+					if ((pte[i].raw & PTE_PRESENT) != 0) {
+						uint64_t raw = (pte[i].raw & ~PROTECTION_FLAGS) | protection;
+
+						// shared frames stay read-only, writable mappings of them are flagged for a private copy instead
+						if ((pte[i].raw & PTE_COW) != 0 || (pte[i].raw & PTE_ADDRESS) == PhysicalMemory::FilterAddress(zeroPageFrame)) {
+							raw = (protection & PTE_READWRITE) != 0 ? (raw & ~PTE_READWRITE) | PTE_COW : raw & ~PTE_COW;
 						}
-						else {
-							return AllocateHintCore<privilege>(vmmb, index, pages);
+
+						if (raw != pte[i].raw) {
+							pte[i].raw = raw;
+							CPU::QueueTLBInvalidation(flush, address);
 						}
 					}
+					else if (pte[i].raw != 0) {
+						// on-demand and swapped out entries keep their attributes at the same positions
+						pte[i].raw = (pte[i].raw & ~(NP_READWRITE | NP_USERMODE)) | (protection & (NP_READWRITE | NP_USERMODE));
+					}
 				}
+				return StatusCode::SUCCESS;
 			}
 
-			void* pagesStart = reinterpret_cast<void*>(vmmb->virtualStart + (vmmb->availablePages -= pages) * PhysicalMemory::FRAME_SIZE);
-			int remove = vmmb->availablePages == 0;
+			StatusCode largePage(PDE* pde, uint64_t address, CPU::TLBBatch* flush) {
+				const uint64_t raw = (pde->raw & ~PROTECTION_FLAGS) | protection;
+				if (raw != pde->raw) {
+					pde->raw = raw;
+					CPU::QueueTLBInvalidation(flush, address);
+				}
+				return StatusCode::SUCCESS;
+			}
 
-			if (mapOnDemand(pagesStart, pages, privilege) != StatusCode::SUCCESS) {
-				vmmb->availablePages += pages;
-				return nullptr;
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
 			}
+		};
 
-			sortVirtualMemoryMap(vmmb, ctx->storedBlocks - index);
+		// entries copied from the matching run of another address space
+		struct CopyEntries {
+			static constexpr bool SPLIT_LARGE_PAGES = false;
 
-			if (remove) {
-				--ctx->storedBlocks;
-				ctx->availableBlockMemory += sizeof(VMemMapBlock);
+			const PTE* source;
 
-				if (ctx->availableBlockMemory % PhysicalMemory::FRAME_SIZE == 0 && ctx->availableBlockMemory > PhysicalMemory::FRAME_SIZE) {
-					ctx->availableBlockMemory -= PhysicalMemory::FRAME_SIZE;
-					const uint64_t linearAddress = managementBase + ctx->availableBlockMemory;
-					VirtualAddress blockMemoryAddress = parseVirtualAddress(linearAddress);
-					PTE* blockMemoryPTE = getPTEAddress(
-						blockMemoryAddress.PML4_offset,
-						blockMemoryAddress.PDPT_offset,
-						blockMemoryAddress.PD_offset,
-						blockMemoryAddress.PT_offset
-					);
-					PhysicalMemory::Free(reinterpret_cast<void*>(blockMemoryPTE->raw & PTE_ADDRESS));
-					blockMemoryPTE->raw = 0;
-					__asm__ volatile("invlpg (%0)" :: "r"(linearAddress));
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t, CPU::TLBBatch*) {
+				for (uint64_t i = 0; i < count; ++i) {
+					pte[i].raw = source[i].raw;
 				}
+				return StatusCode::SUCCESS;
 			}
 
-			ctx->availableMemory -= pages * PhysicalMemory::FRAME_SIZE;
-			return pagesStart;
-		}
+			StatusCode largePage(PDE*, uint64_t, CPU::TLBBatch*) {
+				return StatusCode::INVALID_PARAMETER;
+			}
 
-		template<AccessPrivilege privilege> static inline StatusCode FreeCore(void* ptr, uint64_t pages) {
-			constexpr uint64_t managementBase = privilege == AccessPrivilege::HIGH
-				? VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT
-				: VirtualMemoryLayout::USER_MEMORY_MANAGEMENT;
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
 
-			MemoryContext* ctx = privilege == AccessPrivilege::HIGH ? &kernelContext : userContext;
+		// Walks each paging structure of the range once and hands whole runs of entries to the operation.
+		// Missing paging structures are created when create is set, skipped otherwise.
+		template<bool usePrimary, bool create, typename Operation>
+		static inline StatusCode walkRange(uint64_t address, uint64_t pages, AccessPrivilege privilege, Operation* operation) {
+			const uint64_t end = address + pages * PhysicalMemory::FRAME_SIZE;
+			// the user bit sits at the same position at every level
+			const uint64_t userBit = privilege == AccessPrivilege::HIGH ? 0 : PML4E_USERMODE;
 
-			if (pages == 0) {
-				return StatusCode::SUCCESS;
+			TableBatch tables;
+			tables.count = 0;
+			tables.missing = create ? countMissingTables<usePrimary>(address, pages) : 0;
+
+			CPU::TLBBatch flush;
+
+			StatusCode status = StatusCode::SUCCESS;
+
+			while (address < end && status == StatusCode::SUCCESS) {
+				VirtualAddress mapping = parseVirtualAddress(address);
+
+				PML4E* pml4e = getPML4EAddress<usePrimary>(mapping.PML4_offset);
+
+				if ((pml4e->raw & PML4E_PRESENT) == 0) {
+					if constexpr (!create) {
+						const uint64_t next = nextBoundary(address, PML4E_COVERAGE, end);
+						status = operation->hole(address, (next - address) / PhysicalMemory::FRAME_SIZE);
+						address = next;
+						continue;
+					}
+
+					void* page = takeTable(&tables);
+					if (page == nullptr) {
+						status = StatusCode::OUT_OF_MEMORY;
+						break;
+					}
+					pml4e->raw = (PhysicalMemory::FilterAddress(page) & PML4E_ADDRESS)
+						| userBit
+						| PML4E_READWRITE
+						| PML4E_PRESENT;
+				}
+
+				PDPTE* pdpte = getPDPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset);
+
+				if ((pdpte->raw & PDPTE_PRESENT) == 0) {
+					if constexpr (!create) {
+						const uint64_t next = nextBoundary(address, PDPTE_COVERAGE, end);
+						status = operation->hole(address, (next - address) / PhysicalMemory::FRAME_SIZE);
+						address = next;
+						continue;
+					}
+
+					void* page = takeTable(&tables);
+					if (page == nullptr) {
+						status = StatusCode::OUT_OF_MEMORY;
+						break;
+					}
+					pdpte->raw = (PhysicalMemory::FilterAddress(page) & PDPTE_ADDRESS)
+						| userBit
+						| PDPTE_READWRITE
+						| PDPTE_PRESENT;
+				}
+
+				PDE* pde = getPDEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+				const uint64_t next = nextBoundary(address, PDE_COVERAGE, end);
+
+				if ((pde->raw & PDE_PRESENT) == 0) {
+					if constexpr (!create) {
+						status = operation->hole(address, (next - address) / PhysicalMemory::FRAME_SIZE);
+						address = next;
+						continue;
+					}
+
+					void* page = takeTable(&tables);
+					if (page == nullptr) {
+						status = StatusCode::OUT_OF_MEMORY;
+						break;
+					}
+					pde->raw = (PhysicalMemory::FilterAddress(page) & PDE_ADDRESS)
+						| userBit
+						| PDE_READWRITE
+						| PDE_PRESENT;
+				}
+				else if ((pde->raw & PDE_PAGE_SIZE) != 0) {
+					if (next - address == PDE_COVERAGE) {
+						status = operation->largePage(pde, address, &flush);
+						address = next;
+						continue;
+					}
+
+					if constexpr (!Operation::SPLIT_LARGE_PAGES) {
+						status = StatusCode::INVALID_PARAMETER;
+						break;
+					}
+
+					status = splitLargePage<usePrimary>(address);
+					if (status != StatusCode::SUCCESS) {
+						break;
+					}
+				}
+
+				// a table freshly created was not present before: no translation through it can be cached
+				PTE* pte = getPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
+				status = operation->entries(pte, (next - address) / PhysicalMemory::FRAME_SIZE, address, &flush);
+				address = next;
 			}
-			
-			uint64_t address = reinterpret_cast<uint64_t>(ptr);
 
-			if constexpr (privilege == AccessPrivilege::LOW) {
+			releaseTables(&tables);
+			CPU::CommitTLBBatch(&flush);
+
+			return status;
+		}
+
+		// page tables freed by releaseEmptyTables, handed back to the PMM once no translation can reach them anymore
+		struct ReleasedTables {
+			void* tables[32];
+			uint64_t count;
+		};
+
+		static inline void commitReleasedTables(ReleasedTables* released, CPU::TLBBatch* flush) {
+			CPU::CommitTLBBatch(flush);
+			PhysicalMemory::FreeBatch(released->count, released->tables);
+			released->count = 0;
+		}
+
+		// Clears the entry of an empty table and queues the table for release.
+		// address is covered by the entry, tableAddress is where the table is seen through the recursive mapping.
+		static inline void releaseTable(uint64_t* entry, uint64_t address, const void* tableAddress, ReleasedTables* released, CPU::TLBBatch* flush) {
+			if (released->count == sizeof(released->tables) / sizeof(released->tables[0])) {
+				commitReleasedTables(released, flush);
+			}
+
+			released->tables[released->count++] = reinterpret_cast<void*>(*entry & PTE_ADDRESS);
+			*entry = 0;
+
+			// the paging structure caches may hold the table, and the recursive mapping still maps it
+			CPU::QueueTLBTableInvalidation(flush, address);
+			CPU::QueueTLBInvalidation(flush, reinterpret_cast<uint64_t>(tableAddress));
+		}
+
+		template<typename Entry> static inline bool tableEmpty(const Entry* table) {
+			for (uint64_t i = 0; i < PT_ENTRIES; ++i) {
+				if (table[i].raw != 0) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// Frees the paging structures an unmap of the range left empty, bottom-up: a directory is only looked at once one of its tables was freed.
+		// Tables entirely covered by the range are empty without looking. The PDPTs of the shared kernel half stay, the PML4s of every address space point to them.
+		// The legacy DMA zone keeps its tables, tasks copy its entries from the current one.
+		template<bool usePrimary = true>
+		static inline void releaseEmptyTables(uint64_t address, uint64_t pages) {
+			const uint64_t end = address + pages * PhysicalMemory::FRAME_SIZE;
+			if (address < VirtualMemoryLayout::DMA_ZONE + VirtualMemoryLayout::DMA_ZONE_SIZE) {
+				address = VirtualMemoryLayout::DMA_ZONE + VirtualMemoryLayout::DMA_ZONE_SIZE;
+			}
+
+			ReleasedTables released;
+			released.count = 0;
+			CPU::TLBBatch flush;
+
+			while (address < end) {
+				const VirtualAddress mapping = parseVirtualAddress(address);
+				const uint64_t nextPML4E = nextBoundary(address, PML4E_COVERAGE, end);
+
+				PML4E* pml4e = getPML4EAddress<usePrimary>(mapping.PML4_offset);
+				if ((pml4e->raw & PML4E_PRESENT) == 0) {
+					address = nextPML4E;
+					continue;
+				}
+
+				bool pdptChanged = false;
+
+				while (address < nextPML4E) {
+					const VirtualAddress pdptMapping = parseVirtualAddress(address);
+					const uint64_t nextPDPTE = nextBoundary(address, PDPTE_COVERAGE, nextPML4E);
+
+					PDPTE* pdpte = getPDPTEAddress<usePrimary>(pdptMapping.PML4_offset, pdptMapping.PDPT_offset);
+					if ((pdpte->raw & PDPTE_PRESENT) == 0 || (pdpte->raw & PDPTE_PAGE_SIZE) != 0) {
+						address = nextPDPTE;
+						continue;
+					}
+
+					bool pdChanged = false;
+
+					for (; address < nextPDPTE; address = nextBoundary(address, PDE_COVERAGE, nextPDPTE)) {
+						const VirtualAddress pdMapping = parseVirtualAddress(address);
+						const uint64_t nextPDE = nextBoundary(address, PDE_COVERAGE, nextPDPTE);
+
+						PDE* pde = getPDEAddress<usePrimary>(pdMapping.PML4_offset, pdMapping.PDPT_offset, pdMapping.PD_offset);
+						if ((pde->raw & PDE_PRESENT) == 0) {
+							// cleared by the unmap itself, like the large pages
+							pdChanged = true;
+							continue;
+						}
+						if ((pde->raw & PDE_PAGE_SIZE) != 0) {
+							continue;
+						}
+
+						const PTE* pt = getPTAddress<usePrimary>(pdMapping.PML4_offset, pdMapping.PDPT_offset, pdMapping.PD_offset);
+						if (nextPDE - address == PDE_COVERAGE || tableEmpty(pt)) {
+							releaseTable(&pde->raw, address, pt, &released, &flush);
+							pdChanged = true;
+						}
+					}
+
+					const PDE* pd = getPDAddress<usePrimary>(pdptMapping.PML4_offset, pdptMapping.PDPT_offset);
+					if (pdChanged && tableEmpty(pd)) {
+						releaseTable(&pdpte->raw, nextPDPTE - 1, pd, &released, &flush);
+						pdptChanged = true;
+					}
+				}
+
+				const PDPTE* pdpt = getPDPTAddress<usePrimary>(mapping.PML4_offset);
+				if (pdptChanged && !CPU::IsSharedAddress(nextPML4E - 1) && tableEmpty(pdpt)) {
+					releaseTable(&pml4e->raw, nextPML4E - 1, pdpt, &released, &flush);
+				}
+			}
+
+			commitReleasedTables(&released, &flush);
+		}
+
+		template<bool usePrimary = true>
+		static inline StatusCode mapOnDemand(const void* address, uint64_t pages, AccessPrivilege privilege) {
+			OnDemandFill fill {
+				.entry = NP_ON_DEMAND
+					| (privilege == AccessPrivilege::HIGH && CPU::IsSharedAddress(reinterpret_cast<uint64_t>(address)) ? NP_GLOBAL : 0)
+					| (privilege == AccessPrivilege::LOW ? NP_USERMODE : 0)
+					| NP_READWRITE
+			};
+
+			return walkRange<usePrimary, true>(reinterpret_cast<uint64_t>(address), pages, privilege, &fill);
+		}
+
+		// unmaps a range and frees the frames behind it, large pages only partially covered are split first
+		template<AccessPrivilege privilege>
+		static inline StatusCode unmapRange(uint64_t address, uint64_t pages) {
+			Unmap<true> unmap {
+				.strict = privilege == AccessPrivilege::LOW
+			};
+
+			auto status = walkRange<true, false>(address, pages, privilege, &unmap);
+			if (status == StatusCode::SUCCESS) {
+				releaseEmptyTables(address, pages);
+			}
+
+			return status;
+		}
+
+		// Walks the current address space and maps the same frames in the one behind the secondary recursive mapping.
+		// Present writable pages become copy-on-write on both sides, each new mapping holds a reference to its frame or swap slot.
+		struct ShareEntries {
+			static constexpr bool SPLIT_LARGE_PAGES = false;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t address, CPU::TLBBatch* flush) {
+				uint64_t shared = 0;
+				StatusCode status = StatusCode::SUCCESS;
+
+				for (; shared < count; ++shared) {
+					if (isSwapEntry(pte[shared].raw)) {
+						if (Swap::ShareSlot(swapSlot(pte[shared].raw)) != Swap::StatusCode::SUCCESS) {
+							status = StatusCode::INVALID_PARAMETER;
+							break;
+						}
+						continue;
+					}
+
+					if ((pte[shared].raw & PTE_PRESENT) == 0) {
+						continue;
+					}
+
+					if (PhysicalMemory::Share(reinterpret_cast<void*>(pte[shared].raw & PTE_ADDRESS)) != PhysicalMemory::StatusCode::SUCCESS) {
+						status = StatusCode::INVALID_PARAMETER;
+						break;
+					}
+
+					if ((pte[shared].raw & PTE_READWRITE) != 0) {
+						pte[shared].raw = (pte[shared].raw & ~PTE_READWRITE) | PTE_COW;
+						CPU::QueueTLBInvalidation(flush, address + shared * PhysicalMemory::FRAME_SIZE);
+					}
+				}
+
+				if (status == StatusCode::SUCCESS) {
+					CopyEntries copy {
+						.source = pte
+					};
+
+					status = walkRange<false, true>(address, count, AccessPrivilege::LOW, &copy);
+					if (status == StatusCode::SUCCESS) {
+						return status;
+					}
+				}
+
+				// the run is not mapped on the other side, the pages left copy-on-write get their frame back on the next write
+				for (uint64_t i = 0; i < shared; ++i) {
+					if ((pte[i].raw & PTE_PRESENT) != 0) {
+						PhysicalMemory::Free(reinterpret_cast<void*>(pte[i].raw & PTE_ADDRESS));
+					}
+					else if (isSwapEntry(pte[i].raw)) {
+						Swap::ReleaseSlot(swapSlot(pte[i].raw));
+					}
+				}
+
+				return status;
+			}
+
+			StatusCode largePage(PDE*, uint64_t, CPU::TLBBatch*) {
+				return StatusCode::INVALID_PARAMETER;
+			}
+
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
+
+		// present entries backed by freshly zeroed frames
+		struct PopulateFill {
+			static constexpr bool SPLIT_LARGE_PAGES = false;
+
+			uint64_t attributes;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t address, CPU::TLBBatch* flush) {
+				for (uint64_t i = 0; i < count; ++i, address += PhysicalMemory::FRAME_SIZE) {
+					void* frame = PhysicalMemory::AllocateZeroed();
+					if (frame == nullptr) {
+						return StatusCode::OUT_OF_MEMORY;
+					}
+
+					if ((pte[i].raw & PTE_PRESENT) != 0) {
+						CPU::QueueTLBInvalidation(flush, address);
+					}
+					pte[i].raw = (PhysicalMemory::FilterAddress(frame) & PTE_ADDRESS) | attributes;
+				}
+				return StatusCode::SUCCESS;
+			}
+
+			StatusCode largePage(PDE*, uint64_t, CPU::TLBBatch*) {
+				return StatusCode::INVALID_PARAMETER;
+			}
+
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
+
+		// the part of a kernel heap range left to 4 KB pages
+		static inline StatusCode mapKernelHeapRun(uint64_t address, uint64_t end, bool populate) {
+			if (!populate) {
+				return mapOnDemand(reinterpret_cast<void*>(address), (end - address) / PhysicalMemory::FRAME_SIZE, AccessPrivilege::HIGH);
+			}
+
+			PopulateFill fill {
+				.attributes = (CPU::IsSharedAddress(address) ? PTE_GLOBAL : 0) | PTE_READWRITE | PTE_PRESENT
+			};
+
+			return walkRange<true, true>(address, (end - address) / PhysicalMemory::FRAME_SIZE, AccessPrivilege::HIGH, &fill);
+		}
+
+		// kernel heap ranges get a large page wherever they cover whole 2 MB chunks, the rest is populated or mapped on demand
+		static inline StatusCode mapKernelHeap(const void* _address, uint64_t pages, bool populate) {
+			const uint64_t address = reinterpret_cast<uint64_t>(_address);
+			const uint64_t end = address + pages * PhysicalMemory::FRAME_SIZE;
+			uint64_t runStart = address;
+
+			for (uint64_t current = address; current < end;) {
+				if (current % PDE_COVERAGE == 0 && end - current >= PDE_COVERAGE && mapLargePage(current)) {
+					if (runStart < current) {
+						auto status = mapKernelHeapRun(runStart, current, populate);
+						if (status != StatusCode::SUCCESS) {
+							unmapRange<AccessPrivilege::HIGH>(address, pages);
+							return status;
+						}
+					}
+
+					current += PDE_COVERAGE;
+					runStart = current;
+					continue;
+				}
+
+				current = (current & ~(PDE_COVERAGE - 1)) + PDE_COVERAGE;
+			}
+
+			if (runStart < end) {
+				auto status = mapKernelHeapRun(runStart, end, populate);
+				if (status != StatusCode::SUCCESS) {
+					unmapRange<AccessPrivilege::HIGH>(address, pages);
+					return status;
+				}
+			}
+
+			return StatusCode::SUCCESS;
+		}
+
+		static inline uint64_t rangeEnd(const VMemRange* range) {
+			return range->start + range->pages * PhysicalMemory::FRAME_SIZE;
+		}
+
+		// the address index keeps the largest free range of every subtree, which guides hinted lookups
+		struct AddressIndex {
+			static inline VMemRange*& left(VMemRange* node) { return node->addressLeft; }
+			static inline VMemRange*& right(VMemRange* node) { return node->addressRight; }
+			static inline uint8_t& height(VMemRange* node) { return node->addressHeight; }
+
+			static inline bool less(const VMemRange* a, const VMemRange* b) {
+				return a->start < b->start;
+			}
+
+			static inline void augment(VMemRange* node) {
+				uint64_t largest = node->pages;
+				if (node->addressLeft != nullptr && node->addressLeft->largest > largest) {
+					largest = node->addressLeft->largest;
+				}
+				if (node->addressRight != nullptr && node->addressRight->largest > largest) {
+					largest = node->addressRight->largest;
+				}
+				node->largest = largest;
+			}
+		};
+
+		// the size index orders by (pages, start), its leftmost fit is the best fit at the lowest address
+		struct SizeIndex {
+			static inline VMemRange*& left(VMemRange* node) { return node->sizeLeft; }
+			static inline VMemRange*& right(VMemRange* node) { return node->sizeRight; }
+			static inline uint8_t& height(VMemRange* node) { return node->sizeHeight; }
+
+			static inline bool less(const VMemRange* a, const VMemRange* b) {
+				return a->pages < b->pages || (a->pages == b->pages && a->start < b->start);
+			}
+
+			static inline void augment(VMemRange*) {}
+		};
+
+		template<typename Index> static inline uint8_t treeHeight(VMemRange* node) {
+			return node == nullptr ? 0 : Index::height(node);
+		}
+
+		template<typename Index> static inline void updateNode(VMemRange* node) {
+			const uint8_t leftHeight = treeHeight<Index>(Index::left(node));
+			const uint8_t rightHeight = treeHeight<Index>(Index::right(node));
+
+			Index::height(node) = (leftHeight > rightHeight ? leftHeight : rightHeight) + 1;
+			Index::augment(node);
+		}
+
+		template<typename Index> static inline VMemRange* rotateRight(VMemRange* node) {
+			VMemRange* pivot = Index::left(node);
+			Index::left(node) = Index::right(pivot);
+			Index::right(pivot) = node;
+
+			updateNode<Index>(node);
+			updateNode<Index>(pivot);
+			return pivot;
+		}
+
+		template<typename Index> static inline VMemRange* rotateLeft(VMemRange* node) {
+			VMemRange* pivot = Index::right(node);
+			Index::right(node) = Index::left(pivot);
+			Index::left(pivot) = node;
+
+			updateNode<Index>(node);
+			updateNode<Index>(pivot);
+			return pivot;
+		}
+
+		template<typename Index> static inline VMemRange* rebalance(VMemRange* node) {
+			updateNode<Index>(node);
+
+			const int balance = static_cast<int>(treeHeight<Index>(Index::left(node))) - treeHeight<Index>(Index::right(node));
+
+			if (balance > 1) {
+				VMemRange* left = Index::left(node);
+				if (treeHeight<Index>(Index::left(left)) < treeHeight<Index>(Index::right(left))) {
+					Index::left(node) = rotateLeft<Index>(left);
+				}
+				return rotateRight<Index>(node);
+			}
+
+			if (balance < -1) {
+				VMemRange* right = Index::right(node);
+				if (treeHeight<Index>(Index::right(right)) < treeHeight<Index>(Index::left(right))) {
+					Index::right(node) = rotateRight<Index>(right);
+				}
+				return rotateLeft<Index>(node);
+			}
+
+			return node;
+		}
+
+		// returns the new root
+		template<typename Index> static VMemRange* insertNode(VMemRange* root, VMemRange* node) {
+			if (root == nullptr) {
+				Index::left(node) = nullptr;
+				Index::right(node) = nullptr;
+				updateNode<Index>(node);
+				return node;
+			}
+
+			if (Index::less(node, root)) {
+				Index::left(root) = insertNode<Index>(Index::left(root), node);
+			}
+			else {
+				Index::right(root) = insertNode<Index>(Index::right(root), node);
+			}
+
+			return rebalance<Index>(root);
+		}
+
+		template<typename Index> static VMemRange* removeMinimum(VMemRange* root, VMemRange** minimum) {
+			if (Index::left(root) == nullptr) {
+				*minimum = root;
+				return Index::right(root);
+			}
+
+			Index::left(root) = removeMinimum<Index>(Index::left(root), minimum);
+			return rebalance<Index>(root);
+		}
+
+		// the key of the node must not have changed since it was inserted, returns the new root
+		template<typename Index> static VMemRange* removeNode(VMemRange* root, VMemRange* node) {
+			if (root == nullptr) {
+				return nullptr;
+			}
+
+			if (Index::less(node, root)) {
+				Index::left(root) = removeNode<Index>(Index::left(root), node);
+			}
+			else if (Index::less(root, node)) {
+				Index::right(root) = removeNode<Index>(Index::right(root), node);
+			}
+			else {
+				VMemRange* left = Index::left(root);
+				VMemRange* right = Index::right(root);
+
+				if (right == nullptr) {
+					return left;
+				}
+
+				VMemRange* successor = nullptr;
+				right = removeMinimum<Index>(right, &successor);
+				Index::left(successor) = left;
+				Index::right(successor) = right;
+				return rebalance<Index>(successor);
+			}
+
+			return rebalance<Index>(root);
+		}
+
+		static inline void insertRange(MemoryContext* ctx, VMemRange* range) {
+			ctx->addressRoot = insertNode<AddressIndex>(ctx->addressRoot, range);
+			ctx->sizeRoot = insertNode<SizeIndex>(ctx->sizeRoot, range);
+		}
+
+		static inline void removeRange(MemoryContext* ctx, VMemRange* range) {
+			ctx->addressRoot = removeNode<AddressIndex>(ctx->addressRoot, range);
+			ctx->sizeRoot = removeNode<SizeIndex>(ctx->sizeRoot, range);
+		}
+
+		// makes the node the only range of a new context
+		static inline void initializeRanges(MemoryContext* ctx, VMemRange* node, VMemRange* nodeAddress, uint64_t start, uint64_t pages) {
+			node->start = start;
+			node->pages = pages;
+			node->largest = pages;
+			node->addressLeft = nullptr;
+			node->addressRight = nullptr;
+			node->sizeLeft = nullptr;
+			node->sizeRight = nullptr;
+			node->addressHeight = 1;
+			node->sizeHeight = 1;
+
+			ctx->addressRoot = nodeAddress;
+			ctx->sizeRoot = nodeAddress;
+			ctx->freeNodes = nullptr;
+			ctx->carvedNodes = 1;
+			ctx->reclaimCursor = start;
+		}
+
+		// smallest range of at least the requested size
+		static inline VMemRange* findBestFit(VMemRange* node, uint64_t pages) {
+			VMemRange* best = nullptr;
+
+			while (node != nullptr) {
+				if (node->pages >= pages) {
+					best = node;
+					node = node->sizeLeft;
+				}
+				else {
+					node = node->sizeRight;
+				}
+			}
+
+			return best;
+		}
+
+		static inline VMemRange* findContaining(VMemRange* node, uint64_t address) {
+			while (node != nullptr) {
+				if (address < node->start) {
+					node = node->addressLeft;
+				}
+				else if (address >= rangeEnd(node)) {
+					node = node->addressRight;
+				}
+				else {
+					return node;
+				}
+			}
+
+			return nullptr;
+		}
+
+		// last range starting below the address
+		static inline VMemRange* findPredecessor(VMemRange* node, uint64_t address) {
+			VMemRange* predecessor = nullptr;
+
+			while (node != nullptr) {
+				if (node->start < address) {
+					predecessor = node;
+					node = node->addressRight;
+				}
+				else {
+					node = node->addressLeft;
+				}
+			}
+
+			return predecessor;
+		}
+
+		// first range starting at or above the address
+		static inline VMemRange* findSuccessor(VMemRange* node, uint64_t address) {
+			VMemRange* successor = nullptr;
+
+			while (node != nullptr) {
+				if (node->start >= address) {
+					successor = node;
+					node = node->addressLeft;
+				}
+				else {
+					node = node->addressRight;
+				}
+			}
+
+			return successor;
+		}
+
+		static inline VMemRange* findStartingAt(VMemRange* node, uint64_t address) {
+			while (node != nullptr && node->start != address) {
+				node = address < node->start ? node->addressLeft : node->addressRight;
+			}
+
+			return node;
+		}
+
+		// lowest range starting at or above the address with at least the requested size, subtrees without a large enough range are skipped
+		static VMemRange* findFirstFitAbove(VMemRange* node, uint64_t address, uint64_t pages) {
+			if (node == nullptr || node->largest < pages) {
+				return nullptr;
+			}
+
+			if (node->start >= address) {
+				VMemRange* found = findFirstFitAbove(node->addressLeft, address, pages);
+				if (found != nullptr) {
+					return found;
+				}
+
+				if (node->pages >= pages) {
+					return node;
+				}
+			}
+
+			return findFirstFitAbove(node->addressRight, address, pages);
+		}
+
+		// nodes are carved out of the management zone one page at a time, released nodes are reused first
+		template<AccessPrivilege privilege>
+		static inline VMemRange* allocateNode(MemoryContext* ctx) {
+			constexpr uint64_t managementBase = privilege == AccessPrivilege::HIGH
+				? VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT
+				: VirtualMemoryLayout::USER_MEMORY_MANAGEMENT;
+			constexpr uint64_t managementEnd = privilege == AccessPrivilege::HIGH
+				? VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT + VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT_SIZE
+				: VirtualMemoryLayout::USER_MEMORY_CONTEXT + VirtualMemoryLayout::USER_MEMORY_MANAGEMENT_SIZE;
+
+			if (ctx->freeNodes != nullptr) {
+				VMemRange* node = ctx->freeNodes;
+				ctx->freeNodes = node->addressRight;
+				return node;
+			}
+
+			const uint64_t node = managementBase + ctx->carvedNodes * sizeof(VMemRange);
+			if (node + sizeof(VMemRange) > managementEnd) {
+				return nullptr;
+			}
+
+			// the page holding the first node is mapped when the context is created
+			if (node % PhysicalMemory::FRAME_SIZE == 0) {
+				void* page = PhysicalMemory::Allocate();
+				if (page == nullptr) {
+					return nullptr;
+				}
+
+				if (mapPage(reinterpret_cast<uint64_t>(page), node, AccessPrivilege::HIGH) != StatusCode::SUCCESS) {
+					PhysicalMemory::Free(page);
+					return nullptr;
+				}
+			}
+
+			++ctx->carvedNodes;
+			return reinterpret_cast<VMemRange*>(node);
+		}
+
+		static inline void releaseNode(MemoryContext* ctx, VMemRange* node) {
+			node->addressRight = ctx->freeNodes;
+			ctx->freeNodes = node;
+		}
+
+		// takes [start, start + pages) out of a free range, the residues keep their node when possible
+		template<AccessPrivilege privilege>
+		static inline StatusCode carveRange(MemoryContext* ctx, VMemRange* range, uint64_t start, uint64_t pages) {
+			const uint64_t end = start + pages * PhysicalMemory::FRAME_SIZE;
+			const uint64_t rangeStart = range->start;
+			const uint64_t rangeLimit = rangeEnd(range);
+
+			VMemRange* tail = nullptr;
+			if (start > rangeStart && end < rangeLimit) {
+				tail = allocateNode<privilege>(ctx);
+				if (tail == nullptr) {
+					return StatusCode::OUT_OF_MEMORY;
+				}
+			}
+
+			removeRange(ctx, range);
+
+			if (start > rangeStart) {
+				range->pages = (start - rangeStart) / PhysicalMemory::FRAME_SIZE;
+				insertRange(ctx, range);
+			}
+			else if (end < rangeLimit) {
+				tail = range;
+			}
+			else {
+				releaseNode(ctx, range);
+			}
+
+			if (tail != nullptr) {
+				tail->start = end;
+				tail->pages = (rangeLimit - end) / PhysicalMemory::FRAME_SIZE;
+				insertRange(ctx, tail);
+			}
+
+			ctx->availableMemory -= pages * PhysicalMemory::FRAME_SIZE;
+			return StatusCode::SUCCESS;
+		}
+
+		// gives [start, start + pages) back, merging it with the neighbouring free ranges
+		template<AccessPrivilege privilege>
+		static inline StatusCode releaseRange(MemoryContext* ctx, uint64_t start, uint64_t pages) {
+			const uint64_t end = start + pages * PhysicalMemory::FRAME_SIZE;
+
+			VMemRange* previous = findPredecessor(ctx->addressRoot, start);
+			if (previous != nullptr && rangeEnd(previous) != start) {
+				previous = nullptr;
+			}
+
+			VMemRange* next = findStartingAt(ctx->addressRoot, end);
+
+			if (previous != nullptr && next != nullptr) {
+				removeRange(ctx, previous);
+				removeRange(ctx, next);
+				previous->pages += pages + next->pages;
+				insertRange(ctx, previous);
+				releaseNode(ctx, next);
+			}
+			else if (previous != nullptr) {
+				removeRange(ctx, previous);
+				previous->pages += pages;
+				insertRange(ctx, previous);
+			}
+			else if (next != nullptr) {
+				removeRange(ctx, next);
+				next->start = start;
+				next->pages += pages;
+				insertRange(ctx, next);
+			}
+			else {
+				VMemRange* range = allocateNode<privilege>(ctx);
+				if (range == nullptr) {
+					return StatusCode::OUT_OF_MEMORY;
+				}
+
+				range->start = start;
+				range->pages = pages;
+				insertRange(ctx, range);
+			}
+
+			ctx->availableMemory += pages * PhysicalMemory::FRAME_SIZE;
+			return StatusCode::SUCCESS;
+		}
+
+		template<AccessPrivilege privilege, bool useHint = false>
+		static inline void* AllocateCore(uint64_t pages, [[maybe_unused]] void* hintPtr, [[maybe_unused]] HeapBacking backing = HeapBacking::ON_DEMAND) {
+			MemoryContext* ctx = privilege == AccessPrivilege::HIGH ? &kernelContext : userContext;
+
+			if (pages == 0 || ctx->availableMemory < pages * PhysicalMemory::FRAME_SIZE) {
+				return nullptr;
+			}
+
+			VMemRange* range = nullptr;
+			uint64_t start = 0;
+
+			if constexpr (useHint) {
+				const uint64_t hint = reinterpret_cast<uint64_t>(hintPtr);
+
+				if (hintPtr != nullptr && hint % PhysicalMemory::FRAME_SIZE == 0) {
+					// exactly at the hint when it is free, otherwise at the start of the first fit above it
+					range = findContaining(ctx->addressRoot, hint);
+
+					if (range != nullptr && (rangeEnd(range) - hint) / PhysicalMemory::FRAME_SIZE >= pages) {
+						start = hint;
+					}
+					else {
+						range = findFirstFitAbove(ctx->addressRoot, hint, pages);
+						if (range != nullptr) {
+							start = range->start;
+						}
+					}
+				}
+			}
+
+			if (range == nullptr) {
+				range = findBestFit(ctx->sizeRoot, pages);
+				if (range == nullptr) {
+					return nullptr;
+				}
+
+				start = rangeEnd(range) - pages * PhysicalMemory::FRAME_SIZE;
+			}
+
+			if (carveRange<privilege>(ctx, range, start, pages) != StatusCode::SUCCESS) {
+				return nullptr;
+			}
+
+			void* pagesStart = reinterpret_cast<void*>(start);
+
+			StatusCode status;
+			if (privilege == AccessPrivilege::HIGH && backing != HeapBacking::ON_DEMAND) {
+				status = mapKernelHeap(pagesStart, pages, backing == HeapBacking::POPULATED);
+			}
+			else {
+				status = mapOnDemand(pagesStart, pages, privilege);
+			}
+
+			if (status != StatusCode::SUCCESS) {
+				// either a neighbour or the node carveRange released is there to take the range back, this cannot fail
+				releaseRange<privilege>(ctx, start, pages);
+				return nullptr;
+			}
+
+			return pagesStart;
+		}
+
+		template<AccessPrivilege privilege> static inline StatusCode FreeCore(void* ptr, uint64_t pages) {
+			MemoryContext* ctx = privilege == AccessPrivilege::HIGH ? &kernelContext : userContext;
+
+			if (pages == 0) {
+				return StatusCode::SUCCESS;
+			}
+			
+			uint64_t address = reinterpret_cast<uint64_t>(ptr);
+
+			if constexpr (privilege == AccessPrivilege::LOW) {
 				if (address > VirtualMemoryLayout::USER_MEMORY + VirtualMemoryLayout::USER_MEMORY_SIZE
 					|| address < VirtualMemoryLayout::USER_MEMORY
 					|| address + pages * PhysicalMemory::FRAME_SIZE < address
 				) {
 					return StatusCode::INVALID_PARAMETER;
 				}
-			}
+			}
+
+			// refuse to free a range which is already (partly) free
+			VMemRange* overlap = findPredecessor(ctx->addressRoot, address + pages * PhysicalMemory::FRAME_SIZE);
+			if (overlap != nullptr && rangeEnd(overlap) > address) {
+				return StatusCode::INVALID_PARAMETER;
+			}
+
+			auto status = unmapRange<privilege>(address, pages);
+			if (status != StatusCode::SUCCESS) {
+				return status;
+			}
+
+			return releaseRange<privilege>(ctx, address, pages);
+		}
+
+		// hands every allocated run of the user memory to the operation, the allocated runs are the gaps between the free ranges
+		template<typename Operation>
+		static inline StatusCode forEachUserAllocation(const MemoryContext* ctx, Operation operation, uint64_t address = VirtualMemoryLayout::USER_MEMORY) {
+			constexpr uint64_t end = VirtualMemoryLayout::USER_MEMORY + VirtualMemoryLayout::USER_MEMORY_SIZE - VirtualMemoryLayout::USER_STACK_SIZE;
+
+			while (address < end) {
+				const VMemRange* range = findContaining(ctx->addressRoot, address);
+				if (range != nullptr) {
+					address = rangeEnd(range);
+					continue;
+				}
+
+				range = findSuccessor(ctx->addressRoot, address);
+				const uint64_t next = range != nullptr ? range->start : end;
+
+				auto status = operation(address, (next - address) / PhysicalMemory::FRAME_SIZE);
+				if (status != StatusCode::SUCCESS) {
+					return status;
+				}
+
+				address = next;
+			}
+
+			return StatusCode::SUCCESS;
+		}
+
+		// swapped out entry of a present one, the inverse of the page fault handler's mapping of non-present entries
+		static inline uint64_t swapEntry(uint64_t entry, uint64_t slot) {
+			return (slot << NP_INDEX_SHIFT)
+				| ((entry >> 34) & NP_PK)
+				| ((entry & PTE_GLOBAL) >> 2)
+				| ((entry & PTE_PAT) >> 2)
+				| ((entry & PTE_COW) != 0 ? NP_READWRITE : 0)
+				| (entry & (PTE_PCD | PTE_PWT | PTE_USERMODE | PTE_READWRITE));
+		}
+
+		static constexpr uint64_t RECLAIM_BATCH = 32;
+
+		// Clock hand of ReclaimUserPages: accessed pages get their bit cleared, the others are taken until the batch is full.
+		// The victims are unmapped first, their frames are only written out once walkRange has flushed the translations.
+		struct ClockScan {
+			static constexpr bool SPLIT_LARGE_PAGES = false;
+
+			struct Victim {
+				uint64_t address;
+				uint64_t entry;		// restored when the write fails
+				uint64_t slot;
+			};
+
+			Victim victims[RECLAIM_BATCH];
+			uint64_t count;
+			uint64_t target;		// at most RECLAIM_BATCH
+			uint64_t next;			// first address left to scan
+			bool swapFull;
+
+			bool full() const {
+				return count == target || swapFull;
+			}
+
+			StatusCode entries(PTE* pte, uint64_t entryCount, uint64_t address, CPU::TLBBatch* flush) {
+				for (uint64_t i = 0; i < entryCount && !full(); ++i, address += PhysicalMemory::FRAME_SIZE) {
+					const uint64_t raw = pte[i].raw;
+
+					if ((raw & (PTE_PRESENT | PTE_USERMODE)) != (PTE_PRESENT | PTE_USERMODE)) {
+						next = address + PhysicalMemory::FRAME_SIZE;
+						continue;
+					}
+
+					// without a flush the TLB may keep the translation for a while, which only delays the next mark
+					if ((raw & PTE_ACCESSED) != 0) {
+						pte[i].raw = raw & ~PTE_ACCESSED;
+						next = address + PhysicalMemory::FRAME_SIZE;
+						continue;
+					}
+
+					void* frame = reinterpret_cast<void*>(raw & PTE_ADDRESS);
+					const PhysicalMemory::PageFrame* descriptor = PhysicalMemory::QueryPageFrame(frame);
+
+					// the other mappings of a shared frame cannot be found
+					if (frame == zeroPageFrame
+						|| descriptor == nullptr
+						|| (descriptor->flags & PhysicalMemory::FRAME_PINNED) != 0
+						|| __atomic_load_n(&descriptor->refcount, __ATOMIC_ACQUIRE) != 1
+					) {
+						next = address + PhysicalMemory::FRAME_SIZE;
+						continue;
+					}
+
+					const uint64_t slot = Swap::AllocateSlot();
+					if (slot == 0) {
+						swapFull = true;
+						break;
+					}
+
+					victims[count++] = Victim {
+						.address = address,
+						.entry = raw,
+						.slot = slot
+					};
+
+					pte[i].raw = swapEntry(raw, slot);
+					CPU::QueueTLBInvalidation(flush, address);
+					next = address + PhysicalMemory::FRAME_SIZE;
+				}
+				return StatusCode::SUCCESS;
+			}
+
+			StatusCode largePage(PDE*, uint64_t, CPU::TLBBatch*) {
+				return StatusCode::SUCCESS;
+			}
+
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
+
+		// writes the victims out and frees their frames, returns the number of frames freed
+		static inline uint64_t pageOut(ClockScan* scan) {
+			uint64_t freed = 0;
+
+			for (uint64_t i = 0; i < scan->count; ++i) {
+				const ClockScan::Victim& victim = scan->victims[i];
+				void* frame = reinterpret_cast<void*>(victim.entry & PTE_ADDRESS);
+
+				if (Swap::WriteSlot(victim.slot, PhysToVirt(frame)) != Swap::StatusCode::SUCCESS) {
+					// nothing could reach the page since it was unmapped, it is simply mapped back
+					const VirtualAddress mapping = parseVirtualAddress(victim.address);
+					getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw = victim.entry;
+					Swap::ReleaseSlot(victim.slot);
+					continue;
+				}
+
+				PhysicalMemory::Free(frame);
+				++freed;
+			}
+
+			scan->count = 0;
+			return freed;
+		}
+
+		// first address past the pages holding the context and its carved nodes
+		static inline uint64_t userManagementEnd(const MemoryContext* ctx) {
+			const uint64_t end = VirtualMemoryLayout::USER_MEMORY_MANAGEMENT + ctx->carvedNodes * sizeof(VMemRange);
+			return (end + PhysicalMemory::FRAME_SIZE - 1) & ~(PhysicalMemory::FRAME_SIZE - 1);
+		}
+
+		// frames of an address space being destroyed, given back to the PMM a batch at a time
+		struct FrameBatch {
+			void* frames[64];
+			uint64_t count;
+		};
+
+		static inline void commitFrames(FrameBatch* batch) {
+			PhysicalMemory::FreeBatch(batch->count, batch->frames);
+			batch->count = 0;
+		}
+
+		static inline void queueFrame(FrameBatch* batch, uint64_t frame) {
+			if (batch->count == sizeof(batch->frames) / sizeof(batch->frames[0])) {
+				commitFrames(batch);
+			}
+			batch->frames[batch->count++] = reinterpret_cast<void*>(frame);
+		}
+
+		// drops the reference of an entry to its frame or swap slot
+		static inline void releaseEntry(uint64_t entry, FrameBatch* batch) {
+			if ((entry & PTE_PRESENT) != 0) {
+				queueFrame(batch, entry & PTE_ADDRESS);
+			}
+			else if (isSwapEntry(entry)) {
+				Swap::ReleaseSlot(swapSlot(entry));
+			}
+		}
+
+		// Releases the mappings of an address space no CPU has loaded anymore: nothing to invalidate, and the entries are left
+		// as they are since their tables are freed right after.
+		struct ReleaseEntries {
+			static constexpr bool SPLIT_LARGE_PAGES = true;
+
+			FrameBatch* frames;
+
+			StatusCode entries(PTE* pte, uint64_t count, uint64_t, CPU::TLBBatch*) {
+				for (uint64_t i = 0; i < count; ++i) {
+					releaseEntry(pte[i].raw, frames);
+				}
+				return StatusCode::SUCCESS;
+			}
+
+			StatusCode largePage(PDE* pde, uint64_t, CPU::TLBBatch*) {
+				PhysicalMemory::FreeLargePage(reinterpret_cast<void*>(pde->raw & PDE_LARGE_ADDRESS));
+				pde->raw = 0;
+				return StatusCode::SUCCESS;
+			}
+
+			StatusCode hole(uint64_t, uint64_t) {
+				return StatusCode::SUCCESS;
+			}
+		};
+
+		// physical address behind a mapping, 0 when the address is not mapped
+		template<bool usePrimary = true>
+		static inline uint64_t translate(uint64_t linear) {
+			VirtualAddress mapping = parseVirtualAddress(linear);
+
+			if ((getPML4EAddress<usePrimary>(mapping.PML4_offset)->raw & PML4E_PRESENT) == 0) {
+				return 0;
+			}
+
+			const uint64_t pdpte = getPDPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset)->raw;
+			if ((pdpte & PDPTE_PRESENT) == 0) {
+				return 0;
+			}
+			if ((pdpte & PDPTE_PAGE_SIZE) != 0) {
+				return (pdpte & PDPTE_HUGE_ADDRESS) | (linear & (PDPTE_COVERAGE - 1));
+			}
+
+			const uint64_t pde = getPDEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset)->raw;
+			if ((pde & PDE_PRESENT) == 0) {
+				return 0;
+			}
+			if ((pde & PDE_PAGE_SIZE) != 0) {
+				return (pde & PDE_LARGE_ADDRESS) | (linear & (PDE_COVERAGE - 1));
+			}
+
+			const uint64_t pte = getPTEAddress<usePrimary>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw;
+			if ((pte & PTE_PRESENT) == 0) {
+				return 0;
+			}
+
+			return (pte & PTE_ADDRESS) | (linear & (PhysicalMemory::FRAME_SIZE - 1));
+		}
+
+		// a management structure of the address space behind the secondary recursive mapping, seen through the direct map
+		template<typename T>
+		static inline const T* secondaryStructure(const T* pointer) {
+			const uint64_t physicalAddress = translate<false>(reinterpret_cast<uint64_t>(pointer));
+			return physicalAddress != 0 ? static_cast<const T*>(PhysToVirt(physicalAddress)) : nullptr;
+		}
+
+		// findSuccessor on the address tree of the address space behind the secondary recursive mapping, complete is cleared when a node is not mapped
+		static inline const VMemRange* findSecondarySuccessor(const VMemRange* node, uint64_t address, bool* complete) {
+			const VMemRange* successor = nullptr;
+
+			while (node != nullptr) {
+				node = secondaryStructure(node);
+				if (node == nullptr) {
+					*complete = false;
+					break;
+				}
+
+				if (node->start >= address) {
+					successor = node;
+					node = node->addressLeft;
+				}
+				else {
+					node = node->addressRight;
+				}
+			}
+
+			return successor;
+		}
+
+		// Same as forEachUserAllocation, for the address space behind the secondary recursive mapping.
+		// Nothing is allocated without a context, and the walk stops at the first node a partial clone did not get.
+		template<typename Operation>
+		static inline StatusCode forEachSecondaryUserAllocation(Operation operation) {
+			constexpr uint64_t end = VirtualMemoryLayout::USER_MEMORY + VirtualMemoryLayout::USER_MEMORY_SIZE - VirtualMemoryLayout::USER_STACK_SIZE;
+
+			const MemoryContext* ctx = secondaryStructure(reinterpret_cast<const MemoryContext*>(VirtualMemoryLayout::USER_MEMORY_CONTEXT));
+			if (ctx == nullptr) {
+				return StatusCode::SUCCESS;
+			}
+
+			uint64_t address = VirtualMemoryLayout::USER_MEMORY;
+
+			while (address < end) {
+				bool complete = true;
+				const VMemRange* range = findSecondarySuccessor(ctx->addressRoot, address, &complete);
+				if (!complete) {
+					return StatusCode::INVALID_PARAMETER;
+				}
+
+				const uint64_t next = range != nullptr ? range->start : end;
+
+				if (next > address) {
+					auto status = operation(address, (next - address) / PhysicalMemory::FRAME_SIZE);
+					if (status != StatusCode::SUCCESS) {
+						return status;
+					}
+				}
+
+				address = range != nullptr ? rangeEnd(range) : end;
+			}
+
+			return StatusCode::SUCCESS;
+		}
+
+		// the entry points to the same paging structure as the one of the current address space, same bit positions at every level
+		static inline bool sameTable(uint64_t entry, uint64_t current) {
+			return (current & PDE_PRESENT) != 0 && (current & PDE_PAGE_SIZE) == 0 && (entry & PDE_ADDRESS) == (current & PDE_ADDRESS);
+		}
+
+		// Queues the paging structures below an entry of the PML4 behind the secondary recursive mapping, and the frames they map when releaseLeaves is set.
+		// Structures the current address space points to as well are shared by every task, like the ones of the task image, and are skipped.
+		// The page tables of the legacy DMA zone are always skipped: tasks copy the entries of the one current when they are created.
+		static inline void releaseSecondaryTables(uint64_t pml4Offset, bool releaseLeaves, FrameBatch* batch) {
+			const uint64_t pml4e = getPML4EAddress<false>(pml4Offset)->raw;
+			const uint64_t currentPML4E = getPML4EAddress(pml4Offset)->raw;
+
+			if ((pml4e & PML4E_PRESENT) == 0 || sameTable(pml4e, currentPML4E)) {
+				return;
+			}
+
+			// the current structures can only be read through the recursive mapping while their parent is present
+			const bool comparePDPT = (currentPML4E & PML4E_PRESENT) != 0;
+
+			for (uint64_t pdptOffset = 0; pdptOffset < PDPT_ENTRIES; ++pdptOffset) {
+				const uint64_t pdpte = getPDPTEAddress<false>(pml4Offset, pdptOffset)->raw;
+				if ((pdpte & PDPTE_PRESENT) == 0 || (pdpte & PDPTE_PAGE_SIZE) != 0) {
+					continue;
+				}
+
+				const uint64_t currentPDPTE = comparePDPT ? getPDPTEAddress(pml4Offset, pdptOffset)->raw : 0;
+				if (sameTable(pdpte, currentPDPTE)) {
+					continue;
+				}
+
+				const bool comparePD = (currentPDPTE & PDPTE_PRESENT) != 0 && (currentPDPTE & PDPTE_PAGE_SIZE) == 0;
+
+				for (uint64_t pdOffset = 0; pdOffset < PD_ENTRIES; ++pdOffset) {
+					const uint64_t pde = getPDEAddress<false>(pml4Offset, pdptOffset, pdOffset)->raw;
+					if ((pde & PDE_PRESENT) == 0) {
+						continue;
+					}
+					if ((pde & PDE_PAGE_SIZE) != 0) {
+						if (releaseLeaves) {
+							PhysicalMemory::FreeLargePage(reinterpret_cast<void*>(pde & PDE_LARGE_ADDRESS));
+						}
+						continue;
+					}
+
+					if (comparePD && sameTable(pde, getPDEAddress(pml4Offset, pdptOffset, pdOffset)->raw)) {
+						continue;
+					}
+
+					const uint64_t address = (pml4Offset * PML4E_COVERAGE) | (pdptOffset * PDPTE_COVERAGE) | (pdOffset * PDE_COVERAGE);
+					if (address >= VirtualMemoryLayout::DMA_ZONE && address < VirtualMemoryLayout::DMA_ZONE + VirtualMemoryLayout::DMA_ZONE_SIZE) {
+						continue;
+					}
+
+					if (releaseLeaves) {
+						const PTE* pt = getPTAddress<false>(pml4Offset, pdptOffset, pdOffset);
+						for (uint64_t i = 0; i < PT_ENTRIES; ++i) {
+							releaseEntry(pt[i].raw, batch);
+						}
+					}
+
+					queueFrame(batch, pde & PDE_ADDRESS);
+				}
+
+				queueFrame(batch, pdpte & PDPTE_ADDRESS);
+			}
+
+			queueFrame(batch, pml4e & PML4E_ADDRESS);
+		}
+
+		// Maps [start, end) of the physical memory in the direct map, with 1 GB and 2 MB pages wherever the alignment allows.
+		// Page table allocations zero their frames through the direct map, so its own tables are zeroed through the recursive mapping.
+		static inline StatusCode mapDirectRange(uint64_t start, uint64_t end, bool hugePages) {
+			// same positions at every level
+			constexpr uint64_t attributes = PTE_XD | PTE_GLOBAL | PTE_READWRITE | PTE_PRESENT;
+
+			while (start < end) {
+				VirtualAddress mapping = parseVirtualAddress(VirtualMemoryLayout::DIRECT_MAP + start);
+
+				PML4E* pml4e = getPML4EAddress(mapping.PML4_offset);
+
+				if ((pml4e->raw & PML4E_PRESENT) == 0) {
+					void* page = PhysicalMemory::Allocate();
+					if (page == nullptr) {
+						return StatusCode::OUT_OF_MEMORY;
+					}
+					pml4e->raw =
+						(PhysicalMemory::FilterAddress(page) & PML4E_ADDRESS)
+						| PML4E_READWRITE
+						| PML4E_PRESENT;
+
+					zeroPage(getPDPTAddress(mapping.PML4_offset));
+				}
+
+				PDPTE* pdpte = getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+
+				if (hugePages && start % PDPTE_COVERAGE == 0 && end - start >= PDPTE_COVERAGE) {
+					pdpte->raw = (start & PDPTE_HUGE_ADDRESS) | PDPTE_PAGE_SIZE | attributes;
+					start += PDPTE_COVERAGE;
+					continue;
+				}
+
+				if ((pdpte->raw & PDPTE_PRESENT) == 0) {
+					void* page = PhysicalMemory::Allocate();
+					if (page == nullptr) {
+						return StatusCode::OUT_OF_MEMORY;
+					}
+					pdpte->raw =
+						(PhysicalMemory::FilterAddress(page) & PDPTE_ADDRESS)
+						| PDPTE_READWRITE
+						| PDPTE_PRESENT;
+
+					zeroPage(getPDAddress(mapping.PML4_offset, mapping.PDPT_offset));
+				}
+
+				PDE* pde = getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+
+				if (start % PDE_COVERAGE == 0 && end - start >= PDE_COVERAGE) {
+					pde->raw = (start & PDE_LARGE_ADDRESS) | PDE_PAGE_SIZE | attributes;
+					start += PDE_COVERAGE;
+					continue;
+				}
+
+				if ((pde->raw & PDE_PRESENT) == 0) {
+					void* page = PhysicalMemory::Allocate();
+					if (page == nullptr) {
+						return StatusCode::OUT_OF_MEMORY;
+					}
+					pde->raw =
+						(PhysicalMemory::FilterAddress(page) & PDE_ADDRESS)
+						| PDE_READWRITE
+						| PDE_PRESENT;
+
+					zeroPage(getPTAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset));
+				}
+
+				getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw = (start & PTE_ADDRESS) | attributes;
+				start += PhysicalMemory::FRAME_SIZE;
+			}
+
+			return StatusCode::SUCCESS;
+		}
+
+		static inline StatusCode buildDirectMap() {
+			const PhysicalMemory::MemoryRange* ranges = nullptr;
+			const uint64_t count = PhysicalMemory::QueryMemoryRanges(&ranges);
+			const bool hugePages = CPU::HasFeature(CPU::Feature::PDPE1GB);
+
+			for (uint64_t i = 0; i < count; ++i) {
+				const StatusCode status = mapDirectRange(ranges[i].start, ranges[i].end, hugePages);
+				if (status != StatusCode::SUCCESS) {
+					return status;
+				}
+			}
+
+			return StatusCode::SUCCESS;
+		}
+
+		// the tables of the general purpose mappings are created once, so mapping a slot is a single store
+		static inline StatusCode reserveGeneralMappingTables() {
+			constexpr uint64_t end = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS + VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS_SIZE;
+
+			for (uint64_t address = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS; address < end; address += PDE_COVERAGE) {
+				VirtualAddress mapping = parseVirtualAddress(address);
+
+				PDPTE* pdpte = getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+
+				if ((pdpte->raw & PDPTE_PRESENT) == 0) {
+					void* page = PhysicalMemory::Allocate();
+					if (page == nullptr) {
+						return StatusCode::OUT_OF_MEMORY;
+					}
+					pdpte->raw =
+						(PhysicalMemory::FilterAddress(page) & PDPTE_ADDRESS)
+						| PDPTE_READWRITE
+						| PDPTE_PRESENT;
+
+					zeroPage(getPDAddress(mapping.PML4_offset, mapping.PDPT_offset));
+				}
 
-			for (size_t i = 0; i < pages; ++i, address += PhysicalMemory::FRAME_SIZE) {
-				VirtualAddress mapping = parseVirtualAddress(address);
-				PML4E* pml4e = getPML4EAddress(mapping.PML4_offset);
-				PDPTE* pdpte = getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
 				PDE* pde = getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
-				PTE* pte = getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
-
-				if constexpr (privilege == AccessPrivilege::LOW) {
-					if ((pml4e->raw & PML4E_PRESENT) == 0 || (pdpte->raw & PDPTE_PRESENT) == 0 || (pde->raw & PDE_PRESENT) == 0 || (pte->raw == 0)) {
-						return StatusCode::INVALID_PARAMETER;
-					}
-				}
 
-				if ((pte->raw & PTE_PRESENT) != 0) {
-					void* pageAddress = reinterpret_cast<void*>(pte->raw & PTE_ADDRESS);
-					if (PhysicalMemory::Free(pageAddress) != PhysicalMemory::StatusCode::SUCCESS) {
+				if ((pde->raw & PDE_PRESENT) == 0) {
+					void* page = PhysicalMemory::Allocate();
+					if (page == nullptr) {
 						return StatusCode::OUT_OF_MEMORY;
 					}
-					__asm__ volatile("invlpg (%0)" :: "r"(address));
-				}
-				else if ((pte->raw & NP_ON_DEMAND) != 0) {
-					// do stuff with the swap file
-				}
-				pte->raw = 0;
-			}
-
-			VMemMapBlock vmmb = {
-				.virtualStart = reinterpret_cast<uint64_t>(ptr),
-				.availablePages = pages
-			};
+					pde->raw =
+						(PhysicalMemory::FilterAddress(page) & PDE_ADDRESS)
+						| PDE_READWRITE
+						| PDE_PRESENT;
 
-			if (ctx->availableBlockMemory == 0) {
-				auto status = expandVirtualMemoryMap(managementBase, ctx->storedBlocks);
-				if (status != StatusCode::SUCCESS) {
-					return status;
+					zeroPage(getPTAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset));
 				}
-				ctx->availableBlockMemory += PhysicalMemory::FRAME_SIZE;
 			}
 
-			VMemMapBlock* blockPtr = reinterpret_cast<VMemMapBlock*>(managementBase) + ctx->storedBlocks++;
-			*blockPtr = vmmb;
-			ctx->availableBlockMemory -= sizeof(VMemMapBlock);
-			ctx->availableMemory += pages * PhysicalMemory::FRAME_SIZE;
-			rsortVirtualMemoryMap(blockPtr, ctx->storedBlocks);
-
 			return StatusCode::SUCCESS;
 		}
 	}
 
+	uint64_t VirtToPhys(const void* address) {
+		const uint64_t linear = reinterpret_cast<uint64_t>(address);
+
+		if (linear >= VirtualMemoryLayout::DIRECT_MAP && linear < VirtualMemoryLayout::DIRECT_MAP + VirtualMemoryLayout::DIRECT_MAP_SIZE) {
+			return linear - VirtualMemoryLayout::DIRECT_MAP;
+		}
+
+		return translate(linear);
+	}
+
+	void* QueryZeroPage() {
+		return zeroPageFrame;
+	}
+
 	void UpdateSecondaryRecursiveMapping(void* newAddress) {
 		constexpr VirtualAddress secondaryMapping = parseVirtualAddress(VirtualMemoryLayout::SECONDARY_RECURSIVE_PML4);
 		PML4E* secondaryPML4 = getPML4EAddress(secondaryMapping.PML4_offset);
@@ -482,6 +1933,24 @@ namespace VirtualMemory {
 	}
 
 	StatusCode Setup() {
+		// every page table allocation zeroes its frame through the direct map, so it comes first
+		auto status = buildDirectMap();
+		if (status != StatusCode::SUCCESS) {
+			return status;
+		}
+
+		// the reference of the allocation is never dropped, so the zero frame outlives all of its mappings
+		zeroPageFrame = PhysicalMemory::AllocateZeroed();
+		if (zeroPageFrame == nullptr) {
+			return StatusCode::OUT_OF_MEMORY;
+		}
+		PhysicalMemory::UpdateFrameFlags(zeroPageFrame, PhysicalMemory::FRAME_PINNED, 0);
+
+		status = reserveGeneralMappingTables();
+		if (status != StatusCode::SUCCESS) {
+			return status;
+		}
+
 		// set up identity paging for the DMA zone
 		for (size_t i = VirtualMemoryLayout::DMA_ZONE;
 			i < VirtualMemoryLayout::DMA_ZONE + VirtualMemoryLayout::DMA_ZONE_SIZE;
@@ -502,17 +1971,19 @@ namespace VirtualMemory {
 			return StatusCode::OUT_OF_MEMORY;
 		}
 
-		auto status = mapPage(reinterpret_cast<uint64_t>(basePage), VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT, AccessPrivilege::HIGH);
+		status = mapPage(reinterpret_cast<uint64_t>(basePage), VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT, AccessPrivilege::HIGH);
 		if (status != StatusCode::SUCCESS) {
 			return status;
 		}
 
-		kernelContext.availableBlockMemory = PhysicalMemory::FRAME_SIZE - sizeof(VMemMapBlock);
-		kernelContext.storedBlocks = 1;
-
-		VMemMapBlock* kernelHeapBlockPtr = reinterpret_cast<VMemMapBlock*>(VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT);
-		kernelHeapBlockPtr->virtualStart = VirtualMemoryLayout::KERNEL_HEAP;
-		kernelHeapBlockPtr->availablePages = kernelContext.availableMemory / PhysicalMemory::FRAME_SIZE;
+		VMemRange* kernelHeapRange = reinterpret_cast<VMemRange*>(VirtualMemoryLayout::KERNEL_HEAP_MANAGEMENT);
+		initializeRanges(
+			&kernelContext,
+			kernelHeapRange,
+			kernelHeapRange,
+			VirtualMemoryLayout::KERNEL_HEAP,
+			kernelContext.availableMemory / PhysicalMemory::FRAME_SIZE
+		);
 
 		// setup a temporary main core dump in case a setup failure happens
 		basePage = PhysicalMemory::Allocate();
@@ -525,39 +1996,30 @@ namespace VirtualMemory {
 	}
 
 	StatusCode SetupTask(void* CR3) {
-		// setting up recursive paging in the PML4
-		PML4E* vroot = reinterpret_cast<PML4E*>(MapGeneralPage(CR3));
-		if (vroot == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
+		// the root is filled through the direct map, then edited through the secondary recursive mapping
+		PML4E* vroot = reinterpret_cast<PML4E*>(PhysToVirt(CR3));
+
+		// clearing entries that are not shared
+		for (size_t i = 0; i < 256; ++i) {
+			vroot[i].raw = 0;
 		}
+		vroot[511].raw = 0;
 
-		(vroot + 509)->raw = (vroot + 510)->raw = PML4E_XD
+		// copying shared kernel memory
+		for (size_t i = 256; i < 509; ++i) {
+			vroot[i].raw = getPML4EAddress(i)->raw;
+		}
+
+		// setting up recursive paging in the PML4
+		vroot[509].raw = vroot[510].raw = PML4E_XD
 			| (PhysicalMemory::FilterAddress(CR3) & PML4E_ADDRESS)
 			| PML4E_READWRITE
 			| PML4E_PRESENT;
 
-		auto status = UnmapGeneralPage(vroot);
-		if (status != StatusCode::SUCCESS) {
-			return status;
-		}
-
 		UpdateSecondaryRecursiveMapping(CR3);
 
-		// copying shared kernel memory
-		for (size_t i = 256; i < 509; ++i) {
-			volatile PML4E* current = getPML4EAddress(i);
-			PML4E* shared = getPML4EAddress<false>(i);
-
-			shared->raw = current->raw;
-		}
-		// clearing entries that are not shared
-		for (size_t i = 0; i < 256; ++i) {
-			getPML4EAddress<false>(i)->raw = 0;
-		}
-		getPML4EAddress<false>(511)->raw = 0;
-
 		// set up the kernel stack and the stack guard
-		status = mapOnDemand<false>(
+		auto status = mapOnDemand<false>(
 			reinterpret_cast<void*>(VirtualMemoryLayout::KERNEL_STACK_USABLE),
 			(VirtualMemoryLayout::KERNEL_STACK_USABLE_SIZE - PhysicalMemory::FRAME_SIZE) / PhysicalMemory::FRAME_SIZE,
 			AccessPrivilege::HIGH
@@ -573,13 +2035,22 @@ namespace VirtualMemory {
 		stackGuardPTE->raw = 0;
 		__asm__ volatile("invlpg (%0)" :: "r"(VirtualMemoryLayout::KERNEL_STACK_GUARD));
 
-		void* stackTop = PhysicalMemory::Allocate();
-		void* stackReserve = PhysicalMemory::Allocate();
+		// the stack top, the stack reserve and the user memory base page, then the two core dump zones which must start zeroed
+		void* taskPages[3];
+		void* dumpPages[2];
 
-		if (stackTop == nullptr || stackReserve == nullptr) {
+		if (PhysicalMemory::AllocateBatch(3, taskPages) != PhysicalMemory::StatusCode::SUCCESS) {
+			return StatusCode::OUT_OF_MEMORY;
+		}
+		if (PhysicalMemory::AllocateZeroedBatch(2, dumpPages) != PhysicalMemory::StatusCode::SUCCESS) {
+			PhysicalMemory::FreeBatch(3, taskPages);
 			return StatusCode::OUT_OF_MEMORY;
 		}
 
+		void* stackTop = taskPages[0];
+		void* stackReserve = taskPages[1];
+		void* basePage = taskPages[2];
+
 		status = mapPage<false>(
 			reinterpret_cast<uint64_t>(stackTop),
 			VirtualMemoryLayout::KERNEL_STACK_RESERVE - PhysicalMemory::FRAME_SIZE,
@@ -608,14 +2079,9 @@ namespace VirtualMemory {
 			return status;
 		}
 
-		// allocate two pages for the main and secondary core dump zones
-		void* mainDumpPage = PhysicalMemory::Allocate();
-		if (mainDumpPage == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
-
+		// map the main and secondary core dump zones
 		status = mapPage<false>(
-			reinterpret_cast<uint64_t>(mainDumpPage),
+			reinterpret_cast<uint64_t>(dumpPages[0]),
 			VirtualMemoryLayout::MAIN_CORE_DUMP,
 			AccessPrivilege::HIGH
 		);
@@ -623,24 +2089,8 @@ namespace VirtualMemory {
 			return status;
 		}
 
-		void* mappedDumpPage = MapGeneralPage(mainDumpPage);
-		if (mappedDumpPage == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
-		zeroPage(mappedDumpPage);
-
-		status = UnmapGeneralPage(mappedDumpPage);
-		if (status != StatusCode::SUCCESS) {
-			return status;
-		}
-
-		void* secondaryDumpPage = PhysicalMemory::Allocate();
-		if (secondaryDumpPage == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
-
 		status = mapPage<false>(
-			reinterpret_cast<uint64_t>(secondaryDumpPage),
+			reinterpret_cast<uint64_t>(dumpPages[1]),
 			VirtualMemoryLayout::SECONDARY_CORE_DUMP,
 			AccessPrivilege::HIGH
 		);
@@ -648,17 +2098,6 @@ namespace VirtualMemory {
 			return status;
 		}
 
-		mappedDumpPage = MapGeneralPage(secondaryDumpPage);
-		if (mappedDumpPage == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
-		zeroPage(mappedDumpPage);
-
-		status = UnmapGeneralPage(mappedDumpPage);
-		if (status != StatusCode::SUCCESS) {
-			return status;
-		}
-
 		// Map user stack, leaving one extra guard page, usable stack size: 0x1FF000 bytes, or 2 MB - 4 KB = 2,093,056 bytes
 		status = mapOnDemand<false>(
 			reinterpret_cast<void*>(VirtualMemoryLayout::USER_STACK + PhysicalMemory::FRAME_SIZE),
@@ -671,59 +2110,222 @@ namespace VirtualMemory {
 		}
 
 		// set up the user memory 
-		void* basePage = PhysicalMemory::Allocate();
-		if (basePage == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
-
 		status = mapPage<false>(reinterpret_cast<uint64_t>(basePage), VirtualMemoryLayout::USER_MEMORY_CONTEXT, AccessPrivilege::HIGH);
 		if (status != StatusCode::SUCCESS) {
 			return status;
 		}
 
-		void* vbasePage = MapGeneralPage(basePage);
-		if (vbasePage == nullptr) {
-			return StatusCode::OUT_OF_MEMORY;
-		}
-
+		void* vbasePage = PhysToVirt(basePage);
 		MemoryContext* newUserContext = reinterpret_cast<MemoryContext*>(vbasePage);
 
 		newUserContext->availableMemory = VirtualMemoryLayout::USER_MEMORY_SIZE - VirtualMemoryLayout::USER_STACK_SIZE;
-		newUserContext->availableBlockMemory = PhysicalMemory::FRAME_SIZE 
-			- sizeof(VMemMapBlock) 
-			- (VirtualMemoryLayout::USER_MEMORY_MANAGEMENT - VirtualMemoryLayout::USER_MEMORY_CONTEXT);
-		newUserContext->storedBlocks = 1;
 
-		VMemMapBlock* userMemoryBlockPtr = reinterpret_cast<VMemMapBlock*>(
+		// the node is written through the direct map, but linked at its address in the new task
+		VMemRange* userMemoryRange = reinterpret_cast<VMemRange*>(
 			reinterpret_cast<uint8_t*>(vbasePage) + (VirtualMemoryLayout::USER_MEMORY_MANAGEMENT - VirtualMemoryLayout::USER_MEMORY_CONTEXT)
 		);
-		userMemoryBlockPtr->virtualStart = VirtualMemoryLayout::USER_MEMORY;
-		userMemoryBlockPtr->availablePages = newUserContext->availableMemory / PhysicalMemory::FRAME_SIZE;
+		initializeRanges(
+			newUserContext,
+			userMemoryRange,
+			reinterpret_cast<VMemRange*>(VirtualMemoryLayout::USER_MEMORY_MANAGEMENT),
+			VirtualMemoryLayout::USER_MEMORY,
+			newUserContext->availableMemory / PhysicalMemory::FRAME_SIZE
+		);
+
+		return StatusCode::SUCCESS;
+	}
+
+	StatusCode CloneUserMemory(void* CR3) {
+		UpdateSecondaryRecursiveMapping(CR3);
+
+		// the ranges are copied eagerly: the context page SetupTask mapped, then every page of carved nodes
+		const VirtualAddress contextMapping = parseVirtualAddress(VirtualMemoryLayout::USER_MEMORY_CONTEXT);
+		const PTE* contextPTE = getPTEAddress<false>(contextMapping.PML4_offset, contextMapping.PDPT_offset, contextMapping.PD_offset, contextMapping.PT_offset);
+		copyPage(PhysToVirt(contextPTE->raw & PTE_ADDRESS), userContext);
+
+		const uint64_t managementEnd = userManagementEnd(userContext);
+		for (uint64_t address = VirtualMemoryLayout::USER_MEMORY_CONTEXT + PhysicalMemory::FRAME_SIZE; address < managementEnd; address += PhysicalMemory::FRAME_SIZE) {
+			void* page = PhysicalMemory::Allocate();
+			if (page == nullptr) {
+				return StatusCode::OUT_OF_MEMORY;
+			}
+
+			copyPage(PhysToVirt(page), reinterpret_cast<const void*>(address));
+
+			auto status = mapPage<false>(reinterpret_cast<uint64_t>(page), address, AccessPrivilege::HIGH);
+			if (status != StatusCode::SUCCESS) {
+				PhysicalMemory::Free(page);
+				return status;
+			}
+		}
+
+		// the frames of the allocations are shared, whichever task writes first gets the copy
+		return forEachUserAllocation(userContext, [](uint64_t address, uint64_t pages) {
+			ShareEntries share;
+			return walkRange<true, false>(address, pages, AccessPrivilege::LOW, &share);
+		});
+	}
+
+	StatusCode ReleaseUserMemory() {
+		auto status = forEachUserAllocation(userContext, [](uint64_t address, uint64_t pages) {
+			return unmapRange<AccessPrivilege::LOW>(address, pages);
+		});
+		if (status != StatusCode::SUCCESS) {
+			return status;
+		}
+
+		// the first node stays in the context page, the pages of the other nodes go back to the PMM
+		const uint64_t managementPages = (userManagementEnd(userContext) - VirtualMemoryLayout::USER_MEMORY_CONTEXT) / PhysicalMemory::FRAME_SIZE;
+		if (managementPages > 1) {
+			status = unmapRange<AccessPrivilege::HIGH>(VirtualMemoryLayout::USER_MEMORY_CONTEXT + PhysicalMemory::FRAME_SIZE, managementPages - 1);
+			if (status != StatusCode::SUCCESS) {
+				return status;
+			}
+		}
 
-		UnmapGeneralPage(vbasePage);
+		userContext->availableMemory = VirtualMemoryLayout::USER_MEMORY_SIZE - VirtualMemoryLayout::USER_STACK_SIZE;
+
+		VMemRange* userMemoryRange = reinterpret_cast<VMemRange*>(VirtualMemoryLayout::USER_MEMORY_MANAGEMENT);
+		initializeRanges(
+			userContext,
+			userMemoryRange,
+			userMemoryRange,
+			VirtualMemoryLayout::USER_MEMORY,
+			userContext->availableMemory / PhysicalMemory::FRAME_SIZE
+		);
 
 		return StatusCode::SUCCESS;
 	}
 
+	StatusCode DestroyAddressSpace(void* CR3) {
+		uint64_t currentCR3;
+		__asm__ volatile("mov %%cr3, %0" : "=r"(currentCR3));
+
+		if (CR3 == nullptr || (PhysicalMemory::FilterAddress(CR3) & PML4E_ADDRESS) == (currentCR3 & PML4E_ADDRESS)) {
+			return StatusCode::INVALID_PARAMETER;
+		}
+
+		UpdateSecondaryRecursiveMapping(CR3);
+		// the secondary view may still cache the structures of the address space it showed before
+		CPU::FlushTLB();
+
+		FrameBatch frames;
+		frames.count = 0;
+
+		ReleaseEntries release {
+			.frames = &frames
+		};
+
+		// the allocations are read from the allocator of the task, the management pages are only released with the process data
+		StatusCode status = forEachSecondaryUserAllocation([&release](uint64_t address, uint64_t pages) {
+			return walkRange<false, false>(address, pages, AccessPrivilege::LOW, &release);
+		});
+
+		const StatusCode stackStatus = walkRange<false, false>(VirtualMemoryLayout::USER_STACK, VirtualMemoryLayout::USER_STACK_SIZE / PhysicalMemory::FRAME_SIZE, AccessPrivilege::LOW, &release);
+		if (status == StatusCode::SUCCESS) {
+			status = stackStatus;
+		}
+
+		// the rest goes even when a walk stopped early, only the frames it did not reach are left behind
+
+		// the DMA zone and the task image keep their frames, only the tables private to the task go
+		for (uint64_t pml4Offset = 0; pml4Offset < PML4_ENTRIES / 2; ++pml4Offset) {
+			releaseSecondaryTables(pml4Offset, false, &frames);
+		}
+
+		// kernel stack, process context, core dumps and user memory management
+		releaseSecondaryTables(parseVirtualAddress(VirtualMemoryLayout::RUNTIME_PROCESS_DATA).PML4_offset, true, &frames);
+
+		// nothing may reach the structures through the secondary view once they are freed
+		UpdateSecondaryRecursiveMapping(reinterpret_cast<void*>(currentCR3 & PML4E_ADDRESS));
+		CPU::FlushTLB();
+
+		queueFrame(&frames, PhysicalMemory::FilterAddress(CR3) & PML4E_ADDRESS);
+		commitFrames(&frames);
+
+		return status;
+	}
+
+	uint64_t ReclaimUserPages(uint64_t pages) {
+		constexpr uint64_t userEnd = VirtualMemoryLayout::USER_MEMORY + VirtualMemoryLayout::USER_MEMORY_SIZE - VirtualMemoryLayout::USER_STACK_SIZE;
+		// the first turn may only clear accessed bits, the second one finds them clear, a hand starting midway needs one more
+		const uint64_t maximumTurns = userContext->reclaimCursor == VirtualMemoryLayout::USER_MEMORY ? 2 : 3;
+		uint64_t reclaimed = 0;
+		uint64_t turns = 0;
+
+		while (reclaimed < pages && turns < maximumTurns) {
+			ClockScan scan;
+			scan.count = 0;
+			scan.target = pages - reclaimed < RECLAIM_BATCH ? pages - reclaimed : RECLAIM_BATCH;
+			scan.next = userContext->reclaimCursor;
+			scan.swapFull = false;
+
+			// one page table at a time, so the scan stops close to where the batch filled up
+			forEachUserAllocation(userContext, [&scan](uint64_t address, uint64_t count) {
+				const uint64_t end = address + count * PhysicalMemory::FRAME_SIZE;
+
+				while (address < end && !scan.full()) {
+					const uint64_t next = nextBoundary(address, PDE_COVERAGE, end);
+					walkRange<true, false>(address, (next - address) / PhysicalMemory::FRAME_SIZE, AccessPrivilege::LOW, &scan);
+					address = next;
+				}
+
+				return StatusCode::SUCCESS;
+			}, userContext->reclaimCursor);
+
+			const bool stopped = scan.full();
+			const bool swapFull = scan.swapFull;
+
+			reclaimed += pageOut(&scan);
+
+			if (stopped && scan.next < userEnd) {
+				userContext->reclaimCursor = scan.next;
+			}
+			else {
+				userContext->reclaimCursor = VirtualMemoryLayout::USER_MEMORY;
+				++turns;
+			}
+
+			if (swapFull) {
+				break;
+			}
+		}
+
+		return reclaimed;
+	}
+
 	void* AllocateDMA(uint64_t pages) {
-		void* const allocated = PhysicalMemory::AllocateDMA(pages);
+		return AllocateDMA(pages, PhysicalMemory::FRAME_SIZE, 0);
+	}
+
+	void* AllocateDMA(uint64_t pages, uint64_t alignment, uint64_t boundary) {
+		void* const allocated = PhysicalMemory::AllocateDMA(pages, alignment, boundary);
 		if (allocated == nullptr) {
 			return nullptr;
 		}
 		
-		uint64_t address = reinterpret_cast<uint64_t>(allocated);
+		// the DMA zone is identity mapped
+		FrameFill fill {
+			.physicalAddress = reinterpret_cast<uint64_t>(allocated),
+			.attributes = PTE_READWRITE | PTE_PRESENT
+		};
 
-		for (size_t i = 0; i < pages; ++i, address += PhysicalMemory::FRAME_SIZE) {
-			if (mapPage(address, address, AccessPrivilege::MEDIUM) != StatusCode::SUCCESS) {
-				return nullptr;
-			}
+		if (walkRange<true, true>(reinterpret_cast<uint64_t>(allocated), pages, AccessPrivilege::MEDIUM, &fill) != StatusCode::SUCCESS) {
+			// the pages already mapped go first, nothing may reach them once they are handed out again
+			UnmapRange(allocated, pages);
+			PhysicalMemory::FreeDMA(allocated, pages);
+			return nullptr;
 		}
 
 		return allocated;
 	}
 
 	void* AllocateKernelHeap(uint64_t pages) {
-		return AllocateCore<AccessPrivilege::HIGH>(pages, nullptr);
+		return AllocateCore<AccessPrivilege::HIGH>(pages, nullptr, HeapBacking::LARGE_PAGES);
+	}
+
+	void* AllocateKernelHeap(uint64_t pages, HeapBacking backing) {
+		return AllocateCore<AccessPrivilege::HIGH>(pages, nullptr, backing);
 	}
 
 	void* AllocateUserPages(uint64_t pages) {
@@ -734,18 +2336,23 @@ namespace VirtualMemory {
 		return AllocateCore<AccessPrivilege::LOW, true>(pages, ptr);
 	}
 
+	// unmapped before they go back to the bitmap, so an allocation running meanwhile never gets pages which are still mapped
 	StatusCode FreeDMA(void* ptr, uint64_t pages) {
-		auto status = PhysicalMemory::FreeDMA(ptr, pages);
-		if (status != PhysicalMemory::StatusCode::SUCCESS) {
+		const uint64_t address = reinterpret_cast<uint64_t>(ptr);
+		if (address % PhysicalMemory::FRAME_SIZE != 0
+			|| address >= VirtualMemoryLayout::DMA_ZONE + VirtualMemoryLayout::DMA_ZONE_SIZE
+			|| pages > (VirtualMemoryLayout::DMA_ZONE + VirtualMemoryLayout::DMA_ZONE_SIZE - address) / PhysicalMemory::FRAME_SIZE
+		) {
 			return StatusCode::INVALID_PARAMETER;
 		}
 
-		uint64_t address = reinterpret_cast<uint64_t>(ptr);
+		auto status = UnmapRange(ptr, pages);
+		if (status != StatusCode::SUCCESS) {
+			return status;
+		}
 
-		for (size_t i = 0; i < pages; ++i, address += PhysicalMemory::FRAME_SIZE) {
-			VirtualAddress mapping = parseVirtualAddress(address);
-			PTE* pte = getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
-			pte->raw = 0;
+		if (PhysicalMemory::FreeDMA(ptr, pages) != PhysicalMemory::StatusCode::SUCCESS) {
+			return StatusCode::INVALID_PARAMETER;
 		}
 
 		return StatusCode::SUCCESS;
@@ -759,83 +2366,167 @@ namespace VirtualMemory {
 		return FreeCore<AccessPrivilege::LOW>(ptr, pages);
 	}
 
-	void* MapGeneralPage(void* pageAddress) {
-		constexpr uint64_t GP_PAGES = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS_SIZE / PhysicalMemory::FRAME_SIZE;
+	StatusCode MapRange(void* address, void* physicalAddress, uint64_t pages, uint64_t attributes) {
+		const uint64_t start = reinterpret_cast<uint64_t>(address);
 
-		uint64_t address = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS;
+		if (start % PhysicalMemory::FRAME_SIZE != 0
+			|| reinterpret_cast<uint64_t>(physicalAddress) % PhysicalMemory::FRAME_SIZE != 0
+			|| start + pages * PhysicalMemory::FRAME_SIZE < start
+		) {
+			return StatusCode::INVALID_PARAMETER;
+		}
 
-		for (size_t i = 0; i < GP_PAGES; ++i, address += PhysicalMemory::FRAME_SIZE) {
-			VirtualAddress mapping = parseVirtualAddress(address);
+		FrameFill fill {
+			.physicalAddress = reinterpret_cast<uint64_t>(physicalAddress),
+			.attributes = (attributes & ~PTE_ADDRESS) | PTE_PRESENT
+		};
 
-			PDPTE* pdpte = getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
+		const AccessPrivilege privilege = (attributes & PTE_USERMODE) != 0 ? AccessPrivilege::LOW : AccessPrivilege::HIGH;
 
-			if ((pdpte->raw & PDPTE_PRESENT) == 0) {
-				void* page = PhysicalMemory::Allocate();
-				if (page == nullptr) {
-					return nullptr;
-				}
-				pdpte->raw =
-					(PhysicalMemory::FilterAddress(page) & PDPTE_ADDRESS)
-					| PDPTE_READWRITE
-					| PDPTE_PRESENT;
+		if (privilege == AccessPrivilege::HIGH && CPU::IsSharedAddress(start)) {
+			fill.attributes |= PTE_GLOBAL;
+		}
 
-				PDE* pd = getPDAddress(mapping.PML4_offset, mapping.PDPT_offset);
-				zeroPage(pd);
-			}
+		return walkRange<true, true>(start, pages, privilege, &fill);
+	}
 
-			PDE* pde = getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
+	StatusCode UnmapRange(void* address, uint64_t pages) {
+		const uint64_t start = reinterpret_cast<uint64_t>(address);
 
-			if ((pde->raw & PDE_PRESENT) == 0) {
-				void* page = PhysicalMemory::Allocate();
-				if (page == nullptr) {
-					return nullptr;
-				}
-				pde->raw =
-					(PhysicalMemory::FilterAddress(page) & PDE_ADDRESS)
-					| PDE_READWRITE
-					| PDE_PRESENT;
+		if (start % PhysicalMemory::FRAME_SIZE != 0 || start + pages * PhysicalMemory::FRAME_SIZE < start) {
+			return StatusCode::INVALID_PARAMETER;
+		}
 
-				PTE* pt = getPTAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
-				zeroPage(pt);
-			}
+		Unmap<false> unmap {
+			.strict = false
+		};
 
-			PTE* pte = getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
+		auto status = walkRange<true, false>(start, pages, AccessPrivilege::HIGH, &unmap);
+		if (status == StatusCode::SUCCESS) {
+			releaseEmptyTables(start, pages);
+		}
 
-			if ((pte->raw & PTE_PRESENT) == 0) {
-				pte->raw = (PhysicalMemory::FilterAddress(pageAddress) & PTE_ADDRESS)
-					| PTE_READWRITE
-					| PTE_PRESENT;
+		return status;
+	}
 
-				__asm__ volatile("invlpg (%0)" :: "r"(address));
-				return reinterpret_cast<void*>(address);
+	StatusCode ProtectRange(void* address, uint64_t pages, uint64_t protection) {
+		const uint64_t start = reinterpret_cast<uint64_t>(address);
+
+		if (start % PhysicalMemory::FRAME_SIZE != 0
+			|| start + pages * PhysicalMemory::FRAME_SIZE < start
+			|| (protection & ~PROTECTION_FLAGS) != 0
+		) {
+			return StatusCode::INVALID_PARAMETER;
+		}
+
+		Protect protect {
+			.protection = protection
+		};
+
+		return walkRange<true, false>(start, pages, AccessPrivilege::HIGH, &protect);
+	}
+
+	void* MapGeneralPage(void* pageAddress) {
+		uint64_t slot = GENERAL_MAPPINGS_PAGES;
+
+		{
+			CPU::LockGuard guard(&generalMappingsLock);
+
+			for (uint64_t word = generalMappingsHint; word < GENERAL_MAPPINGS_WORDS; ++word) {
+				if (~generalMappings[word] != 0) {
+					const uint64_t bit = __builtin_ctzll(~generalMappings[word]);
+					generalMappings[word] |= static_cast<uint64_t>(1) << bit;
+					generalMappingsHint = word;
+					slot = word * 64 + bit;
+					break;
+				}
 			}
 		}
 
-		return nullptr;
+		if (slot == GENERAL_MAPPINGS_PAGES) {
+			return nullptr;
+		}
+
+		// the slot was flushed when it was last unmapped
+		const uint64_t address = GENERAL_MAPPINGS + slot * PhysicalMemory::FRAME_SIZE;
+		VirtualAddress mapping = parseVirtualAddress(address);
+		getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw =
+			(PhysicalMemory::FilterAddress(pageAddress) & PTE_ADDRESS)
+			| PTE_GLOBAL
+			| PTE_READWRITE
+			| PTE_PRESENT;
+
+		return reinterpret_cast<void*>(address);
 	}
 
 	StatusCode UnmapGeneralPage(void* vpage) {
-		VirtualAddress mapping = parseVirtualAddress(vpage);
+		const uint64_t address = reinterpret_cast<uint64_t>(vpage);
+		if (address < GENERAL_MAPPINGS
+			|| address >= GENERAL_MAPPINGS + GENERAL_MAPPINGS_PAGES * PhysicalMemory::FRAME_SIZE
+			|| address % PhysicalMemory::FRAME_SIZE != 0
+		) {
+			return StatusCode::INVALID_PARAMETER;
+		}
 
-		PML4E* pml4e = getPML4EAddress(mapping.PML4_offset);
-		if ((pml4e->raw & PML4E_PRESENT) == 0) {
+		const uint64_t slot = (address - GENERAL_MAPPINGS) / PhysicalMemory::FRAME_SIZE;
+		const uint64_t word = slot / 64;
+		const uint64_t bit = static_cast<uint64_t>(1) << (slot % 64);
+
+		CPU::LockGuard guard(&generalMappingsLock);
+
+		if ((generalMappings[word] & bit) == 0) {
 			return StatusCode::INVALID_PARAMETER;
 		}
 
-		PDPTE* pdpte = getPDPTEAddress(mapping.PML4_offset, mapping.PDPT_offset);
-		if ((pdpte->raw & PDPTE_PRESENT) == 0) {
+		VirtualAddress mapping = parseVirtualAddress(address);
+		getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw = 0;
+		CPU::FlushTLBPage(address);
+
+		generalMappings[word] &= ~bit;
+		if (word < generalMappingsHint) {
+			generalMappingsHint = word;
+		}
+
+		return StatusCode::SUCCESS;
+	}
+
+	void* MapLocalPage(void* pageAddress) {
+		const uint64_t cpu = CPU::currentIndex();
+		if (localMappingsDepth[cpu] == LOCAL_MAPPING_SLOTS) {
+			return nullptr;
+		}
+
+		// the slot was flushed when it was last unmapped
+		const uint64_t address = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS
+			+ (cpu * LOCAL_MAPPING_SLOTS + localMappingsDepth[cpu]++) * PhysicalMemory::FRAME_SIZE;
+		VirtualAddress mapping = parseVirtualAddress(address);
+		getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw =
+			(PhysicalMemory::FilterAddress(pageAddress) & PTE_ADDRESS)
+			| PTE_GLOBAL
+			| PTE_READWRITE
+			| PTE_PRESENT;
+
+		return reinterpret_cast<void*>(address);
+	}
+
+	StatusCode UnmapLocalPage(void* vpage) {
+		const uint64_t cpu = CPU::currentIndex();
+		if (localMappingsDepth[cpu] == 0) {
 			return StatusCode::INVALID_PARAMETER;
 		}
 
-		PDE* pde = getPDEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
-		if ((pde->raw & PDE_PRESENT) == 0) {
+		// only the last slot mapped can be released
+		const uint64_t address = VirtualMemoryLayout::GENERAL_PURPOSE_MAPPINGS
+			+ (cpu * LOCAL_MAPPING_SLOTS + localMappingsDepth[cpu] - 1) * PhysicalMemory::FRAME_SIZE;
+		if (reinterpret_cast<uint64_t>(vpage) != address) {
 			return StatusCode::INVALID_PARAMETER;
 		}
 
-		PTE* pte = getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
-		pte->raw = 0;
+		VirtualAddress mapping = parseVirtualAddress(address);
+		getPTEAddress(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset)->raw = 0;
+		CPU::FlushTLBPage(address);
 
-		__asm__ volatile("invlpg (%0)" :: "r"(vpage));
+		--localMappingsDepth[cpu];
 		return StatusCode::SUCCESS;
 	}
 
@@ -883,6 +2574,7 @@ namespace VirtualMemory {
 
 			if ((pte->raw & PTE_PRESENT) == 0) {
 				pte->raw = (PhysicalMemory::FilterAddress(configurationAddress) & PTE_ADDRESS)
+					| PTE_GLOBAL
 					| PTE_PCD
 					| PTE_PWT
 					| PTE_READWRITE
@@ -19,23 +19,44 @@ namespace {
 	constexpr VirtualMemory::VirtualAddress secondaryMapping = VirtualMemory::parseVirtualAddress(VirtualMemoryLayout::SECONDARY_RECURSIVE_PML4);
 	VirtualMemory::PML4E* secondaryPML4 = VirtualMemory::getPML4EAddress(secondaryMapping.PML4_offset);
 
+	// tasks which exited, linked by their next pointer until they are destroyed
+	static Multitasking::Task* exitedTasks = nullptr;
+
 	__attribute__((noinline)) static inline void* setupTaskPages() {
-		void* CR3 = PhysicalMemory::Allocate();
-		if (CR3 == nullptr) {
+		uint64_t remaining = taskImageSize;
+		uint64_t address = reinterpret_cast<uint64_t>(taskImageStartPtr);
+
+		if (address % VirtualMemory::PML4E_COVERAGE != 0) {
+			Panic::Panic("Kernel tasks code/data must be aligned on a 512 GB boundary");
+		}
+		else if (taskImageSize % VirtualMemory::PTE_COVERAGE != 0) {
+			Panic::Panic("Kernel tasks code/data size must be aligned on a KB boundary");
+		}
+
+		// the PML4 and the DMA PDPT and page directory, then one structure per level the task image only partially covers
+		void* tables[6];
+		uint64_t tableCount = 3;
+		uint64_t nextTable = 1;
+
+		tableCount += taskImageSize % VirtualMemory::PML4E_COVERAGE != 0 ? 1 : 0;
+		tableCount += taskImageSize % VirtualMemory::PDPTE_COVERAGE != 0 ? 1 : 0;
+		tableCount += taskImageSize % VirtualMemory::PDE_COVERAGE != 0 ? 1 : 0;
+
+		if (PhysicalMemory::AllocatePageTableBatch(tableCount, tables) != PhysicalMemory::StatusCode::SUCCESS) {
 			return nullptr;
 		}
 
+		void* CR3 = tables[0];
+
 		if (VirtualMemory::SetupTask(CR3) != VirtualMemory::StatusCode::SUCCESS) {
+			PhysicalMemory::FreeBatch(tableCount, tables);
 			return nullptr;
 		}
 		// secondary mapping is now set to CR3, all high memory kernel structures are now set up.
 
 		// DMA shared region
 
-		void* page = PhysicalMemory::Allocate();
-		if (page == nullptr) {
-			return nullptr;
-		}
+		void* page = tables[nextTable++];
 
 		VirtualMemory::PML4E* DMA_PML4E = VirtualMemory::getPML4EAddress<false>(0);
 		DMA_PML4E->raw = (PhysicalMemory::FilterAddress(page) & VirtualMemory::PML4E_ADDRESS)
@@ -43,10 +64,7 @@ namespace {
 			| (VirtualMemory::PML4E_READWRITE)
 			| (VirtualMemory::PML4E_PRESENT);
 
-		page = PhysicalMemory::Allocate();
-		if (page == nullptr) {
-			return nullptr;
-		}
+		page = tables[nextTable++];
 
 		VirtualMemory::PDPTE* DMA_PDPTE = VirtualMemory::getPDPTEAddress<false>(0, 0);
 		__asm__ volatile("invlpg (%0)" :: "r"(DMA_PDPTE));
@@ -55,41 +73,22 @@ namespace {
 			| (VirtualMemory::PDPTE_READWRITE)
 			| (VirtualMemory::PDPTE_PRESENT);
 
-		page = PhysicalMemory::Allocate();
-		if (page == nullptr) {
-			return nullptr;
-		}
-
 		/// TODO: allocate every single DMA Page Table (even if nothing is in it) at kernel start
 
-		VirtualMemory::PDE* DMA_PDE = VirtualMemory::getPDEAddress<false>(0, 0, 0);
-		__asm__ volatile("invlpg (%0)" :: "r"(DMA_PDE));
-		DMA_PDE->raw = (PhysicalMemory::FilterAddress(page) & VirtualMemory::PDE_ADDRESS)
-			| (VirtualMemory::PDE_USERMODE)
-			| (VirtualMemory::PDE_READWRITE)
-			| (VirtualMemory::PDE_PRESENT);
-
+		// the page tables of the DMA zone are shared, DestroyAddressSpace leaves them alone
 		constexpr uint64_t DMA_PTs = VirtualMemoryLayout::DMA_ZONE_SIZE / (VirtualMemory::PT_ENTRIES * VirtualMemory::PTE_COVERAGE);
 		static_assert(DMA_PTs < VirtualMemory::PD_ENTRIES, "Legacy DMA Zone is too large (the current size is larger than 1 GB)");
 
-		for (size_t i = 0; i < VirtualMemoryLayout::DMA_ZONE_SIZE / (VirtualMemory::PT_ENTRIES * VirtualMemory::PTE_COVERAGE); ++i) {
-			VirtualMemory::PTE* current = VirtualMemory::getPTEAddress(0, 0, 0, i);
-			VirtualMemory::PTE* shared = VirtualMemory::getPTEAddress<false>(0, 0, 0, i);
+		__asm__ volatile("invlpg (%0)" :: "r"(VirtualMemory::getPDAddress<false>(0, 0)));
+
+		for (size_t i = 0; i < DMA_PTs; ++i) {
+			VirtualMemory::PDE* current = VirtualMemory::getPDEAddress(0, 0, i);
+			VirtualMemory::PDE* shared = VirtualMemory::getPDEAddress<false>(0, 0, i);
 			shared->raw = current->raw;
 		}
 
 		// share the current kernel tasks space with the new one
 
-		uint64_t remaining = taskImageSize;
-		uint64_t address = reinterpret_cast<uint64_t>(taskImageStartPtr);
-
-		if (address % VirtualMemory::PML4E_COVERAGE != 0) {
-			Panic::Panic("Kernel tasks code/data must be aligned on a 512 GB boundary");
-		}
-		else if (taskImageSize % VirtualMemory::PTE_COVERAGE != 0) {
-			Panic::Panic("Kernel tasks code/data size must be aligned on a KB boundary");
-		}
-
 		while (remaining >= VirtualMemory::PML4E_COVERAGE) {
 			VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(address);
 			VirtualMemory::PML4E* current = VirtualMemory::getPML4EAddress(mapping.PML4_offset);
@@ -100,10 +99,7 @@ namespace {
 			remaining -= VirtualMemory::PML4E_COVERAGE;
 		}
 		if (remaining > 0) {
-			void* _pml4e_page = PhysicalMemory::Allocate();
-			if (_pml4e_page == nullptr) {
-				return nullptr;
-			}
+			void* _pml4e_page = tables[nextTable++];
 			VirtualMemory::VirtualAddress mapping = VirtualMemory::parseVirtualAddress(address);
 			VirtualMemory::PML4E* _pml4e = VirtualMemory::getPML4EAddress<false>(mapping.PML4_offset);
 			_pml4e->raw = (PhysicalMemory::FilterAddress(_pml4e_page) & VirtualMemory::PML4E_ADDRESS)
@@ -123,10 +119,7 @@ namespace {
 				remaining -= VirtualMemory::PDPTE_COVERAGE;
 			}
 			if (remaining > 0) {
-				void* _pdpte_page = PhysicalMemory::Allocate();
-				if (_pdpte_page == nullptr) {
-					return nullptr;
-				}
+				void* _pdpte_page = tables[nextTable++];
 				mapping = VirtualMemory::parseVirtualAddress(address);
 				VirtualMemory::PDPTE* _pdpte = VirtualMemory::getPDPTEAddress<false>(mapping.PML4_offset, mapping.PDPT_offset);
 				_pdpte->raw = (PhysicalMemory::FilterAddress(_pdpte_page) & VirtualMemory::PDPTE_ADDRESS)
@@ -146,10 +139,7 @@ namespace {
 					remaining -= VirtualMemory::PDE_COVERAGE;
 				}
 				if (remaining > 0) {
-					void* _pde_page = PhysicalMemory::Allocate();
-					if (_pde_page == nullptr) {
-						return nullptr;
-					}
+					void* _pde_page = tables[nextTable++];
 					mapping = VirtualMemory::parseVirtualAddress(address);
 					VirtualMemory::PDE* _pde = VirtualMemory::getPDEAddress<false>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset);
 					_pde->raw = (PhysicalMemory::FilterAddress(_pde_page) & VirtualMemory::PDE_ADDRESS)
@@ -181,10 +171,7 @@ namespace {
 		VirtualMemory::PTE* CtxPTE = VirtualMemory::getPTEAddress<false>(mapping.PML4_offset, mapping.PDPT_offset, mapping.PD_offset, mapping.PT_offset);
 
 		void* physicalFrame = reinterpret_cast<void*>(CtxPTE->raw & VirtualMemory::PTE_ADDRESS);
-		void* mappedFrame = VirtualMemory::MapGeneralPage(physicalFrame);
-		if (mappedFrame == nullptr) {
-			return nullptr;
-		}
+		void* mappedFrame = VirtualMemory::PhysToVirt(physicalFrame);
 
 		struct _TaskCtx {
 			void* InstructionPointer;
@@ -200,25 +187,17 @@ namespace {
 		TaskContext->RSP = reinterpret_cast<void*>(VirtualMemoryLayout::USER_STACK + VirtualMemoryLayout::USER_STACK_SIZE);
 		TaskContext->StackSelector = 0x23;
 
-		VirtualMemory::UnmapGeneralPage(mappedFrame);
-
 		return absoluteContextPtr;
 	}
-}
-
-namespace Multitasking {
-	Task* setupKernelTask(void* entryPointPtr) {
-		void* TaskCR3 = setupTaskPages();
-		if (TaskCR3 == nullptr) {
-			return nullptr;
-		}
 
+	// the secondary recursive mapping must still point to the new task root
+	__attribute__((noinline)) static inline Multitasking::Task* setupTask(void* TaskCR3, void* entryPointPtr) {
 		void* KernelStackPointer = setupTaskContext(entryPointPtr);
 		if (KernelStackPointer == nullptr) {
 			return nullptr;
 		}
 
-		Task* task = reinterpret_cast<Task*>(Heap::Allocate(sizeof(Task)));
+		Multitasking::Task* task = reinterpret_cast<Multitasking::Task*>(Heap::Allocate(sizeof(Multitasking::Task)));
 		if (task == nullptr) {
 			return nullptr;
 		}
@@ -226,9 +205,46 @@ namespace Multitasking {
 		task->prev = nullptr;
 		task->next = nullptr;
 		task->CR3 = TaskCR3;
+		task->AddressSpaceID = 0;
 		task->InstructionPointer = entryPointPtr;
 		task->KernelStackTop = KernelStackPointer;
-		task->TaskID = Task::taskCount();
+		task->TaskID = Multitasking::Task::nextTaskID();
+
+		return task;
+	}
+}
+
+namespace Multitasking {
+	Task* setupKernelTask(void* entryPointPtr) {
+		void* TaskCR3 = setupTaskPages();
+		if (TaskCR3 == nullptr) {
+			return nullptr;
+		}
+
+		Task* task = setupTask(TaskCR3, entryPointPtr);
+		if (task == nullptr) {
+			VirtualMemory::DestroyAddressSpace(TaskCR3);
+		}
+
+		return task;
+	}
+
+	Task* cloneKernelTask(void* entryPointPtr) {
+		void* TaskCR3 = setupTaskPages();
+		if (TaskCR3 == nullptr) {
+			return nullptr;
+		}
+
+		// a partial clone only holds references to what it shared so far, they are dropped with the rest
+		if (VirtualMemory::CloneUserMemory(TaskCR3) != VirtualMemory::StatusCode::SUCCESS) {
+			VirtualMemory::DestroyAddressSpace(TaskCR3);
+			return nullptr;
+		}
+
+		Task* task = setupTask(TaskCR3, entryPointPtr);
+		if (task == nullptr) {
+			VirtualMemory::DestroyAddressSpace(TaskCR3);
+		}
 
 		return task;
 	}
@@ -237,4 +253,56 @@ namespace Multitasking {
 		Task* task = setupKernelTask(entryPointPtr);
 		return Task::addTask(task);
 	}
+
+	StatusCode spawnKernelTask(void* entryPointPtr) {
+		Task* task = cloneKernelTask(entryPointPtr);
+		return Task::addTask(task);
+	}
+
+	StatusCode destroyKernelTask(Task* task) {
+		if (task == nullptr || task->prev != nullptr || task->next != nullptr) {
+			return StatusCode::INVALID_PARAMETER;
+		}
+
+		if (VirtualMemory::DestroyAddressSpace(task->CR3) != VirtualMemory::StatusCode::SUCCESS) {
+			return StatusCode::FAILED;
+		}
+
+		Heap::Free(task);
+		return StatusCode::SUCCESS;
+	}
+
+	Task* exitKernelTask() {
+		Task* task = Task::currentTask();
+		Task* next = Task::taskSwitch();
+
+		if (next == task) {
+			return nullptr;
+		}
+
+		if (Task::removeTask(task) != StatusCode::SUCCESS) {
+			Panic::Panic("Exited task is not in the task list\n\r");
+		}
+
+		task->next = exitedTasks;
+		exitedTasks = task;
+
+		return next;
+	}
+
+	bool reapKernelTask() {
+		Task* task = exitedTasks;
+		if (task == nullptr) {
+			return false;
+		}
+
+		exitedTasks = task->next;
+		task->next = nullptr;
+
+		if (destroyKernelTask(task) != StatusCode::SUCCESS) {
+			Panic::Panic("Failed to destroy an exited task\n\r");
+		}
+
+		return true;
+	}
 }
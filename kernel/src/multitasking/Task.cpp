@@ -6,17 +6,26 @@
 
 namespace Multitasking {
 	namespace {
-		static Task* currentTask = nullptr;
+		static Task* _currentTask = nullptr;
 		static uint64_t _taskCount = 0;
+		static uint64_t _nextTaskID = 0;
 	}
 
 	uint64_t Task::taskCount() {
 		return _taskCount;
 	}
 
+	uint64_t Task::nextTaskID() {
+		return _nextTaskID;
+	}
+
+	Task* Task::currentTask() {
+		return _currentTask;
+	}
+
 	StatusCode Task::addTask(Task* task) {
 		if (task == nullptr
-			|| task->TaskID != taskCount()
+			|| task->TaskID != nextTaskID()
 			|| task->prev != nullptr
 			|| task->next != nullptr
 			|| task->CR3 == nullptr
@@ -26,37 +35,65 @@ namespace Multitasking {
 			return StatusCode::INVALID_PARAMETER;
 		}
 
-		if (currentTask == nullptr) {
-			currentTask = task;
+		if (_currentTask == nullptr) {
+			_currentTask = task;
 		}
 		else {
-			task->prev = currentTask->prev;
+			task->prev = _currentTask->prev;
 
 			if (task->prev == nullptr) {
-				task->prev = currentTask;
+				task->prev = _currentTask;
 			}
 
 			task->prev->next = task;
 
-			task->next = currentTask;
+			task->next = _currentTask;
 
 			if (task->next == nullptr) {
-				task->next = currentTask;
+				task->next = _currentTask;
 			}
 			
 			task->next->prev = task;
 		}
 
 		++_taskCount;
+		++_nextTaskID;
+
+		return StatusCode::SUCCESS;
+	}
+
+	StatusCode Task::removeTask(Task* task) {
+		if (task == nullptr
+			|| task == _currentTask
+			|| task->prev == nullptr
+			|| task->next == nullptr
+		) {
+			return StatusCode::INVALID_PARAMETER;
+		}
+
+		// a task left alone is unlinked, like the first task added
+		if (task->prev == task->next) {
+			task->prev->prev = nullptr;
+			task->prev->next = nullptr;
+		}
+		else {
+			task->prev->next = task->next;
+			task->next->prev = task->prev;
+		}
+
+		task->prev = nullptr;
+		task->next = nullptr;
+
+		--_taskCount;
 
 		return StatusCode::SUCCESS;
 	}
 
 	Task* Task::taskSwitch() {
-		if (currentTask != nullptr && currentTask->next != nullptr) {
-			currentTask = currentTask->next;
+		if (_currentTask != nullptr && _currentTask->next != nullptr) {
+			_currentTask = _currentTask->next;
 		}
 
-		return currentTask;
+		return _currentTask;
 	}
 }